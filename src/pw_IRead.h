@@ -23,12 +23,17 @@
 
 #include <pwinterface.h>
 #include <glib.h>
+#include <sys/uio.h>		/* struct iovec */
 
 typedef gboolean pw_IRead_read(void *, void */*data*/, gsize, GError **);
+/* Optional: fill n buffers in turn.  See pwio_readv(). */
+typedef gboolean pw_IRead_readv(void *, const struct iovec *, guint /*n*/,
+				GError **);
 
 typedef struct {
   gsize size;
   pw_IRead_read *read;
+  pw_IRead_readv *readv;
 } pw_MIRead;
 
 typedef struct {
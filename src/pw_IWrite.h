@@ -23,14 +23,19 @@
 
 #include <pwinterface.h>
 #include <glib.h>
+#include <sys/uio.h>		/* struct iovec */
 
 typedef gboolean pw_IWrite_write(void *, const void *, gsize, GError **);
 typedef gboolean pw_IWrite_flush(void *, GError **);
+/* Optional: write n buffers as one.  See pwio_writev(). */
+typedef gboolean pw_IWrite_writev(void *, const struct iovec *, guint /*n*/,
+				  GError **);
 
 typedef struct {
   gsize size;
   pw_IWrite_write *write;
   pw_IWrite_flush *flush;
+  pw_IWrite_writev *writev;
 } pw_MIWrite;
 
 typedef struct {
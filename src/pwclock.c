@@ -0,0 +1,94 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Clocks to be given to timing code: a real clock, or a virtual
+ *	one which moves only when told to, so that simulations and
+ *	tests run as fast as they can and give the same result each
+ *	time.
+ *=======================================================================*/
+#include "pwutil.h"
+
+#define NSEC_PER_SEC 1000000000
+
+struct _PwClock {
+  gboolean manual;
+  clockid_t id;			/* Real */
+  guint64 now;			/* Virtual, in ns */
+};
+
+/* Real clock, e.g. CLOCK_MONOTONIC */
+PwClock *
+pwclock_new(clockid_t id)
+{
+  PwClock *self = g_new0(PwClock, 1);
+  self->id = id;
+  return self;
+}
+
+/* Virtual clock, starting at start_ns */
+PwClock *
+pwclock_new_virtual(guint64 start_ns)
+{
+  PwClock *self = g_new0(PwClock, 1);
+  self->manual = TRUE;
+  self->now = start_ns;
+  return self;
+}
+
+guint64
+pwclock_now(PwClock *self)
+{
+  struct timespec now;
+
+  if (self->manual) return __atomic_load_n(&self->now, __ATOMIC_ACQUIRE);
+  clock_gettime(self->id, &now);
+  return (guint64)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/* Whether the clock only moves when told, so cannot be slept on */
+gboolean
+pwclock_is_virtual(PwClock *self)
+{
+  return self->manual;
+}
+
+/* Move a virtual clock on; real clocks ignore this */
+void
+pwclock_advance(PwClock *self, guint64 ns)
+{
+  if (self->manual) __atomic_add_fetch(&self->now, ns, __ATOMIC_ACQ_REL);
+}
+
+/* Set a virtual clock, which never goes back */
+void
+pwclock_set(PwClock *self, guint64 ns)
+{
+  guint64 now;
+
+  if (! self->manual) return;
+  now = __atomic_load_n(&self->now, __ATOMIC_RELAXED);
+  while (ns > now &&
+	 ! __atomic_compare_exchange_n(&self->now, &now, ns, TRUE,
+				       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) ;
+}
+
+void
+pwclock_free(PwClock *self)
+{
+  g_free(self);
+}
@@ -0,0 +1,148 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Detect CPU features to select accelerated code at run time
+ *=======================================================================*/
+#include "pwutil.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#  define PWCPU_X86 1
+#  include <cpuid.h>
+#elif defined(__arm__) || defined(__aarch64__)
+#  define PWCPU_ARM 1
+#  include <sys/auxv.h>
+#  if defined(__aarch64__) && ! defined(HWCAP_ASIMD)
+#    define HWCAP_ASIMD (1 << 1)
+#  endif
+#  if defined(__arm__) && ! defined(HWCAP_NEON)
+#    define HWCAP_NEON (1 << 12)
+#  endif
+#endif
+
+/* Names accepted in PWUTIL_FORCE_ISA, each with the features it allows */
+static const struct {
+  const gchar *name;
+  PwCpuFeatures features;
+} pwcpu_isas[] = {
+  {"c",      0},
+  {"sse2",   PWCPU_SSE2},
+  {"ssse3",  PWCPU_SSE2 | PWCPU_SSSE3},
+  {"sse4.1", PWCPU_SSE2 | PWCPU_SSSE3 | PWCPU_SSE41},
+  {"avx2",   PWCPU_SSE2 | PWCPU_SSSE3 | PWCPU_SSE41 | PWCPU_AVX2},
+  {"neon",   PWCPU_NEON},
+};
+
+static PwCpuFeatures pwcpu_detected;
+static PwCpuFeatures pwcpu_enabled;
+static gsize pwcpu_inited = 0;
+
+/*-----------------------------------------------------------------------
+ *	Ask the hardware (and OS) what is supported
+ *-----------------------------------------------------------------------*/
+static PwCpuFeatures
+_pwcpu_detect(void)
+{
+  PwCpuFeatures features = 0;
+#if defined(PWCPU_X86)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (edx & bit_SSE2) features |= PWCPU_SSE2;
+    if (ecx & bit_SSSE3) features |= PWCPU_SSSE3;
+    if (ecx & bit_SSE4_1) features |= PWCPU_SSE41;
+    /* AVX state must also be enabled by the OS */
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+      unsigned int xcr0, xcr0_hi;
+      __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+      if ((xcr0 & 6) == 6 &&
+	  __get_cpuid_max(0, NULL) >= 7) {
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (ebx & bit_AVX2) features |= PWCPU_AVX2;
+      }
+    }
+  }
+#elif defined(PWCPU_ARM)
+  unsigned long hwcap = getauxval(AT_HWCAP);
+#  if defined(__aarch64__)
+  if (hwcap & HWCAP_ASIMD) features |= PWCPU_NEON;
+#  else
+  if (hwcap & HWCAP_NEON) features |= PWCPU_NEON;
+#  endif
+#endif
+  return features;
+}
+
+/*-----------------------------------------------------------------------
+ *	Detect once, applying any limit from the environment
+ *-----------------------------------------------------------------------*/
+static void
+_pwcpu_init(void)
+{
+  if (g_once_init_enter(&pwcpu_inited)) {
+    const gchar *force = g_getenv("PWUTIL_FORCE_ISA");
+    pwcpu_detected = _pwcpu_detect();
+    pwcpu_enabled = pwcpu_detected;
+    if (force != NULL && force[0] != '\0') {
+      guint i;
+      for (i=0; i < G_N_ELEMENTS(pwcpu_isas); i++) {
+	if (g_ascii_strcasecmp(force, pwcpu_isas[i].name) == 0) {
+	  /* Can only take away, never claim what is not there */
+	  pwcpu_enabled &= pwcpu_isas[i].features;
+	  break;
+	}
+      }
+      if (i == G_N_ELEMENTS(pwcpu_isas)) {
+	g_warning("Unknown PWUTIL_FORCE_ISA \"%s\" ignored", force);
+      }
+    }
+    g_once_init_leave(&pwcpu_inited, 1);
+  }
+}
+
+#ifdef __GNUC__
+/* Run at load so that the first hot call does not pay for it */
+static void _pwcpu_load(void) __attribute__((constructor));
+static void
+_pwcpu_load(void)
+{
+  _pwcpu_init();
+}
+#endif
+
+/* Features which may be used */
+PwCpuFeatures
+pwcpu_features(void)
+{
+  _pwcpu_init();
+  return pwcpu_enabled;
+}
+
+/* Name of the best instruction set which may be used, e.g. "avx2" */
+const gchar *
+pwcpu_isa_name(void)
+{
+  const gchar *name = pwcpu_isas[0].name;
+  guint i;
+  _pwcpu_init();
+  for (i=0; i < G_N_ELEMENTS(pwcpu_isas); i++) {
+    if (pwcpu_isas[i].features != 0 &&
+	(pwcpu_isas[i].features & ~pwcpu_enabled) == 0) {
+      name = pwcpu_isas[i].name;
+    }
+  }
+  return name;
+}
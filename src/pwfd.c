@@ -0,0 +1,238 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Scatter-gather reads and writes through pw_IRead and pw_IWrite,
+ *	and both on a file descriptor.
+ *
+ *	writev and readv were added to the interfaces later, so PW_CAN
+ *	tells whether an implementation has them; if not, the helpers
+ *	here make one call per buffer.
+ *
+ *	A socket is written with sendmsg() and MSG_NOSIGNAL, so that a
+ *	peer going away is an error rather than SIGPIPE.
+ *=======================================================================*/
+#include "pwutil.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+gboolean
+pwio_writev(const pw_IWrite *iface, const struct iovec *iov, guint n,
+	    GError **error)
+{
+  guint i;
+
+  if (PW_CAN(iface, writev)) return PW_CALL(iface, writev, iov, n, error);
+  for (i=0; i < n; i++) {
+    if (iov[i].iov_len == 0) continue;
+    if (! PW_CALL(iface, write, iov[i].iov_base, iov[i].iov_len, error)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+gboolean
+pwio_readv(const pw_IRead *iface, const struct iovec *iov, guint n,
+	   GError **error)
+{
+  guint i;
+
+  if (PW_CAN(iface, readv)) return PW_CALL(iface, readv, iov, n, error);
+  for (i=0; i < n; i++) {
+    if (iov[i].iov_len == 0) continue;
+    if (! PW_CALL(iface, read, iov[i].iov_base, iov[i].iov_len, error)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	File descriptor
+ *-----------------------------------------------------------------------*/
+struct _PwFd {
+  pw_IWrite iwrite;
+  pw_IRead iread;
+  int fd;
+  gboolean socket;
+};
+
+static gboolean
+_pwfd_error(GError **error, const char *what)
+{
+  int err = errno;
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+	      "%s: %s", what, g_strerror(err));
+  return FALSE;
+}
+
+/* Write or read count buffers once */
+static ssize_t
+_pwfd_once(PwFd *self, gboolean out, struct iovec *iov, guint count)
+{
+#ifdef MSG_NOSIGNAL
+  if (out && self->socket) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(self->fd, &msg, MSG_NOSIGNAL);
+  }
+#endif
+  return out ? writev(self->fd, iov, count) : readv(self->fd, iov, count);
+}
+
+/* All of the buffers, however many calls it takes.  iov is changed. */
+static gboolean
+_pwfd_transfer(PwFd *self, gboolean out, struct iovec *iov, guint n,
+	       GError **error)
+{
+  for (;;) {
+    guint count;
+    ssize_t done;
+
+    /* Nothing left but empty buffers is done, not end of file */
+    while (n > 0 && iov->iov_len == 0) {
+      iov++;
+      n--;
+    }
+    if (n == 0) break;
+    count = MIN(n, IOV_MAX);
+    done = _pwfd_once(self, out, iov, count);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return _pwfd_error(error, out ? "writev" : "readv");
+    }
+    if (done == 0 && ! out) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "readv: Unexpected end of file");
+      return FALSE;
+    }
+    /* Step past what was done */
+    while (n > 0 && (gsize)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (done > 0) {
+      iov->iov_base = (guint8 *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return TRUE;
+}
+
+/* On a copy of the vector, as it is changed; on the stack if short */
+static gboolean
+_pwfd_transferv(PwFd *self, gboolean out, const struct iovec *iov, guint n,
+		GError **error)
+{
+  struct iovec local[8];
+  struct iovec *copy = (n <= G_N_ELEMENTS(local)) ? local :
+    g_new(struct iovec, n);
+  gboolean ok;
+
+  memcpy(copy, iov, n * sizeof *iov);
+  ok = _pwfd_transfer(self, out, copy, n, error);
+  if (copy != local) g_free(copy);
+  return ok;
+}
+
+static gboolean
+_pwfd_write(void *priv, const void *data, gsize len, GError **error)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  return _pwfd_transfer(priv, TRUE, &iov, 1, error);
+}
+
+static gboolean
+_pwfd_writev(void *priv, const struct iovec *iov, guint n, GError **error)
+{
+  return _pwfd_transferv(priv, TRUE, iov, n, error);
+}
+
+static gboolean
+_pwfd_read(void *priv, void *data, gsize len, GError **error)
+{
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = len;
+  return _pwfd_transfer(priv, FALSE, &iov, 1, error);
+}
+
+static gboolean
+_pwfd_readv(void *priv, const struct iovec *iov, guint n, GError **error)
+{
+  return _pwfd_transferv(priv, FALSE, iov, n, error);
+}
+
+static const pw_MIWrite pwfd_miwrite = {
+  sizeof(pwfd_miwrite),
+  &_pwfd_write,
+  NULL,
+  &_pwfd_writev,
+};
+
+static const pw_MIRead pwfd_miread = {
+  sizeof(pwfd_miread),
+  &_pwfd_read,
+  &_pwfd_readv,
+};
+
+PwFd *
+pwfd_new(int fd)
+{
+  PwFd *self = g_new0(PwFd, 1);
+  struct stat st;
+
+  self->iwrite.methods = &pwfd_miwrite;
+  self->iwrite.priv = self;
+  self->iread.methods = &pwfd_miread;
+  self->iread.priv = self;
+  self->fd = fd;
+  self->socket = (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode));
+  return self;
+}
+
+const pw_IWrite *
+pwfd_iwrite(PwFd *self)
+{
+  return &self->iwrite;
+}
+
+const pw_IRead *
+pwfd_iread(PwFd *self)
+{
+  return &self->iread;
+}
+
+void
+pwfd_free(PwFd *self)
+{
+  g_free(self);
+}
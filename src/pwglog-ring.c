@@ -0,0 +1,121 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Show the lines a pwglog ring file still holds, oldest first.
+ *	With --no-time, just the lines as written to stderr.
+ *=======================================================================*/
+#include "pwglog_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static gboolean
+_show_ring(const gchar *filename, gboolean show_time)
+{
+  PwGLogRingHeader header;
+  GError *error = NULL;
+  const guint8 *ring;
+  guint64 mask, pos, head;
+  gchar *data;
+  gsize len;
+
+  if (! g_file_get_contents(filename, &data, &len, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+  memcpy(&header, data, MIN(len, sizeof header));
+  if (len < PWGLOG_RING_HEADER ||
+      memcmp(header.magic, PWGLOG_RING_MAGIC, 8) != 0) {
+    g_printerr("%s: Not a pwglog ring\n", filename);
+    g_free(data);
+    return FALSE;
+  }
+  if (header.byte_order != PWGLOG_RING_BYTE_ORDER ||
+      header.version != PWGLOG_RING_VERSION ||
+      header.ring_size == 0 || (header.ring_size & (header.ring_size - 1)) ||
+      len < PWGLOG_RING_HEADER + header.ring_size) {
+    g_printerr("%s: Unknown or truncated pwglog ring\n", filename);
+    g_free(data);
+    return FALSE;
+  }
+
+  ring = (const guint8 *)data + PWGLOG_RING_HEADER;
+  mask = header.ring_size - 1;
+  head = header.head;
+  pos = (head > header.ring_size) ? head - header.ring_size : 0;
+  while (pos + sizeof(PwGLogRingRecord) <= head) {
+    gsize off = pos & mask;
+    gsize room = mask + 1 - off;
+    PwGLogRingRecord rec;
+    const gchar *text;
+
+    if (room < sizeof rec) {
+      pos += room;
+      continue;
+    }
+    memcpy(&rec, ring + off, sizeof rec);
+    /* Overwritten, or not the start of a record */
+    if (rec.pos != pos) {
+      pos += 8;
+      continue;
+    }
+    if (rec.size == 0) {
+      pos += room;
+      continue;
+    }
+    text = (const gchar *)ring + off + sizeof rec;
+    if (rec.size <= sizeof rec || rec.size > room ||
+	text[rec.size - sizeof rec - 1] != '\0') {
+      pos += 8;
+      continue;
+    }
+    if (show_time) {
+      time_t sec = rec.time / G_USEC_PER_SEC;
+      struct tm tm;
+      gchar when[32];
+      localtime_r(&sec, &tm);
+      strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tm);
+      printf("%s.%06d ", when, (int)(rec.time % G_USEC_PER_SEC));
+    }
+    printf("%s\n", text);
+    pos += PWGLOG_RING_ALIGN(rec.size);
+  }
+  g_free(data);
+  return TRUE;
+}
+
+int
+main(int argc, char *argv[])
+{
+  gboolean show_time = TRUE;
+  int first = 1, i, rc = 0;
+
+  if (argc > 1 && strcmp(argv[1], "--no-time") == 0) {
+    show_time = FALSE;
+    first = 2;
+  }
+  if (first >= argc) {
+    g_printerr("Usage: %s [--no-time] RINGFILE...\n", argv[0]);
+    return 2;
+  }
+  for (i=first; i < argc; i++) {
+    if (! _show_ring(argv[i], show_time)) rc = 1;
+  }
+  return rc;
+}
@@ -17,11 +17,50 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  *-----------------------------------------------------------------------
  *	Sensible log output for glib
+ *
+ *	In async mode the handler formats each message into a slot of a
+ *	bounded queue (after Vyukov's array queue) and a writer thread
+ *	does the output, so a stalled syslog or terminal cannot hold up
+ *	the thread logging.  Fatal messages are still written at once.
+ *
+ *	Each thread keeps the levels of the domains it has logged to,
+ *	thrown away when a generation count shows the settings changed.
+ *
+ *	Domains may be rate limited with a token bucket for each place
+ *	logging to them, if known (as pwglog_writer is told), otherwise
+ *	one for the domain.  Each bucket also folds repeats of its last
+ *	message into a count, as syslogd does.  What was held back is
+ *	reported with the next message written, at most every
+ *	PWGLOG_REPORT_USEC, or by a thread of its own if no message
+ *	comes, so the count from the end of a storm is not lost.
+ *
+ *	The journal destination sends each message to journald as
+ *	separate fields, in the native protocol: one datagram put
+ *	together from an iovec per piece, or a sealed memfd when too
+ *	big for a datagram.  If journald cannot be reached the message
+ *	goes to syslog instead.
+ *
+ *	The ring destination appends lines to a fixed-size file, mapped
+ *	into memory, so writing one costs a copy.  A thread of its own
+ *	calls msync() now and then on the pages written since, so they
+ *	go to the disk together.  Choosing another destination unmaps
+ *	the file and stops the thread.  pwglog-ring shows the lines.
  *=======================================================================*/
+#define _GNU_SOURCE		/* For memfd_create */
 #include "pwutil.h"
+#include "pwglog_file.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #ifdef __GNUC__
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
@@ -31,9 +70,35 @@
 
 #define LEVELS_UP_TO(l) (((l) | ((l) - 1)) & G_LOG_LEVEL_MASK)
 
+/* Marks a cached entry, as domain levels may be 0 */
+#define LEVELS_CACHED	G_LOG_FLAG_RECURSION
+
+/* How often to report messages held back, and to look for any
+ * no later message has reported */
+#define PWGLOG_REPORT_USEC	(10 * G_USEC_PER_SEC)
+#define PWGLOG_HELD_USEC	G_USEC_PER_SEC
+
+/* Longest message kept in async mode, and its domain and source */
+#define PWGLOG_SLOT_TEXT	256
+#define PWGLOG_SLOT_NAME	48
+/* How often the writer thread looks for messages */
+#define PWGLOG_WRITER_USEC	5000
+/* How long a blocked caller waits before looking again */
+#define PWGLOG_BLOCK_USEC	1000
+
+#define PWGLOG_JOURNAL_SOCKET	"/run/systemd/journal/socket"
+/* Smallest ring and default time between msync() calls */
+#define PWGLOG_RING_MIN		4096
+#define PWGLOG_RING_SYNC_MSEC	5000
+
+/* Most fields sent to the journal */
+#define PWGLOG_JOURNAL_FIELDS	10
+
 typedef enum {
   DEST_STDERR,
-  DEST_SYSLOG
+  DEST_SYSLOG,
+  DEST_JOURNAL,
+  DEST_RING
 } PwGLogDest;
 
 typedef struct {
@@ -53,26 +118,387 @@ static PwGLog _pwglog = {
   LEVELS_UP_TO(G_LOG_LEVEL_WARNING),
 };
 
+/* Rate limit and repeats for one place logging, or as set for a
+ * domain */
+typedef struct {
+  gchar *domain;		/* Of the place, to report in */
+  gdouble rate;			/* Messages per second */
+  gdouble burst;
+  gdouble tokens;
+  gint64 time;			/* When tokens last added */
+  guint suppressed;		/* Over the limit */
+  GLogLevelFlags suppressed_level; /* Of the last of them */
+  gint64 reported;		/* When suppressed last written */
+  guint last;			/* Hash of last message written */
+  GLogLevelFlags last_level;	/* Of last, or 0 if none */
+  guint repeats;		/* Of last, not written */
+  gint64 repeat_since;
+} PwGLogLimit;
+
+/* What a limited domain held back, to be written now */
+typedef struct {
+  guint repeats;
+  GLogLevelFlags repeat_level;
+  guint suppressed;
+} PwGLogHeld;
+
+/* One message to write */
+typedef struct {
+  GLogLevelFlags level;
+  const gchar *domain;		/* May be NULL, as may the rest */
+  const gchar *message;
+  const gchar *file;		/* Where logged, if known */
+  const gchar *line;
+  const gchar *func;
+  guint64 frame;
+} PwGLogMsg;
+
+/* Message waiting to be written; empty strings for NULL */
+typedef struct {
+  gsize seq;			/* Whose turn, as in Vyukov's queue */
+  GLogLevelFlags level;
+  guint64 frame;
+  gchar domain[PWGLOG_SLOT_NAME];
+  gchar file[PWGLOG_SLOT_NAME];
+  gchar line[8];
+  gchar func[PWGLOG_SLOT_NAME];
+  gchar text[PWGLOG_SLOT_TEXT];
+} PwGLogSlot;
+
+typedef struct {
+  PwGLogSlot *slots;
+  gsize mask;			/* Number of slots - 1 */
+  PwGLogOverflow overflow;
+  gsize head __attribute__((aligned(64)));	/* Next to fill */
+  gsize tail __attribute__((aligned(64)));	/* Next to write */
+  guint dropped;
+  GMutex drain_lock;		/* One drain at a time, for order */
+  guint reported;		/* Value of dropped already written */
+  gboolean stop;
+  GThread *writer;
+} PwGLogQueue;
+
+static PwGLogQueue *_queue = NULL;	/* Set while in async mode */
+static gint _queue_users = 0;	/* Threads which may have loaded it */
+static gint _queue_stopping = 0;	/* Until what it held is written */
+
+/* Ring file mapped for writing */
+typedef struct {
+  guint8 *map;
+  gsize map_size;
+  PwGLogRingHeader *header;
+  guint8 *ring;
+  guint64 mask;			/* Ring size - 1 */
+  guint64 synced;		/* Head when last synced */
+} PwGLogRing;
+
+/* Levels by domain, for one thread */
+typedef struct {
+  guint gen;			/* Of settings cached */
+  GHashTable *levels;
+} PwGLogCache;
+
+static void _pwglog_cache_free(gpointer);
+
 static gboolean _syslog_opened = FALSE;
-static gboolean _inited = FALSE;
+static gsize _inited = 0;
 static PwGLogConfig *_pwglog_configs = NULL;
+static GMutex pwglog_lock;	/* For configs */
+static guint _pwglog_gen = 1;	/* Changed with settings */
+static GPrivate _pwglog_cache = G_PRIVATE_INIT(_pwglog_cache_free);
+static GMutex pwglog_limit_lock;
+static GHashTable *_pwglog_limits = NULL;	/* Domain to PwGLogLimit */
+static PwGLogLimit *_pwglog_default_limit = NULL;
+static GHashTable *_pwglog_buckets = NULL;	/* Place to PwGLogLimit */
+static gboolean _pwglog_limiting = FALSE;	/* Any limits set */
+static gboolean _pwglog_held_running = FALSE;	/* Thread below */
+static GCond _pwglog_held_wake;
+static int _journal_fd = -1;	/* Connected to journald */
+static const gchar *_pwglog_tile = NULL;
+static guint64 _pwglog_frame = 0;
+static PwGLogRing *_ring = NULL;
+static GMutex pwglog_ring_lock;	/* For writing to _ring */
+static GMutex pwglog_sync_lock;	/* For msync() or munmap(), and: */
+static GCond _ring_wake;
+static guint _ring_sync_usec;
+static GThread *_ring_syncer = NULL;
+static gboolean _ring_stop = FALSE;
+
+/* Levels enabled in any domain, so PWGLOG_ENABLED can be quick.
+ * Everything until G_DEBUG has been read. */
+GLogLevelFlags pwglog_any_levels = G_LOG_LEVEL_MASK;
+
+static void _pwglog_init(void);
+static void _pwglog_changed(void);
+static void _pwglog_add_config(const gchar *, GLogLevelFlags);
+static PwGLogConfig *_pwglog_find_config(const gchar *);
+static GLogLevelFlags _pwglog_domain_levels(const gchar *);
+static void _pwglog_set_limit(const gchar *, gdouble, guint);
+static gpointer _pwglog_held(gpointer);
+static void _ring_close(void);
+
+/* Direct all messages to stderr, as at first */
+void
+pwglog_to_stderr(void)
+{
+  _pwglog.dest = DEST_STDERR;
+  _ring_close();
+}
 
 /* Direct all messages to syslog */
 void
 pwglog_to_syslog(void)
 {
   _pwglog.dest = DEST_SYSLOG;
+  _ring_close();
+}
+
+/* Send messages to journald, at path if not the usual socket.  If
+ * it cannot be reached, send them to syslog. */
+gboolean
+pwglog_to_journal(const gchar *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (path == NULL) path = PWGLOG_JOURNAL_SOCKET;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    pwglog_to_syslog();
+    return FALSE;
+  }
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    pwglog_to_syslog();
+    return FALSE;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    close(fd);
+    pwglog_to_syslog();
+    return FALSE;
+  }
+  if (_journal_fd >= 0) close(_journal_fd);
+  _journal_fd = fd;
+  _pwglog.dest = DEST_JOURNAL;
+  _ring_close();
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Append messages to a ring of size bytes (rounded up to a power
+ *	of 2) mapped from filename, calling msync() every sync_msec
+ *	(0 for the default) if anything was written.  A ring file of
+ *	the same size carries on where it left off.
+ *-----------------------------------------------------------------------*/
+
+/* msync() the pages holding bytes from start to end of the map */
+static void
+_ring_msync(PwGLogRing *self, gsize start, gsize end)
+{
+  gsize page = sysconf(_SC_PAGESIZE);
+  start &= ~(page - 1);
+  msync(self->map + start, end - start, MS_SYNC);
+}
+
+/* Sync what was written since last time, under pwglog_sync_lock */
+static void
+_ring_flush(PwGLogRing *self)
+{
+  guint64 head = __atomic_load_n(&self->header->head, __ATOMIC_ACQUIRE);
+  gsize from = PWGLOG_RING_HEADER + (self->synced & self->mask);
+  gsize to = PWGLOG_RING_HEADER + (head & self->mask);
+
+  if (head == self->synced) return;
+  if (head - self->synced >= self->mask + 1) {
+    _ring_msync(self, PWGLOG_RING_HEADER, self->map_size);
+  } else if (from < to) {
+    _ring_msync(self, from, to);
+  } else {
+    /* Wrapped round */
+    _ring_msync(self, from, self->map_size);
+    if (to > PWGLOG_RING_HEADER) _ring_msync(self, PWGLOG_RING_HEADER, to);
+  }
+  /* The header last, so its head never runs ahead of the lines */
+  _ring_msync(self, 0, sizeof *self->header);
+  self->synced = head;
+}
+
+static void
+_ring_free(PwGLogRing *self)
+{
+  _ring_flush(self);
+  munmap(self->map, self->map_size);
+  g_free(self);
+}
+
+static gpointer
+_ring_sync(gpointer UNUSED(data))
+{
+  g_mutex_lock(&pwglog_sync_lock);
+  while (! _ring_stop) {
+    PwGLogRing *self;
+    g_cond_wait_until(&_ring_wake, &pwglog_sync_lock, g_get_monotonic_time() +
+		      g_atomic_int_get(&_ring_sync_usec));
+    self = g_atomic_pointer_get(&_ring);
+    if (self != NULL) _ring_flush(self);
+  }
+  g_mutex_unlock(&pwglog_sync_lock);
+  return NULL;
+}
+
+/* Stop writing to the ring, if any, syncing what it has */
+static void
+_ring_close(void)
+{
+  PwGLogRing *old;
+  GThread *syncer;
+
+  g_mutex_lock(&pwglog_ring_lock);
+  old = _ring;
+  g_atomic_pointer_set(&_ring, NULL);
+  syncer = _ring_syncer;
+  _ring_syncer = NULL;
+  g_mutex_unlock(&pwglog_ring_lock);
+  if (syncer == NULL) return;
+
+  g_mutex_lock(&pwglog_sync_lock);
+  _ring_stop = TRUE;
+  g_cond_signal(&_ring_wake);
+  g_mutex_unlock(&pwglog_sync_lock);
+  g_thread_join(syncer);
+  g_mutex_lock(&pwglog_sync_lock);
+  _ring_stop = FALSE;
+  if (old != NULL) _ring_free(old);
+  g_mutex_unlock(&pwglog_sync_lock);
+}
+
+gboolean
+pwglog_to_ring(const gchar *filename, gsize size, guint sync_msec)
+{
+  PwGLogRing *self, *old;
+  PwGLogRingHeader *header;
+  struct stat st;
+  gsize ring_size = PWGLOG_RING_MIN;
+  gsize map_size;
+  gboolean keep;
+  void *map;
+  int fd;
+
+  while (ring_size < size) ring_size <<= 1;
+  map_size = PWGLOG_RING_HEADER + ring_size;
+  fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) return FALSE;
+  keep = (fstat(fd, &st) == 0 && st.st_size == map_size);
+  if (! keep && (ftruncate(fd, 0) != 0 || ftruncate(fd, map_size) != 0)) {
+    close(fd);
+    return FALSE;
+  }
+  /* Claim the blocks now, not as lines are written */
+  (void)posix_fallocate(fd, 0, map_size);
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return FALSE;
+
+  header = map;
+  if (! keep || memcmp(header->magic, PWGLOG_RING_MAGIC, 8) != 0 ||
+      header->byte_order != PWGLOG_RING_BYTE_ORDER ||
+      header->version != PWGLOG_RING_VERSION ||
+      header->ring_size != ring_size) {
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, PWGLOG_RING_MAGIC, 8);
+    header->byte_order = PWGLOG_RING_BYTE_ORDER;
+    header->version = PWGLOG_RING_VERSION;
+    header->ring_size = ring_size;
+  }
+  self = g_new0(PwGLogRing, 1);
+  self->map = map;
+  self->map_size = map_size;
+  self->header = header;
+  self->ring = (guint8 *)map + PWGLOG_RING_HEADER;
+  self->mask = ring_size - 1;
+  self->synced = header->head;
+
+  g_atomic_int_set(&_ring_sync_usec,
+		   (sync_msec ? sync_msec : PWGLOG_RING_SYNC_MSEC) * 1000);
+  g_mutex_lock(&pwglog_ring_lock);
+  old = _ring;
+  g_atomic_pointer_set(&_ring, self);
+  if (_ring_syncer == NULL) {
+    _ring_syncer = g_thread_new("pwglog-sync", _ring_sync, NULL);
+  }
+  g_mutex_unlock(&pwglog_ring_lock);
+  if (old != NULL) {
+    g_mutex_lock(&pwglog_sync_lock);
+    _ring_free(old);
+    g_mutex_unlock(&pwglog_sync_lock);
+  }
+  _pwglog.dest = DEST_RING;
+  return TRUE;
+}
+
+/* Tile id and frame number, sent to the journal with each message */
+void
+pwglog_set_tile(const gchar *tile)
+{
+  g_atomic_pointer_set(&_pwglog_tile, g_intern_string(tile));
+}
+
+void
+pwglog_set_frame(guint64 frame)
+{
+  __atomic_store_n(&_pwglog_frame, frame, __ATOMIC_RELAXED);
 }
 
 /* Set default logging level */
 void
 pwglog_set_level(GLogLevelFlags level)
 {
+  _pwglog_init();
+  g_mutex_lock(&pwglog_lock);
   _pwglog.levels = LEVELS_UP_TO(level);
+  _pwglog_changed();
+  g_mutex_unlock(&pwglog_lock);
+}
+
+/* Set logging level for one domain */
+void
+pwglog_set_domain_level(const gchar *domain, GLogLevelFlags level)
+{
+  PwGLogConfig *conf;
+
+  _pwglog_init();
+  g_mutex_lock(&pwglog_lock);
+  conf = _pwglog_find_config(domain);
+  if (conf != NULL) {
+    conf->levels = LEVELS_UP_TO(level);
+  } else {
+    _pwglog_add_config(domain, LEVELS_UP_TO(level));
+  }
+  _pwglog_changed();
+  g_mutex_unlock(&pwglog_lock);
+}
+
+/* Limit a domain (or all domains, for NULL) to rate messages per
+ * second after an initial burst, from each place logging to it if
+ * known.  A rate of 0 removes the limit. */
+void
+pwglog_set_rate_limit(const gchar *domain, gdouble rate, guint burst)
+{
+  _pwglog_init();
+  _pwglog_set_limit(domain, rate, burst);
+}
+
+/* Whether a message would be written */
+gboolean
+pwglog_enabled(const gchar *domain, GLogLevelFlags level)
+{
+  return (_pwglog_domain_levels(domain) & level) != 0;
 }
 
 /*-----------------------------------------------------------------------
- *	Lookup levels by domain
+ *	Lookup levels by domain.  Settings change under the lock.
  *-----------------------------------------------------------------------*/
 static void
 _pwglog_add_config(const gchar *domain, GLogLevelFlags levels)
@@ -84,6 +510,20 @@ _pwglog_add_config(const gchar *domain, GLogLevelFlags levels)
   _pwglog_configs = conf;
 }
 
+/* Make threads look again */
+static void
+_pwglog_changed(void)
+{
+  GLogLevelFlags any = _pwglog.levels;
+  PwGLogConfig *conf;
+
+  for (conf=_pwglog_configs; conf; conf=conf->next) {
+    any |= conf->levels;
+  }
+  g_atomic_int_set((gint *)&pwglog_any_levels, any);
+  g_atomic_int_inc(&_pwglog_gen);
+}
+
 static PwGLogConfig *
 _pwglog_find_config(const gchar *domain)
 {
@@ -96,93 +536,845 @@ _pwglog_find_config(const gchar *domain)
   return NULL;
 }
 
+/* Once, by whichever thread gets here first */
 static void
 _pwglog_init(void)
 {
+  const char *debug;
+
+  if (! g_once_init_enter(&_inited)) return;
   /* Populate configs from G_DEBUG environment variable */
-  const char *debug = g_getenv("G_DEBUG");
+  debug = g_getenv("G_DEBUG");
+  g_mutex_lock(&pwglog_lock);
   if (debug != NULL) {
     gchar **tokens = g_strsplit_set(debug, " ,", -1);
     int i;
     gchar *token;
     for (i=0; (token=tokens[i]) != NULL; i++) {
-      _pwglog_add_config(token, LEVELS_UP_TO(G_LOG_LEVEL_DEBUG));
+      gchar *eq = strchr(token, '=');
+      if (eq != NULL) {
+	/* DOMAIN=RATE[/BURST] limits a domain, * being every domain */
+	gchar *end;
+	gdouble rate = g_ascii_strtod(eq + 1, &end);
+	guint burst = (*end == '/') ? strtoul(end + 1, NULL, 10) : 0;
+	*eq = '\0';
+	_pwglog_set_limit((strcmp(token, "*") == 0) ? NULL : token,
+			  rate, burst);
+      } else if (token[0] != '\0') {
+	_pwglog_add_config(token, LEVELS_UP_TO(G_LOG_LEVEL_DEBUG));
+      }
     }
+    g_strfreev(tokens);
   }
-  _inited = TRUE;
+  _pwglog_changed();
+  g_mutex_unlock(&pwglog_lock);
+  g_once_init_leave(&_inited, 1);
+}
+
+static void
+_pwglog_cache_free(gpointer data)
+{
+  PwGLogCache *cache = data;
+  g_hash_table_destroy(cache->levels);
+  g_free(cache);
 }
 
 static GLogLevelFlags
 _pwglog_domain_levels(const gchar *domain)
 {
-  if (! _inited) {
-    _pwglog_init();
-  }
+  _pwglog_init();
   if (domain != NULL && domain[0] != '\0') {
-    PwGLogConfig *conf = _pwglog_find_config(domain);
-    if (conf != NULL) {
-      return conf->levels;
+    PwGLogCache *cache = g_private_get(&_pwglog_cache);
+    guint gen = g_atomic_int_get(&_pwglog_gen);
+    GLogLevelFlags levels;
+    PwGLogConfig *conf;
+
+    if (cache == NULL) {
+      cache = g_new0(PwGLogCache, 1);
+      cache->levels = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free, NULL);
+      g_private_set(&_pwglog_cache, cache);
+    }
+    if (cache->gen != gen) {
+      g_hash_table_remove_all(cache->levels);
+      cache->gen = gen;
+    }
+    levels = GPOINTER_TO_UINT(g_hash_table_lookup(cache->levels, domain));
+    if (levels != 0) {
+      return levels & ~LEVELS_CACHED;
     }
+
+    g_mutex_lock(&pwglog_lock);
+    conf = _pwglog_find_config(domain);
+    levels = (conf != NULL) ? conf->levels : _pwglog.levels;
+    g_mutex_unlock(&pwglog_lock);
+    g_hash_table_insert(cache->levels, g_strdup(domain),
+			GUINT_TO_POINTER(levels | LEVELS_CACHED));
+    return levels;
   }
   return _pwglog.levels;
 }
 
 /*-----------------------------------------------------------------------
- *	Handler to be installed
+ *	Rate limits
+ *-----------------------------------------------------------------------*/
+static PwGLogLimit *
+_pwglog_new_limit(gdouble rate, guint burst)
+{
+  PwGLogLimit *lim = g_new0(PwGLogLimit, 1);
+  lim->rate = rate;
+  lim->burst = (burst > 0) ? burst : MAX(rate, 1.0);
+  lim->tokens = lim->burst;
+  lim->time = g_get_monotonic_time();
+  lim->reported = lim->time - PWGLOG_REPORT_USEC;
+  return lim;
+}
+
+static void
+_pwglog_free_limit(gpointer data)
+{
+  PwGLogLimit *lim = data;
+  g_free(lim->domain);
+  g_free(lim);
+}
+
+static void
+_pwglog_set_limit(const gchar *domain, gdouble rate, guint burst)
+{
+  g_mutex_lock(&pwglog_limit_lock);
+  if (_pwglog_limits == NULL) {
+    _pwglog_limits = g_hash_table_new_full(g_str_hash, g_str_equal,
+					   g_free, g_free);
+    _pwglog_buckets = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free, _pwglog_free_limit);
+  }
+  /* Start afresh */
+  g_hash_table_remove_all(_pwglog_buckets);
+  if (domain == NULL) {
+    if (_pwglog_default_limit != NULL) {
+      g_free(_pwglog_default_limit);
+      _pwglog_default_limit = NULL;
+    }
+    if (rate > 0) {
+      _pwglog_default_limit = _pwglog_new_limit(rate, burst);
+    }
+  } else if (rate > 0) {
+    g_hash_table_replace(_pwglog_limits, g_strdup(domain),
+			 _pwglog_new_limit(rate, burst));
+  } else {
+    g_hash_table_remove(_pwglog_limits, domain);
+  }
+  _pwglog_limiting = (_pwglog_default_limit != NULL ||
+		      g_hash_table_size(_pwglog_limits) > 0);
+  if (_pwglog_limiting && ! _pwglog_held_running) {
+    _pwglog_held_running = TRUE;
+    g_thread_unref(g_thread_new("pwglog-held", _pwglog_held, NULL));
+  }
+  /* It stops once nothing is limited */
+  g_cond_signal(&_pwglog_held_wake);
+  g_mutex_unlock(&pwglog_limit_lock);
+}
+
+/* Whether to write a message, filling in what to report first */
+static gboolean
+_pwglog_limit(const PwGLogMsg *m, GLogLevelFlags level, PwGLogHeld *held)
+{
+  const gchar *domain = (m->domain != NULL) ? m->domain : "";
+  gint64 now = g_get_monotonic_time();
+  guint hash = g_str_hash(m->message);
+  gboolean pass = FALSE;
+  PwGLogLimit *lim;
+  gchar place[256];
+
+  memset(held, 0, sizeof *held);
+  if (m->file != NULL && m->line != NULL) {
+    g_snprintf(place, sizeof place, "%s %s:%s", domain, m->file, m->line);
+  } else {
+    g_strlcpy(place, domain, sizeof place);
+  }
+  g_mutex_lock(&pwglog_limit_lock);
+  lim = g_hash_table_lookup(_pwglog_buckets, place);
+  if (lim == NULL) {
+    PwGLogLimit *set = g_hash_table_lookup(_pwglog_limits, domain);
+    if (set == NULL) set = _pwglog_default_limit;
+    if (set == NULL) {
+      g_mutex_unlock(&pwglog_limit_lock);
+      return TRUE;
+    }
+    lim = _pwglog_new_limit(set->rate, (guint)set->burst);
+    lim->domain = g_strdup(domain);
+    g_hash_table_insert(_pwglog_buckets, g_strdup(place), lim);
+  }
+
+  if (lim->last_level != 0 && level == lim->last_level && hash == lim->last) {
+    /* Same again: count it, saying so now and then */
+    lim->repeats++;
+    if (now - lim->repeat_since >= PWGLOG_REPORT_USEC) {
+      held->repeats = lim->repeats;
+      held->repeat_level = lim->last_level;
+      lim->repeats = 0;
+      lim->repeat_since = now;
+    }
+    goto done;
+  }
+  if (lim->repeats > 0) {
+    held->repeats = lim->repeats;
+    held->repeat_level = lim->last_level;
+    lim->repeats = 0;
+  }
+
+  lim->tokens = MIN(lim->burst,
+		    lim->tokens + (now - lim->time) * lim->rate / G_USEC_PER_SEC);
+  lim->time = now;
+  if (lim->tokens < 1.0) {
+    lim->suppressed++;
+    lim->suppressed_level = level;
+    goto done;
+  }
+  lim->tokens -= 1.0;
+  pass = TRUE;
+  if (lim->suppressed > 0 && now - lim->reported >= PWGLOG_REPORT_USEC) {
+    held->suppressed = lim->suppressed;
+    lim->suppressed = 0;
+    lim->reported = now;
+  }
+  lim->last = hash;
+  lim->last_level = level;
+  lim->repeat_since = now;
+
+ done:
+  g_mutex_unlock(&pwglog_limit_lock);
+  return pass;
+}
+
+/*-----------------------------------------------------------------------
+ *	Journal protocol: NAME=value lines, or for values which may hold
+ *	a newline, NAME, a newline, 64-bit little-endian length and the
+ *	value.  Each piece is an iovec, so nothing is copied.
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  struct iovec iov[5 * PWGLOG_JOURNAL_FIELDS];
+  guint64 len[PWGLOG_JOURNAL_FIELDS];
+  int niov;
+  int nfields;
+} PwGLogJournal;
+
+#define IOV(s, p, n) \
+  do { (s)->iov[(s)->niov].iov_base = (void *)(p); \
+       (s)->iov[(s)->niov].iov_len = (n); (s)->niov++; } while (0)
+
+static void
+_journal_field(PwGLogJournal *self, const gchar *name, const gchar *value)
+{
+  gsize len;
+
+  if (value == NULL || self->nfields == PWGLOG_JOURNAL_FIELDS) return;
+  len = strlen(value);
+  IOV(self, name, strlen(name));
+  if (memchr(value, '\n', len) == NULL) {
+    IOV(self, "=", 1);
+  } else {
+    self->len[self->nfields] = GUINT64_TO_LE(len);
+    IOV(self, "\n", 1);
+    IOV(self, &self->len[self->nfields], 8);
+  }
+  IOV(self, value, len);
+  IOV(self, "\n", 1);
+  self->nfields++;
+}
+
+/* Too big for a datagram: pass a sealed memfd holding it instead */
+static gboolean
+_journal_memfd(PwGLogJournal *self)
+{
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  gboolean sent;
+  int fd = memfd_create("pwglog", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (fd < 0) return FALSE;
+  if (writev(fd, self->iov, self->niov) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    close(fd);
+    return FALSE;
+  }
+  memset(&msg, 0, sizeof msg);
+  memset(&control, 0, sizeof control);
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof control;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  sent = sendmsg(_journal_fd, &msg, MSG_NOSIGNAL) >= 0;
+  close(fd);
+  return sent;
+#else
+  (void)self;
+  return FALSE;
+#endif
+}
+
+static gboolean
+_journal_send(const PwGLogMsg *m, int prio)
+{
+  PwGLogJournal j;
+  struct msghdr msg;
+  gchar priority[4], frame[24];
+  const gchar *tile = g_atomic_pointer_get(&_pwglog_tile);
+
+  j.niov = j.nfields = 0;
+  g_snprintf(priority, sizeof priority, "%d", prio);
+  _journal_field(&j, "PRIORITY", priority);
+  _journal_field(&j, "MESSAGE", m->message);
+  _journal_field(&j, "SYSLOG_IDENTIFIER", g_get_prgname());
+  _journal_field(&j, "GLIB_DOMAIN", m->domain);
+  _journal_field(&j, "CODE_FILE", m->file);
+  _journal_field(&j, "CODE_LINE", m->line);
+  _journal_field(&j, "CODE_FUNC", m->func);
+  _journal_field(&j, "PW_TILE", tile);
+  if (m->frame != 0) {
+    g_snprintf(frame, sizeof frame, "%" G_GUINT64_FORMAT, m->frame);
+    _journal_field(&j, "PW_FRAME", frame);
+  }
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = j.iov;
+  msg.msg_iovlen = j.niov;
+  if (sendmsg(_journal_fd, &msg, MSG_NOSIGNAL) >= 0) return TRUE;
+  if (errno == EMSGSIZE || errno == ENOBUFS) return _journal_memfd(&j);
+  return FALSE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Append a line to the ring, as written to stderr.  FALSE if the
+ *	ring was closed meanwhile.
+ *-----------------------------------------------------------------------*/
+static gboolean
+_ring_write(const PwGLogMsg *m, int prio, const char *level_text)
+{
+  const gchar *parts[6];
+  gsize lens[6];
+  PwGLogRingRecord rec;
+  PwGLogRing *self;
+  gsize text = 0, max, room, off, total;
+  guint64 pos;
+  guint8 *p;
+  int i, n = 0;
+
+  parts[n++] = "[";
+  parts[n++] = level_text;
+  parts[n++] = "] ";
+  if (m->domain != NULL) {
+    parts[n++] = m->domain;
+    parts[n++] = ": ";
+  }
+  parts[n++] = m->message;
+  for (i=0; i < n; i++) {
+    lens[i] = strlen(parts[i]);
+    text += lens[i];
+  }
+
+  g_mutex_lock(&pwglog_ring_lock);
+  self = _ring;
+  if (self == NULL) {
+    g_mutex_unlock(&pwglog_ring_lock);
+    return FALSE;
+  }
+  /* Cut short lines too long for the ring */
+  max = (self->mask + 1) / 4 - sizeof rec - 1;
+  if (text > max) {
+    lens[n-1] -= MIN(lens[n-1], text - max);
+    text = max;
+  }
+  total = PWGLOG_RING_ALIGN(sizeof rec + text + 1);
+  pos = self->header->head;
+  off = pos & self->mask;
+  room = self->mask + 1 - off;
+  memset(&rec, 0, sizeof rec);
+  rec.time = g_get_real_time();
+  if (room < total) {
+    /* Pad to the end */
+    if (room >= sizeof rec) {
+      rec.pos = pos;
+      memcpy(self->ring + off, &rec, sizeof rec);
+    }
+    pos += room;
+    off = 0;
+  }
+  rec.pos = pos;
+  rec.seq = self->header->seq++;
+  rec.size = sizeof rec + text + 1;
+  rec.prio = prio;
+  p = self->ring + off;
+  memcpy(p, &rec, sizeof rec);
+  p += sizeof rec;
+  for (i=0; i < n; i++) {
+    memcpy(p, parts[i], lens[i]);
+    p += lens[i];
+  }
+  *p = '\0';
+  __atomic_store_n(&self->header->head, pos + total, __ATOMIC_RELEASE);
+  g_mutex_unlock(&pwglog_ring_lock);
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Output, from the handler or the writer thread
+ *-----------------------------------------------------------------------*/
+static const char *
+_pwglog_level_text(GLogLevelFlags level, int *prio)
+{
+  if (level & G_LOG_LEVEL_ERROR) {
+    *prio = LOG_ERR;
+    return "ERROR";
+  } else if (level & G_LOG_LEVEL_CRITICAL) {
+    *prio = LOG_CRIT;
+    return "CRITICAL";
+  } else if (level & G_LOG_LEVEL_WARNING) {
+    *prio = LOG_WARNING;
+    return "WARNING";
+  } else if (level & G_LOG_LEVEL_MESSAGE) {
+    *prio = LOG_NOTICE;
+    return "MESSAGE";
+  } else if (level & G_LOG_LEVEL_INFO) {
+    *prio = LOG_INFO;
+    return "INFO";
+  } else if (level & G_LOG_LEVEL_DEBUG) {
+    *prio = LOG_DEBUG;
+    return "DEBUG";
+  }
+  *prio = LOG_INFO;
+  return "?";
+}
+
+static void
+_pwglog_write(const PwGLogMsg *m)
+{
+  int prio;
+  const char *level_text = _pwglog_level_text(m->level, &prio);
+
+  switch (_pwglog.dest) {
+  case DEST_RING:
+    if (_ring_write(m, prio, level_text)) break;
+    /* Otherwise the destination is changing */
+  case DEST_STDERR:
+    if (m->domain != NULL) {
+      fprintf(stderr, "[%s] %s: %s\n", level_text, m->domain, m->message);
+    } else {
+      fprintf(stderr, "[%s] %s\n", level_text, m->message);
+    }
+    break;
+  case DEST_JOURNAL:
+    if (_journal_send(m, prio)) break;
+    /* Otherwise fall back to syslog */
+  case DEST_SYSLOG:
+    /* Check first that logging facility is initialized */
+    if (! _syslog_opened) {
+      const char *ident = g_get_prgname();
+      openlog(ident, LOG_PID, LOG_USER);
+      _syslog_opened = TRUE;
+    }
+    if (m->domain != NULL) {
+      syslog(prio, "[%s] %s: %s", level_text, m->domain, m->message);
+    } else {
+      syslog(prio, "[%s] %s", level_text, m->message);
+    }
+    break;
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Queue with a slot per message.  Any thread may take a message
+ *	off (to drop the oldest, or before a fatal message), though
+ *	usually only the writer does.
+ *-----------------------------------------------------------------------*/
+static PwGLogSlot *
+_pwglog_claim(PwGLogQueue *q, gsize *pos)
+{
+  gsize p = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  while (1) {
+    PwGLogSlot *slot = &q->slots[p & q->mask];
+    gssize diff = (gssize)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+      (gssize)p;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &p, p + 1, TRUE,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	*pos = p;
+	return slot;
+      }
+    } else if (diff < 0) {
+      return NULL;		/* Full */
+    } else {
+      p = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Copy out the oldest message, if any */
+static gboolean
+_pwglog_take(PwGLogQueue *q, PwGLogSlot *copy)
+{
+  gsize p = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  PwGLogSlot *slot;
+
+  while (1) {
+    gssize diff;
+    slot = &q->slots[p & q->mask];
+    diff = (gssize)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+      (gssize)(p + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &p, p + 1, TRUE,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	break;
+      }
+    } else if (diff < 0) {
+      return FALSE;		/* Empty */
+    } else {
+      p = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  if (copy != NULL) {
+    memcpy(copy, slot, sizeof *copy);
+  }
+  __atomic_store_n(&slot->seq, p + q->mask + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+/* Empty string as NULL */
+#define SLOT_STRING(s) ((s)[0] != '\0' ? (s) : NULL)
+
+/* Write out what is queued, then say if any were lost */
+static void
+_pwglog_drain(PwGLogQueue *q)
+{
+  PwGLogSlot copy;
+  PwGLogMsg m;
+  gchar text[64];
+  guint dropped;
+
+  g_mutex_lock(&q->drain_lock);
+  while (_pwglog_take(q, &copy)) {
+    m.level = copy.level;
+    m.domain = SLOT_STRING(copy.domain);
+    m.message = copy.text;
+    m.file = SLOT_STRING(copy.file);
+    m.line = SLOT_STRING(copy.line);
+    m.func = SLOT_STRING(copy.func);
+    m.frame = copy.frame;
+    _pwglog_write(&m);
+  }
+  dropped = g_atomic_int_get(&q->dropped);
+  if (dropped != q->reported) {
+    g_snprintf(text, sizeof text,
+	       "%u messages dropped", dropped - q->reported);
+    memset(&m, 0, sizeof m);
+    m.level = G_LOG_LEVEL_WARNING;
+    m.domain = "pwglog";
+    m.message = text;
+    _pwglog_write(&m);
+    q->reported = dropped;
+  }
+  g_mutex_unlock(&q->drain_lock);
+}
+
+static gpointer
+_pwglog_writer(gpointer data)
+{
+  PwGLogQueue *q = data;
+  while (! g_atomic_int_get(&q->stop)) {
+    _pwglog_drain(q);
+    if (_pwglog.dest == DEST_STDERR) fflush(stderr);
+    g_usleep(PWGLOG_WRITER_USEC);
+  }
+  _pwglog_drain(q);
+  return NULL;
+}
+
+/* Copy a string into a slot, cut short if need be */
+static void
+_pwglog_slot_string(gchar *dst, gsize size, const gchar *src)
+{
+  if (src == NULL) {
+    dst[0] = '\0';
+  } else {
+    g_strlcpy(dst, src, size);
+  }
+}
+
+/* Queue a message, or follow the overflow policy if full */
+static void
+_pwglog_queue(PwGLogQueue *q, const PwGLogMsg *m)
+{
+  PwGLogSlot *slot;
+  gsize pos;
+
+  while ((slot = _pwglog_claim(q, &pos)) == NULL) {
+    switch (q->overflow) {
+    case PWGLOG_DROP_NEW:
+      g_atomic_int_inc((gint *)&q->dropped);
+      return;
+    case PWGLOG_DROP_OLDEST:
+      if (_pwglog_take(q, NULL)) g_atomic_int_inc((gint *)&q->dropped);
+      break;
+    case PWGLOG_BLOCK:
+      g_usleep(PWGLOG_BLOCK_USEC);
+      break;
+    }
+  }
+  slot->level = m->level;
+  slot->frame = m->frame;
+  _pwglog_slot_string(slot->domain, sizeof slot->domain, m->domain);
+  _pwglog_slot_string(slot->file, sizeof slot->file, m->file);
+  _pwglog_slot_string(slot->line, sizeof slot->line, m->line);
+  _pwglog_slot_string(slot->func, sizeof slot->func, m->func);
+  _pwglog_slot_string(slot->text, sizeof slot->text, m->message);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*-----------------------------------------------------------------------
+ *	Start writing messages from a thread of our own, queueing up
+ *	to nslots (rounded up to a power of 2).  When full, drop the
+ *	new message or the oldest, or wait for room.
  *-----------------------------------------------------------------------*/
 void
-pwglog_handler(const gchar *domain, GLogLevelFlags level, const gchar *message,
-	       gpointer UNUSED(userdata))
+pwglog_start_async(guint nslots, PwGLogOverflow overflow)
+{
+  PwGLogQueue *q;
+  gsize n = 2, i;
+
+  if (_queue != NULL) return;
+  while (n < nslots) n <<= 1;
+  q = g_new0(PwGLogQueue, 1);
+  q->slots = g_new0(PwGLogSlot, n);
+  q->mask = n - 1;
+  q->overflow = overflow;
+  g_mutex_init(&q->drain_lock);
+  for (i=0; i < n; i++) {
+    q->slots[i].seq = i;
+  }
+  q->writer = g_thread_new("pwglog", _pwglog_writer, q);
+  g_atomic_pointer_set(&_queue, q);
+}
+
+/* Write out what is queued and go back to writing from the caller,
+ * once threads which found the queue are done with it */
+void
+pwglog_stop_async(void)
+{
+  PwGLogQueue *q = _queue;
+
+  if (q == NULL) return;
+  g_atomic_int_set(&_queue_stopping, TRUE);
+  g_atomic_pointer_set(&_queue, NULL);
+  /* The writer keeps making room for any waiting to queue */
+  while (g_atomic_int_get(&_queue_users) > 0) {
+    g_usleep(PWGLOG_BLOCK_USEC);
+  }
+  g_atomic_int_set(&q->stop, TRUE);
+  g_thread_join(q->writer);
+  _pwglog_drain(q);
+  g_mutex_clear(&q->drain_lock);
+  g_free(q->slots);
+  g_free(q);
+  g_atomic_int_set(&_queue_stopping, FALSE);
+}
+
+/*-----------------------------------------------------------------------
+ *	Write or queue one message.  Counted as a user before looking
+ *	for the queue, so pwglog_stop_async() knows when it may go.
+ *-----------------------------------------------------------------------*/
+static void
+_pwglog_output(const PwGLogMsg *m, gboolean fatal)
+{
+  PwGLogQueue *queue;
+
+  g_atomic_int_inc(&_queue_users);
+  queue = g_atomic_pointer_get(&_queue);
+  if (queue != NULL) {
+    if (! fatal) {
+      _pwglog_queue(queue, m);
+    } else {
+      /* About to abort: write out earlier messages first */
+      _pwglog_drain(queue);
+    }
+  }
+  g_atomic_int_add(&_queue_users, -1);
+  if (queue == NULL) {
+    /* Not ahead of what this thread queued before */
+    while (g_atomic_int_get(&_queue_stopping)) {
+      g_usleep(PWGLOG_BLOCK_USEC);
+    }
+  }
+  if (queue == NULL || fatal) _pwglog_write(m);
+}
+
+/* Check level and limits, then write */
+static void
+_pwglog_log(PwGLogMsg *m, GLogLevelFlags level)
 {
-  PwGLog *self = &_pwglog;
-  GLogLevelFlags levels = _pwglog_domain_levels(domain);
+  GLogLevelFlags levels = _pwglog_domain_levels(m->domain);
   GLogLevelFlags enabled = (GLogLevelFlags)(levels & level);
+  gboolean fatal = (level & G_LOG_FLAG_FATAL) != 0;
 
   if (enabled) {
     /* Output enabled for this level */
-    const char *level_text = "?";
-    int prio = LOG_INFO;
-    if (enabled & G_LOG_LEVEL_ERROR) {
-      level_text = "ERROR";
-      prio = LOG_ERR;
-    } else if (enabled & G_LOG_LEVEL_CRITICAL) {
-      level_text = "CRITICAL";
-      prio = LOG_CRIT;
-    } else if (enabled & G_LOG_LEVEL_WARNING) {
-      level_text = "WARNING";
-      prio = LOG_WARNING;
-    } else if (enabled & G_LOG_LEVEL_MESSAGE) {
-      level_text = "MESSAGE";
-      prio = LOG_NOTICE;
-    } else if (enabled & G_LOG_LEVEL_INFO) {
-      level_text = "INFO";
-      prio = LOG_INFO;
-    } else if (enabled & G_LOG_LEVEL_DEBUG) {
-      level_text = "DEBUG";
-      prio = LOG_DEBUG;
-    }
-
-    switch (self->dest) {
-    case DEST_STDERR:
-      if (domain != NULL) {
-	fprintf(stderr, "[%s] %s: %s\n", level_text, domain, message);
-      } else {
-	fprintf(stderr, "[%s] %s\n", level_text, message);
+    m->level = enabled;
+    m->frame = __atomic_load_n(&_pwglog_frame, __ATOMIC_RELAXED);
+    if (_pwglog_limiting && ! fatal) {
+      PwGLogHeld held;
+      PwGLogMsg note = *m;
+      gchar text[64];
+      gboolean pass = _pwglog_limit(m, enabled, &held);
+      note.message = text;
+      if (held.repeats > 0) {
+	g_snprintf(text, sizeof text, "last message repeated %u times",
+		   held.repeats);
+	note.level = held.repeat_level;
+	_pwglog_output(&note, FALSE);
       }
-      break;
-    case DEST_SYSLOG:
-      /* Check first that logging facility is initialized */
-      if (! _syslog_opened) {
-	const char *ident = g_get_prgname();
-	openlog(ident, LOG_PID, LOG_USER);
-	_syslog_opened = TRUE;
+      if (held.suppressed > 0) {
+	g_snprintf(text, sizeof text, "%u messages suppressed",
+		   held.suppressed);
+	note.level = enabled;
+	_pwglog_output(&note, FALSE);
       }
-      if (domain != NULL) {
-	syslog(prio, "[%s] %s: %s", level_text, domain, message);
-      } else {
-	syslog(prio, "[%s] %s", level_text, message);
+      if (! pass) return;
+    }
+    _pwglog_output(m, fatal);
+  }
+}
+
+/* What a bucket held back, to be written by the thread below */
+typedef struct {
+  gchar *place;
+  gchar *domain;
+  PwGLogMsg m;
+  gchar text[64];
+} PwGLogNote;
+
+static GSList *
+_pwglog_note(GSList *notes, const gchar *place, const PwGLogLimit *lim,
+	     GLogLevelFlags level, const gchar *format, guint count)
+{
+  PwGLogNote *note = g_new0(PwGLogNote, 1);
+  note->place = g_strdup(place);
+  note->domain = g_strdup(lim->domain);
+  note->m.level = level;
+  note->m.domain = (lim->domain[0] != '\0') ? note->domain : NULL;
+  note->m.message = note->text;
+  g_snprintf(note->text, sizeof note->text, format, count);
+  return g_slist_prepend(notes, note);
+}
+
+static gint
+_pwglog_note_cmp(gconstpointer a, gconstpointer b)
+{
+  return strcmp(((const PwGLogNote *)a)->place,
+		((const PwGLogNote *)b)->place);
+}
+
+/* Write what was held back which no later message has reported,
+ * while anything is limited.  Written outside the lock, so a full
+ * queue holds up only this thread. */
+static gpointer
+_pwglog_held(gpointer UNUSED(data))
+{
+  g_mutex_lock(&pwglog_limit_lock);
+  while (_pwglog_limiting) {
+    GHashTableIter iter;
+    gpointer key, value;
+    GSList *notes = NULL, *l;
+    gint64 now;
+
+    g_cond_wait_until(&_pwglog_held_wake, &pwglog_limit_lock,
+		      g_get_monotonic_time() + PWGLOG_HELD_USEC);
+    if (! _pwglog_limiting) break;
+    now = g_get_monotonic_time();
+    g_hash_table_iter_init(&iter, _pwglog_buckets);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      PwGLogLimit *lim = value;
+      if (lim->repeats > 0 && now - lim->repeat_since >= PWGLOG_REPORT_USEC) {
+	notes = _pwglog_note(notes, key, lim, lim->last_level,
+			     "last message repeated %u times", lim->repeats);
+	lim->repeats = 0;
+	lim->repeat_since = now;
       }
-      break;
+      if (lim->suppressed > 0 && now - lim->reported >= PWGLOG_REPORT_USEC) {
+	notes = _pwglog_note(notes, key, lim, lim->suppressed_level,
+			     "%u messages suppressed", lim->suppressed);
+	lim->suppressed = 0;
+	lim->reported = now;
+      }
+    }
+    /* In order of place, so the same storm reads the same */
+    notes = g_slist_sort(notes, _pwglog_note_cmp);
+    g_mutex_unlock(&pwglog_limit_lock);
+    for (l=notes; l != NULL; l=l->next) {
+      PwGLogNote *note = l->data;
+      _pwglog_output(&note->m, FALSE);
+      g_free(note->place);
+      g_free(note->domain);
+      g_free(note);
+    }
+    g_slist_free(notes);
+    g_mutex_lock(&pwglog_limit_lock);
+  }
+  _pwglog_held_running = FALSE;
+  g_mutex_unlock(&pwglog_limit_lock);
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ *	Handler to be installed
+ *-----------------------------------------------------------------------*/
+void
+pwglog_handler(const gchar *domain, GLogLevelFlags level, const gchar *message,
+	       gpointer UNUSED(userdata))
+{
+  PwGLogMsg m;
+
+  memset(&m, 0, sizeof m);
+  m.domain = domain;
+  m.message = message;
+  _pwglog_log(&m, level);
+}
+
+/*-----------------------------------------------------------------------
+ *	Writer for g_log_set_writer_func(), which also gets the source
+ *	file, line and function of structured messages
+ *-----------------------------------------------------------------------*/
+GLogWriterOutput
+pwglog_writer(GLogLevelFlags level, const GLogField *fields, gsize n_fields,
+	      gpointer UNUSED(userdata))
+{
+  PwGLogMsg m;
+  gsize i;
+
+  memset(&m, 0, sizeof m);
+  for (i=0; i < n_fields; i++) {
+    const GLogField *f = &fields[i];
+    if (f->length >= 0) continue;	/* Only strings are of use */
+    if (strcmp(f->key, "MESSAGE") == 0) {
+      m.message = f->value;
+    } else if (strcmp(f->key, "GLIB_DOMAIN") == 0) {
+      m.domain = f->value;
+    } else if (strcmp(f->key, "CODE_FILE") == 0) {
+      m.file = f->value;
+    } else if (strcmp(f->key, "CODE_LINE") == 0) {
+      m.line = f->value;
+    } else if (strcmp(f->key, "CODE_FUNC") == 0) {
+      m.func = f->value;
     }
   }
+  if (m.message == NULL) return G_LOG_WRITER_UNHANDLED;
+  _pwglog_log(&m, level);
+  return G_LOG_WRITER_HANDLED;
 }
@@ -26,11 +26,54 @@
 extern void
 pwglog_to_syslog(void);
 
+/* Send messages to journald, or a stand-in listening at path */
+extern gboolean
+pwglog_to_journal(const gchar */*path or NULL*/);
+
+/* Append messages to a ring file of fixed size */
+extern gboolean
+pwglog_to_ring(const gchar */*filename*/, gsize /*size*/,
+	       guint /*sync_msec*/);
+
+/* Sent to the journal with each message */
+extern void
+pwglog_set_tile(const gchar *);
+
+extern void
+pwglog_set_frame(guint64);
+
 extern void
 pwglog_set_level(GLogLevelFlags);
 
+/* Set logging level for one domain */
+extern void
+pwglog_set_domain_level(const gchar */*domain*/, GLogLevelFlags);
+
+/* Limit a domain (NULL for each domain) to rate messages per second */
+extern void
+pwglog_set_rate_limit(const gchar */*domain*/, gdouble /*rate*/,
+		      guint /*burst*/);
+
+/* Whether pwglog_handler would write a message */
+extern gboolean
+pwglog_enabled(const gchar */*domain*/, GLogLevelFlags);
+
+/* As pwglog_enabled, but quick when no domain has the level enabled.
+ * Use before formatting costly debug messages. */
+extern GLogLevelFlags pwglog_any_levels;
+#define PWGLOG_ENABLED(domain, level) \
+  (((level) & pwglog_any_levels) != 0 && pwglog_enabled((domain), (level)))
+
 extern void
 pwglog_handler(const gchar */*domain*/, GLogLevelFlags /*level*/,
 	       const gchar */*message*/, gpointer /*userdata*/);
 
+/* For g_log_set_writer_func(), to write structured messages */
+extern GLogWriterOutput
+pwglog_writer(GLogLevelFlags, const GLogField *, gsize /*n_fields*/,
+	      gpointer /*userdata*/);
+
+/* pwglog_start_async() and PwGLogOverflow are only in pwutil.h, as
+ * this header may be included with it */
+
 #endif /* INC_pwglog_h */
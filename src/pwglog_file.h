@@ -0,0 +1,59 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Layout of pwglog ring files (internal to pwlibs)
+ *
+ *	A PwGLogRingHeader, padded to PWGLOG_RING_HEADER, then the ring.
+ *	Each record is a PwGLogRingRecord and the line as written to
+ *	stderr, null-terminated and padded to a multiple of 8 bytes.
+ *	Records never wrap: a record of size 0 pads to the end of the
+ *	ring.  Each starts with its position, so that the records not
+ *	yet overwritten can be found from the head.  Values are in the
+ *	byte order of the machine which wrote the file.
+ *=======================================================================*/
+#ifndef INC_pwglog_file_h
+#define INC_pwglog_file_h
+
+#include <glib.h>
+
+#define PWGLOG_RING_MAGIC	"PWGLOGR\n"
+#define PWGLOG_RING_BYTE_ORDER	0x01020304
+#define PWGLOG_RING_VERSION	1
+#define PWGLOG_RING_HEADER	4096
+
+typedef struct {
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 version;
+  guint64 ring_size;		/* A power of 2 */
+  guint64 head;			/* Bytes of ring ever written */
+  guint64 seq;			/* Of the next record */
+} PwGLogRingHeader;
+
+typedef struct {
+  guint64 pos;			/* Ring bytes written before this */
+  guint64 seq;			/* Counts records, over restarts too */
+  gint64 time;			/* g_get_real_time() */
+  guint32 size;			/* Including this, before padding */
+  guint8 prio;			/* syslog priority */
+  guint8 spare[3];
+} PwGLogRingRecord;
+
+#define PWGLOG_RING_ALIGN(n)	(((n) + 7) & ~(gsize)7)
+
+#endif /* INC_pwglog_file_h */
@@ -0,0 +1,572 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Pixel format conversion
+ *=======================================================================*/
+#include "pwutil.h"
+#include "pwpixel_kernels.h"
+#include <string.h>
+
+#define PWPIXEL_ERROR pwpixel_error_quark()
+
+static GQuark
+pwpixel_error_quark(void)
+{
+  return g_quark_from_static_string("pwpixel-error");
+}
+
+static const PwPixelFormatInfo pwpixel_formats[] = {
+  {PW_PIXEL_RGBA8888, "rgba8888", 4, 1, 0},
+  {PW_PIXEL_BGRA8888, "bgra8888", 4, 1, 0},
+  {PW_PIXEL_RGB888,   "rgb888",   3, 1, 0},
+  {PW_PIXEL_RGB565,   "rgb565",   2, 1, 0},
+  {PW_PIXEL_YUV420,   "yuv420",   1, 3, 1},
+  {PW_PIXEL_NV12,     "nv12",     1, 2, 1},
+};
+
+#define IS_YUV(f) ((f) == PW_PIXEL_YUV420 || (f) == PW_PIXEL_NV12)
+
+/* Pixels converted at a time via an intermediate RGBA8888 row */
+#define CHUNK 256
+
+const PwPixelFormatInfo *
+pwpixel_format_info(PwPixelFormat format)
+{
+  if ((guint)format >= G_N_ELEMENTS(pwpixel_formats)) return NULL;
+  return &pwpixel_formats[format];
+}
+
+/* Convert e.g. "rgb565" to PwPixelFormat */
+gboolean
+pwpixel_format_from_string(PwPixelFormat *format, const gchar *str,
+			   GError **error)
+{
+  guint i;
+  for (i=0; i < G_N_ELEMENTS(pwpixel_formats); i++) {
+    if (g_ascii_strcasecmp(str, pwpixel_formats[i].name) == 0) {
+      *format = pwpixel_formats[i].format;
+      return TRUE;
+    }
+  }
+  if (g_ascii_strcasecmp(str, "i420") == 0) { /* Common alias */
+    *format = PW_PIXEL_YUV420;
+    return TRUE;
+  }
+  g_set_error(error, PWPIXEL_ERROR, 0, "Invalid pixel format \"%s\"", str);
+  return FALSE;
+}
+
+/*-----------------------------------------------------------------------
+ *	YUV coefficients
+ *-----------------------------------------------------------------------*/
+static void
+_yuv_coeffs(PwYuvCoeffs *c, PwYuvMatrix matrix)
+{
+  gdouble kr, kb, yscale, cscale;
+  const gdouble one = 1 << PWPIXEL_YUV_SHIFT;
+
+  if (matrix == PW_YUV_BT709 || matrix == PW_YUV_BT709_FULL) {
+    kr = 0.2126;
+    kb = 0.0722;
+  } else {
+    kr = 0.299;
+    kb = 0.114;
+  }
+  if (matrix == PW_YUV_BT601_FULL || matrix == PW_YUV_BT709_FULL) {
+    c->yoff = 0;
+    yscale = 1.0;
+    cscale = 1.0;
+  } else {
+    c->yoff = 16;
+    yscale = 255.0 / 219;
+    cscale = 255.0 / 224;
+  }
+#define Q(v) ((gint16)((v) * one + 0.5))
+  c->cy = Q(yscale);
+  c->crv = Q(2 * (1 - kr) * cscale);
+  c->cbu = Q(2 * (1 - kb) * cscale);
+  c->cgu = Q(2 * (1 - kb) * kb / (1 - kr - kb) * cscale);
+  c->cgv = Q(2 * (1 - kr) * kr / (1 - kr - kb) * cscale);
+#undef Q
+}
+
+/*-----------------------------------------------------------------------
+ *	Portable kernels
+ *-----------------------------------------------------------------------*/
+void
+pwpixel_c_swap_rb(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i < count; i++, src += 4, dst += 4) {
+    guint8 r = src[0];		/* In case dst == src */
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = r;
+    dst[3] = src[3];
+  }
+}
+
+void
+pwpixel_c_rgba_to_rgb565(guint8 *dst, const guint8 *src, gsize count)
+{
+  guint16 *out = (guint16 *)dst;
+  gsize i;
+  for (i=0; i < count; i++, src += 4) {
+    out[i] = ((src[0] & 0xf8) << 8) | ((src[1] & 0xfc) << 3) | (src[2] >> 3);
+  }
+}
+
+void
+pwpixel_c_rgb565_to_rgba(guint8 *dst, const guint8 *src, gsize count)
+{
+  const guint16 *in = (const guint16 *)src;
+  gsize i;
+  for (i=0; i < count; i++, dst += 4) {
+    guint16 p = in[i];
+    guint r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+    dst[0] = (r << 3) | (r >> 2);
+    dst[1] = (g << 2) | (g >> 4);
+    dst[2] = (b << 3) | (b >> 2);
+    dst[3] = 255;
+  }
+}
+
+void
+pwpixel_c_rgba_to_rgb888(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i < count; i++, src += 4, dst += 3) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+  }
+}
+
+void
+pwpixel_c_rgb888_to_rgba(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i < count; i++, src += 3, dst += 4) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = 255;
+  }
+}
+
+/* Must give identical results to the accelerated versions */
+static inline void
+_yuv_pixel(guint8 *dst, gint y, gint u, gint v, const PwYuvCoeffs *c)
+{
+  const gint round = 1 << (PWPIXEL_YUV_SHIFT - 1);
+  gint yy = (y - c->yoff) * c->cy + round;
+  gint r, g, b;
+  u -= 128;
+  v -= 128;
+  r = (yy + c->crv * v) >> PWPIXEL_YUV_SHIFT;
+  g = (yy - c->cgu * u - c->cgv * v) >> PWPIXEL_YUV_SHIFT;
+  b = (yy + c->cbu * u) >> PWPIXEL_YUV_SHIFT;
+  dst[0] = CLAMP(r, 0, 255);
+  dst[1] = CLAMP(g, 0, 255);
+  dst[2] = CLAMP(b, 0, 255);
+  dst[3] = 255;
+}
+
+void
+pwpixel_c_yuv420_to_rgba(guint8 *dst, const guint8 *y,
+			 const guint8 *u, const guint8 *v,
+			 gsize count, const PwYuvCoeffs *c)
+{
+  gsize i;
+  for (i=0; i < count; i++, dst += 4) {
+    _yuv_pixel(dst, y[i], u[i >> 1], v[i >> 1], c);
+  }
+}
+
+void
+pwpixel_c_nv12_to_rgba(guint8 *dst, const guint8 *y,
+		       const guint8 *uv, const guint8 *unused,
+		       gsize count, const PwYuvCoeffs *c)
+{
+  gsize i;
+  for (i=0; i < count; i++, dst += 4) {
+    _yuv_pixel(dst, y[i], uv[i & ~1], uv[i | 1], c);
+  }
+}
+
+/* RGB to YUV, only needed for encoding so not accelerated */
+static void
+_rgb_to_yuv(gint *y, gint *u, gint *v,
+	    gint r, gint g, gint b, PwYuvMatrix matrix)
+{
+  gdouble kr, kb, ey, eu, ev;
+  gboolean full = (matrix == PW_YUV_BT601_FULL ||
+		   matrix == PW_YUV_BT709_FULL);
+  if (matrix == PW_YUV_BT709 || matrix == PW_YUV_BT709_FULL) {
+    kr = 0.2126;
+    kb = 0.0722;
+  } else {
+    kr = 0.299;
+    kb = 0.114;
+  }
+  ey = kr * r + (1 - kr - kb) * g + kb * b;
+  eu = (b - ey) / (2 * (1 - kb));
+  ev = (r - ey) / (2 * (1 - kr));
+  if (full) {
+    *y = (gint)(ey + 0.5);
+    *u = (gint)(eu + 128.5);
+    *v = (gint)(ev + 128.5);
+  } else {
+    *y = (gint)(ey * 219 / 255 + 16.5);
+    *u = (gint)(eu * 224 / 255 + 128.5);
+    *v = (gint)(ev * 224 / 255 + 128.5);
+  }
+  *y = CLAMP(*y, 0, 255);
+  *u = CLAMP(*u, 0, 255);
+  *v = CLAMP(*v, 0, 255);
+}
+
+/*-----------------------------------------------------------------------
+ *	Select the best kernels once
+ *-----------------------------------------------------------------------*/
+static PwPixelKernels pwpixel_kernels;
+
+static const PwPixelKernels *
+_kernels(void)
+{
+  static gsize inited = 0;
+  if (g_once_init_enter(&inited)) {
+    PwPixelKernels *k = &pwpixel_kernels;
+    PwCpuFeatures cpu = pwcpu_features();
+    k->swap_rb = pwpixel_c_swap_rb;
+    k->rgba_to_rgb565 = pwpixel_c_rgba_to_rgb565;
+    k->rgb565_to_rgba = pwpixel_c_rgb565_to_rgba;
+    k->rgba_to_rgb888 = pwpixel_c_rgba_to_rgb888;
+    k->rgb888_to_rgba = pwpixel_c_rgb888_to_rgba;
+    k->yuv420_to_rgba = pwpixel_c_yuv420_to_rgba;
+    k->nv12_to_rgba = pwpixel_c_nv12_to_rgba;
+    /* Each level overrides what it does better than the one below */
+#if defined(PW_HAVE_SSE2)
+    if (cpu & PWCPU_SSE2) {
+      pwpixel_kernels_sse2(k);
+    }
+#endif
+#if defined(PW_HAVE_AVX2)
+    if (cpu & PWCPU_AVX2) {
+      pwpixel_kernels_avx2(k);
+    }
+#endif
+#if defined(PW_HAVE_NEON)
+    if (cpu & PWCPU_NEON) {
+      pwpixel_kernels_neon(k);
+    }
+#endif
+    g_once_init_leave(&inited, 1);
+  }
+  return &pwpixel_kernels;
+}
+
+/*-----------------------------------------------------------------------
+ *	Pixel value for fill_rect
+ *-----------------------------------------------------------------------*/
+guint
+pwpixel_from_rgba(PwPixelFormat format, const PwRGBA *rgba)
+{
+  guint8 src[4], dst[4] = {0, 0, 0, 0};
+  guint pixel;
+  gint y, u, v;
+
+  src[0] = rgba->r;
+  src[1] = rgba->g;
+  src[2] = rgba->b;
+  src[3] = rgba->a;
+  switch (format) {
+  case PW_PIXEL_RGBA8888:
+    memcpy(dst, src, 4);
+    break;
+  case PW_PIXEL_BGRA8888:
+    pwpixel_c_swap_rb(dst, src, 1);
+    break;
+  case PW_PIXEL_RGB888:
+    pwpixel_c_rgba_to_rgb888(dst, src, 1);
+    break;
+  case PW_PIXEL_RGB565:
+    pwpixel_c_rgba_to_rgb565(dst, src, 1);
+    break;
+  case PW_PIXEL_YUV420:
+  case PW_PIXEL_NV12:
+    /* Bytes Y,U,V */
+    _rgb_to_yuv(&y, &u, &v, src[0], src[1], src[2], PW_YUV_BT601);
+    dst[0] = y;
+    dst[1] = u;
+    dst[2] = v;
+    break;
+  }
+  pixel = 0;
+  memcpy(&pixel, dst, MIN(sizeof(pixel), sizeof(dst)));
+  return pixel;
+}
+
+/*-----------------------------------------------------------------------
+ *	Convert one row of packed pixels
+ *-----------------------------------------------------------------------*/
+/* To RGBA8888, or NULL if no conversion */
+static PwPixelRowFunc *
+_to_rgba(const PwPixelKernels *k, PwPixelFormat format)
+{
+  switch (format) {
+  case PW_PIXEL_BGRA8888: return k->swap_rb;
+  case PW_PIXEL_RGB888: return k->rgb888_to_rgba;
+  case PW_PIXEL_RGB565: return k->rgb565_to_rgba;
+  default: return NULL;
+  }
+}
+
+/* From RGBA8888, or NULL if no conversion */
+static PwPixelRowFunc *
+_from_rgba(const PwPixelKernels *k, PwPixelFormat format)
+{
+  switch (format) {
+  case PW_PIXEL_BGRA8888: return k->swap_rb;
+  case PW_PIXEL_RGB888: return k->rgba_to_rgb888;
+  case PW_PIXEL_RGB565: return k->rgba_to_rgb565;
+  default: return NULL;
+  }
+}
+
+gboolean
+pwpixel_convert_row(PwPixelFormat dst_format, void *dst,
+		    PwPixelFormat src_format, const void *src, gsize count,
+		    GError **error)
+{
+  const PwPixelKernels *k = _kernels();
+  PwPixelRowFunc *unpack, *pack;
+  guint8 tmp[4 * CHUNK];
+  guint dbpp, sbpp;
+  gsize n;
+
+  if (IS_YUV(dst_format) || IS_YUV(src_format) ||
+      pwpixel_format_info(dst_format) == NULL ||
+      pwpixel_format_info(src_format) == NULL) {
+    g_set_error(error, PWPIXEL_ERROR, 0, "Unsupported row conversion");
+    return FALSE;
+  }
+  dbpp = pwpixel_formats[dst_format].bytes_per_pixel;
+  sbpp = pwpixel_formats[src_format].bytes_per_pixel;
+
+  if (dst_format == src_format) {
+    memmove(dst, src, count * dbpp);
+    return TRUE;
+  }
+  unpack = _to_rgba(k, src_format);
+  pack = _from_rgba(k, dst_format);
+  if (unpack == NULL) {
+    (*pack)(dst, src, count);
+  } else if (pack == NULL) {
+    (*unpack)(dst, src, count);
+  } else {
+    /* Go via RGBA8888 a chunk at a time */
+    const guint8 *s = src;
+    guint8 *d = dst;
+    for (; count > 0; count -= n, s += n * sbpp, d += n * dbpp) {
+      n = MIN(count, CHUNK);
+      (*unpack)(tmp, s, n);
+      (*pack)(d, tmp, n);
+    }
+  }
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Convert one row of YUV
+ *-----------------------------------------------------------------------*/
+static void
+_yuv_row(const PwPixelKernels *k, PwPixelFormat dst_format, guint8 *dst,
+	 const guint8 *y, const guint8 *u, const guint8 *v, guint uvstep,
+	 gsize count, const PwYuvCoeffs *coeffs)
+{
+  PwPixelYuvFunc *yuv = (uvstep == 2) ? k->nv12_to_rgba : k->yuv420_to_rgba;
+  PwPixelRowFunc *pack = _from_rgba(k, dst_format);
+  guint dbpp = pwpixel_formats[dst_format].bytes_per_pixel;
+  guint8 tmp[4 * CHUNK];
+  gsize n;
+
+  if (pack == NULL) {
+    (*yuv)(dst, y, u, v, count, coeffs);
+    return;
+  }
+  /* CHUNK is even so chroma stays aligned to pairs */
+  for (; count > 0; count -= n, dst += n * dbpp, y += n,
+	 u += n / 2 * uvstep, v += n / 2 * uvstep) {
+    n = MIN(count, CHUNK);
+    (*yuv)(tmp, y, u, v, n, coeffs);
+    (*pack)(dst, tmp, n);
+  }
+}
+
+gboolean
+pwpixel_convert_yuv_row(PwPixelFormat dst_format, void *dst,
+			const guint8 *y, const guint8 *u, const guint8 *v,
+			guint uvstep, gsize count,
+			PwYuvMatrix matrix, GError **error)
+{
+  PwYuvCoeffs coeffs;
+  if (IS_YUV(dst_format) || pwpixel_format_info(dst_format) == NULL ||
+      (uvstep != 1 && uvstep != 2)) {
+    g_set_error(error, PWPIXEL_ERROR, 0, "Unsupported YUV row conversion");
+    return FALSE;
+  }
+  _yuv_coeffs(&coeffs, matrix);
+  _yuv_row(_kernels(), dst_format, dst, y, u, v, uvstep, count, &coeffs);
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Convert whole image
+ *-----------------------------------------------------------------------*/
+/* Chroma pointers and step for row (not pair) y */
+static void
+_chroma_row(const PwPixelImage *img, guint row,
+	    guint8 **u, guint8 **v, guint *uvstep)
+{
+  guint crow = row >> 1;
+  if (img->format == PW_PIXEL_NV12) {
+    *u = img->data[1] + crow * img->stride[1];
+    *v = *u + 1;
+    *uvstep = 2;
+  } else {
+    *u = img->data[1] + crow * img->stride[1];
+    *v = img->data[2] + crow * img->stride[2];
+    *uvstep = 1;
+  }
+}
+
+/* Encode pair of RGBA rows (second may be the same as the first) */
+static void
+_rgba_to_yuv_rows(const PwPixelImage *dst, guint row,
+		  const guint8 *rgba0, const guint8 *rgba1, PwYuvMatrix matrix)
+{
+  guint8 *y0 = dst->data[0] + row * dst->stride[0];
+  guint8 *y1 = y0 + dst->stride[0];
+  guint8 *u, *v;
+  guint uvstep, x;
+  _chroma_row(dst, row, &u, &v, &uvstep);
+
+  for (x=0; x < dst->width; x += 2) {
+    guint nx = MIN(2, dst->width - x);
+    gint yv, uv, vv, usum = 0, vsum = 0, n = 0;
+    guint i;
+    for (i=0; i < nx; i++) {
+      const guint8 *p0 = rgba0 + 4 * (x + i);
+      const guint8 *p1 = rgba1 + 4 * (x + i);
+      _rgb_to_yuv(&yv, &uv, &vv, p0[0], p0[1], p0[2], matrix);
+      y0[x + i] = yv;
+      usum += uv;
+      vsum += vv;
+      n++;
+      if (rgba1 != rgba0) {
+	_rgb_to_yuv(&yv, &uv, &vv, p1[0], p1[1], p1[2], matrix);
+	y1[x + i] = yv;
+	usum += uv;
+	vsum += vv;
+	n++;
+      }
+    }
+    u[x / 2 * uvstep] = (usum + n / 2) / n;
+    v[x / 2 * uvstep] = (vsum + n / 2) / n;
+  }
+}
+
+gboolean
+pwpixel_convert_image(const PwPixelImage *dst, const PwPixelImage *src,
+		      PwYuvMatrix matrix, GError **error)
+{
+  const PwPixelKernels *k = _kernels();
+  PwYuvCoeffs coeffs;
+  guint row;
+
+  if (dst->width != src->width || dst->height != src->height) {
+    g_set_error(error, PWPIXEL_ERROR, 0, "Image sizes differ");
+    return FALSE;
+  }
+  if (pwpixel_format_info(dst->format) == NULL ||
+      pwpixel_format_info(src->format) == NULL) {
+    g_set_error(error, PWPIXEL_ERROR, 0, "Unsupported pixel format");
+    return FALSE;
+  }
+
+  if (! IS_YUV(src->format) && ! IS_YUV(dst->format)) {
+    /* Packed to packed */
+    for (row=0; row < dst->height; row++) {
+      pwpixel_convert_row(dst->format,
+			  dst->data[0] + row * dst->stride[0],
+			  src->format,
+			  src->data[0] + row * src->stride[0],
+			  dst->width, NULL);
+    }
+  } else if (IS_YUV(src->format) && ! IS_YUV(dst->format)) {
+    /* Decode */
+    _yuv_coeffs(&coeffs, matrix);
+    for (row=0; row < dst->height; row++) {
+      guint8 *u, *v;
+      guint uvstep;
+      _chroma_row(src, row, &u, &v, &uvstep);
+      _yuv_row(k, dst->format, dst->data[0] + row * dst->stride[0],
+	       src->data[0] + row * src->stride[0], u, v, uvstep,
+	       dst->width, &coeffs);
+    }
+  } else if (IS_YUV(src->format) && IS_YUV(dst->format)) {
+    /* Repack chroma */
+    guint cwidth = (dst->width + 1) / 2;
+    for (row=0; row < dst->height; row++) {
+      memcpy(dst->data[0] + row * dst->stride[0],
+	     src->data[0] + row * src->stride[0], dst->width);
+      if ((row & 1) == 0) {
+	guint8 *su, *sv, *du, *dv;
+	guint sstep, dstep, x;
+	_chroma_row(src, row, &su, &sv, &sstep);
+	_chroma_row(dst, row, &du, &dv, &dstep);
+	for (x=0; x < cwidth; x++) {
+	  du[x * dstep] = su[x * sstep];
+	  dv[x * dstep] = sv[x * sstep];
+	}
+      }
+    }
+  } else {
+    /* Encode, via RGBA8888 rows */
+    guint8 *rgba0 = g_malloc(4 * dst->width);
+    guint8 *rgba1 = g_malloc(4 * dst->width);
+    for (row=0; row < dst->height; row += 2) {
+      pwpixel_convert_row(PW_PIXEL_RGBA8888, rgba0,
+			  src->format, src->data[0] + row * src->stride[0],
+			  dst->width, NULL);
+      if (row + 1 < dst->height) {
+	pwpixel_convert_row(PW_PIXEL_RGBA8888, rgba1,
+			    src->format,
+			    src->data[0] + (row + 1) * src->stride[0],
+			    dst->width, NULL);
+	_rgba_to_yuv_rows(dst, row, rgba0, rgba1, matrix);
+      } else {
+	_rgba_to_yuv_rows(dst, row, rgba0, rgba0, matrix);
+      }
+    }
+    g_free(rgba0);
+    g_free(rgba1);
+  }
+  return TRUE;
+}
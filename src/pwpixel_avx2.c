@@ -0,0 +1,189 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Pixel conversion kernels using AVX2.
+ *	Built with -mavx2, so only called after checking the CPU.
+ *=======================================================================*/
+#include "pwpixel_kernels.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+/* Pair of 16-bit coefficients for _mm256_madd_epi16 */
+#define PAIR(lo, hi) ((gint32)(((guint32)(guint16)(hi) << 16) | (guint16)(lo)))
+
+/* RGBA <-> BGRA, 8 pixels at a time */
+static void
+avx2_swap_rb(guint8 *dst, const guint8 *src, gsize count)
+{
+  const __m256i shuffle = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11,
+					   14,13,12,15,
+					   2,1,0,3, 6,5,4,7, 10,9,8,11,
+					   14,13,12,15);
+  gsize i;
+  for (i=0; i + 8 <= count; i += 8) {
+    STORE(dst + 4 * i, _mm256_shuffle_epi8(LOAD(src + 4 * i), shuffle));
+  }
+  pwpixel_c_swap_rb(dst + 4 * i, src + 4 * i, count - i);
+}
+
+/* Eight RGBA pixels to RGB565 in low half of 32-bit lanes, sign-extended */
+static inline __m256i
+avx2_565(__m256i p)
+{
+  __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xf8)),
+				8);
+  __m256i g = _mm256_srli_epi32(_mm256_and_si256(p,
+						 _mm256_set1_epi32(0xfc00)),
+				5);
+  __m256i b = _mm256_srli_epi32(_mm256_and_si256(p,
+						 _mm256_set1_epi32(0xf80000)),
+				19);
+  __m256i v = _mm256_or_si256(r, _mm256_or_si256(g, b));
+  return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+static void
+avx2_rgba_to_rgb565(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    __m256i a = avx2_565(LOAD(src + 4 * i));
+    __m256i b = avx2_565(LOAD(src + 4 * i + 32));
+    /* Pack works within 128-bit lanes, so put quarters back in order */
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    STORE(dst + 2 * i, p);
+  }
+  pwpixel_c_rgba_to_rgb565(dst + 2 * i, src + 4 * i, count - i);
+}
+
+/*-----------------------------------------------------------------------
+ *	YUV to RGBA, 16 pixels at a time.  Arithmetic identical to the
+ *	SSE2 version, but unpack and pack work within each 128-bit lane
+ *	so pixels 0-7 are in the low lane and 8-15 in the high lane.
+ *-----------------------------------------------------------------------*/
+static inline void
+avx2_yuv16(guint8 *dst, __m256i y16, __m256i u16, __m256i v16,
+	   const PwYuvCoeffs *c)
+{
+  const __m256i round = _mm256_set1_epi32(1 << (PWPIXEL_YUV_SHIFT - 1));
+  const __m256i k_r = _mm256_set1_epi32(PAIR(c->cy, c->crv));
+  const __m256i k_gu = _mm256_set1_epi32(PAIR(c->cy, -c->cgu));
+  const __m256i k_gv = _mm256_set1_epi32(PAIR(-c->cgv, 0));
+  const __m256i k_b = _mm256_set1_epi32(PAIR(c->cy, c->cbu));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha = _mm256_set1_epi16(255);
+  __m256i yv, yu, v0, rl, rh, gl, gh, bl, bh, r, g, b, rg, ba, t0, t1, p0, p1;
+
+#define SCALE(x) _mm256_srai_epi32(_mm256_add_epi32((x), round), \
+				   PWPIXEL_YUV_SHIFT)
+  yv = _mm256_unpacklo_epi16(y16, v16);
+  yu = _mm256_unpacklo_epi16(y16, u16);
+  v0 = _mm256_unpacklo_epi16(v16, zero);
+  rl = SCALE(_mm256_madd_epi16(yv, k_r));
+  gl = SCALE(_mm256_add_epi32(_mm256_madd_epi16(yu, k_gu),
+			      _mm256_madd_epi16(v0, k_gv)));
+  bl = SCALE(_mm256_madd_epi16(yu, k_b));
+  yv = _mm256_unpackhi_epi16(y16, v16);
+  yu = _mm256_unpackhi_epi16(y16, u16);
+  v0 = _mm256_unpackhi_epi16(v16, zero);
+  rh = SCALE(_mm256_madd_epi16(yv, k_r));
+  gh = SCALE(_mm256_add_epi32(_mm256_madd_epi16(yu, k_gu),
+			      _mm256_madd_epi16(v0, k_gv)));
+  bh = SCALE(_mm256_madd_epi16(yu, k_b));
+#undef SCALE
+  r = _mm256_packs_epi32(rl, rh);
+  g = _mm256_packs_epi32(gl, gh);
+  b = _mm256_packs_epi32(bl, bh);
+
+  rg = _mm256_packus_epi16(r, g);
+  ba = _mm256_packus_epi16(b, alpha);
+  t0 = _mm256_unpacklo_epi8(rg, ba);
+  t1 = _mm256_unpackhi_epi8(rg, ba);
+  p0 = _mm256_unpacklo_epi8(t0, t1);	/* Pixels 0-3, 8-11 */
+  p1 = _mm256_unpackhi_epi8(t0, t1);	/* Pixels 4-7, 12-15 */
+  STORE(dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+  STORE(dst + 32, _mm256_permute2x128_si256(p0, p1, 0x31));
+}
+
+/* Duplicate eight 16-bit chroma values, one per pixel of 16 */
+static inline __m256i
+avx2_dup_chroma(__m128i c)
+{
+  return _mm256_inserti128_si256(
+	   _mm256_castsi128_si256(_mm_unpacklo_epi16(c, c)),
+	   _mm_unpackhi_epi16(c, c), 1);
+}
+
+static void
+avx2_yuv420_to_rgba(guint8 *dst, const guint8 *y,
+		    const guint8 *u, const guint8 *v,
+		    gsize count, const PwYuvCoeffs *c)
+{
+  const __m256i yoff = _mm256_set1_epi16(c->yoff);
+  const __m128i coff = _mm_set1_epi16(128);
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    __m256i y16 = _mm256_cvtepu8_epi16(
+		    _mm_loadu_si128((const __m128i *)(y + i)));
+    __m128i u8 = _mm_cvtepu8_epi16(
+		   _mm_loadl_epi64((const __m128i *)(u + i / 2)));
+    __m128i v8 = _mm_cvtepu8_epi16(
+		   _mm_loadl_epi64((const __m128i *)(v + i / 2)));
+    avx2_yuv16(dst + 4 * i, _mm256_sub_epi16(y16, yoff),
+	       avx2_dup_chroma(_mm_sub_epi16(u8, coff)),
+	       avx2_dup_chroma(_mm_sub_epi16(v8, coff)), c);
+  }
+  pwpixel_c_yuv420_to_rgba(dst + 4 * i, y + i, u + i / 2, v + i / 2,
+			   count - i, c);
+}
+
+static void
+avx2_nv12_to_rgba(guint8 *dst, const guint8 *y,
+		  const guint8 *uv, const guint8 *unused,
+		  gsize count, const PwYuvCoeffs *c)
+{
+  const __m256i yoff = _mm256_set1_epi16(c->yoff);
+  const __m128i coff = _mm_set1_epi16(128);
+  const __m128i lo = _mm_set1_epi16(0xff);
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    __m256i y16 = _mm256_cvtepu8_epi16(
+		    _mm_loadu_si128((const __m128i *)(y + i)));
+    __m128i pairs = _mm_loadu_si128((const __m128i *)(uv + i));
+    __m128i u8 = _mm_and_si128(pairs, lo);
+    __m128i v8 = _mm_srli_epi16(pairs, 8);
+    avx2_yuv16(dst + 4 * i, _mm256_sub_epi16(y16, yoff),
+	       avx2_dup_chroma(_mm_sub_epi16(u8, coff)),
+	       avx2_dup_chroma(_mm_sub_epi16(v8, coff)), c);
+  }
+  pwpixel_c_nv12_to_rgba(dst + 4 * i, y + i, uv + i, NULL, count - i, c);
+}
+
+void
+pwpixel_kernels_avx2(PwPixelKernels *k)
+{
+  k->swap_rb = avx2_swap_rb;
+  k->rgba_to_rgb565 = avx2_rgba_to_rgb565;
+  k->yuv420_to_rgba = avx2_yuv420_to_rgba;
+  k->nv12_to_rgba = avx2_nv12_to_rgba;
+}
+
+#endif /* __AVX2__ */
@@ -0,0 +1,66 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Pixel conversion kernels (internal to libpwutil)
+ *=======================================================================*/
+#ifndef INC_pwpixel_kernels_h
+#define INC_pwpixel_kernels_h
+
+#include <glib.h>
+
+/* YUV to RGB coefficients, fixed point with PWPIXEL_YUV_SHIFT bits */
+#define PWPIXEL_YUV_SHIFT 13
+typedef struct {
+  gint16 yoff;			/* Black level of Y */
+  gint16 cy;			/* Y scale */
+  gint16 crv, cgu, cgv, cbu;	/* Chroma contributions (cgu,cgv subtract) */
+} PwYuvCoeffs;
+
+/* Row of packed pixels to row of packed pixels */
+typedef void PwPixelRowFunc(guint8 */*dst*/, const guint8 */*src*/,
+			    gsize /*count*/);
+/* Row of YUV to RGBA8888.  For NV12, u points to interleaved UV. */
+typedef void PwPixelYuvFunc(guint8 */*dst*/, const guint8 */*y*/,
+			    const guint8 */*u*/, const guint8 */*v*/,
+			    gsize /*count*/, const PwYuvCoeffs *);
+
+typedef struct {
+  PwPixelRowFunc *swap_rb;	/* RGBA8888 <-> BGRA8888 */
+  PwPixelRowFunc *rgba_to_rgb565;
+  PwPixelRowFunc *rgb565_to_rgba;
+  PwPixelRowFunc *rgba_to_rgb888;
+  PwPixelRowFunc *rgb888_to_rgba;
+  PwPixelYuvFunc *yuv420_to_rgba;
+  PwPixelYuvFunc *nv12_to_rgba;
+} PwPixelKernels;
+
+/* Portable versions, also used for the tail of each row */
+extern PwPixelRowFunc pwpixel_c_swap_rb;
+extern PwPixelRowFunc pwpixel_c_rgba_to_rgb565;
+extern PwPixelRowFunc pwpixel_c_rgb565_to_rgba;
+extern PwPixelRowFunc pwpixel_c_rgba_to_rgb888;
+extern PwPixelRowFunc pwpixel_c_rgb888_to_rgba;
+extern PwPixelYuvFunc pwpixel_c_yuv420_to_rgba;
+extern PwPixelYuvFunc pwpixel_c_nv12_to_rgba;
+
+/* Override entries with accelerated versions */
+extern void pwpixel_kernels_sse2(PwPixelKernels *);
+extern void pwpixel_kernels_avx2(PwPixelKernels *);
+extern void pwpixel_kernels_neon(PwPixelKernels *);
+
+#endif /* INC_pwpixel_kernels_h */
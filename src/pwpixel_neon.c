@@ -0,0 +1,210 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Pixel conversion kernels using NEON
+ *=======================================================================*/
+#include "pwpixel_kernels.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+/* RGBA <-> BGRA, 16 pixels at a time */
+static void
+neon_swap_rb(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + 4 * i);
+    uint8x16_t t = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = t;
+    vst4q_u8(dst + 4 * i, p);
+  }
+  pwpixel_c_swap_rb(dst + 4 * i, src + 4 * i, count - i);
+}
+
+/* Eight pixels to RGB565 by shifting each channel in from the top */
+static inline uint16x8_t
+neon_565(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+  uint16x8_t p = vshll_n_u8(r, 8);
+  p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+  p = vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+  return p;
+}
+
+static void
+neon_rgba_to_rgb565(guint8 *dst, const guint8 *src, gsize count)
+{
+  guint16 *out = (guint16 *)dst;
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + 4 * i);
+    vst1q_u16(out + i, neon_565(vget_low_u8(p.val[0]),
+				vget_low_u8(p.val[1]),
+				vget_low_u8(p.val[2])));
+    vst1q_u16(out + i + 8, neon_565(vget_high_u8(p.val[0]),
+				    vget_high_u8(p.val[1]),
+				    vget_high_u8(p.val[2])));
+  }
+  pwpixel_c_rgba_to_rgb565(dst + 2 * i, src + 4 * i, count - i);
+}
+
+static void
+neon_rgb565_to_rgba(guint8 *dst, const guint8 *src, gsize count)
+{
+  const guint16 *in = (const guint16 *)src;
+  gsize i;
+  for (i=0; i + 8 <= count; i += 8) {
+    uint16x8_t p = vld1q_u16(in + i);
+    uint8x8x4_t q;
+    uint8x8_t r = vshrn_n_u16(p, 8);			/* rrrrrggg */
+    uint8x8_t g = vshrn_n_u16(vshlq_n_u16(p, 5), 8);	/* gggggg.. */
+    uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));		/* bbbbb... */
+    q.val[0] = vsri_n_u8(r, r, 5);
+    q.val[1] = vsri_n_u8(g, g, 6);
+    q.val[2] = vsri_n_u8(b, b, 5);
+    q.val[3] = vdup_n_u8(255);
+    vst4_u8(dst + 4 * i, q);
+  }
+  pwpixel_c_rgb565_to_rgba(dst + 4 * i, src + 2 * i, count - i);
+}
+
+static void
+neon_rgba_to_rgb888(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16x4_t p = vld4q_u8(src + 4 * i);
+    uint8x16x3_t q;
+    q.val[0] = p.val[0];
+    q.val[1] = p.val[1];
+    q.val[2] = p.val[2];
+    vst3q_u8(dst + 3 * i, q);
+  }
+  pwpixel_c_rgba_to_rgb888(dst + 3 * i, src + 4 * i, count - i);
+}
+
+static void
+neon_rgb888_to_rgba(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16x3_t p = vld3q_u8(src + 3 * i);
+    uint8x16x4_t q;
+    q.val[0] = p.val[0];
+    q.val[1] = p.val[1];
+    q.val[2] = p.val[2];
+    q.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst + 4 * i, q);
+  }
+  pwpixel_c_rgb888_to_rgba(dst + 4 * i, src + 3 * i, count - i);
+}
+
+/*-----------------------------------------------------------------------
+ *	YUV to RGBA, 8 pixels at a time.  The rounding narrowing shift
+ *	and saturating narrow give the same result as the C version.
+ *-----------------------------------------------------------------------*/
+static inline int16x4_t
+neon_channel(int32x4_t yy, int16x4_t u, int16x4_t v,
+	     gint16 ku, gint16 kv)
+{
+  int32x4_t acc = vmlal_n_s16(vmlal_n_s16(yy, u, ku), v, kv);
+  return vqrshrn_n_s32(acc, PWPIXEL_YUV_SHIFT);
+}
+
+static inline void
+neon_yuv8(guint8 *dst, int16x8_t y, int16x8_t u, int16x8_t v,
+	  const PwYuvCoeffs *c)
+{
+  int32x4_t ylo = vmull_n_s16(vget_low_s16(y), c->cy);
+  int32x4_t yhi = vmull_n_s16(vget_high_s16(y), c->cy);
+  int16x4_t ulo = vget_low_s16(u), uhi = vget_high_s16(u);
+  int16x4_t vlo = vget_low_s16(v), vhi = vget_high_s16(v);
+  uint8x8x4_t q;
+
+  q.val[0] = vqmovun_s16(vcombine_s16(neon_channel(ylo, ulo, vlo,
+						   0, c->crv),
+				      neon_channel(yhi, uhi, vhi,
+						   0, c->crv)));
+  q.val[1] = vqmovun_s16(vcombine_s16(neon_channel(ylo, ulo, vlo,
+						   -c->cgu, -c->cgv),
+				      neon_channel(yhi, uhi, vhi,
+						   -c->cgu, -c->cgv)));
+  q.val[2] = vqmovun_s16(vcombine_s16(neon_channel(ylo, ulo, vlo,
+						   c->cbu, 0),
+				      neon_channel(yhi, uhi, vhi,
+						   c->cbu, 0)));
+  q.val[3] = vdup_n_u8(255);
+  vst4_u8(dst, q);
+}
+
+/* Widen to signed 16 bits, subtracting offset (mod 2^16 is fine) */
+#define WIDEN(x, off) vreinterpretq_s16_u16(vsubl_u8((x), vdup_n_u8(off)))
+
+static void
+neon_yuv420_to_rgba(guint8 *dst, const guint8 *y,
+		    const guint8 *u, const guint8 *v,
+		    gsize count, const PwYuvCoeffs *c)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16_t y8 = vld1q_u8(y + i);
+    uint8x8x2_t u8 = vzip_u8(vld1_u8(u + i / 2), vld1_u8(u + i / 2));
+    uint8x8x2_t v8 = vzip_u8(vld1_u8(v + i / 2), vld1_u8(v + i / 2));
+    neon_yuv8(dst + 4 * i, WIDEN(vget_low_u8(y8), c->yoff),
+	      WIDEN(u8.val[0], 128), WIDEN(v8.val[0], 128), c);
+    neon_yuv8(dst + 4 * i + 32, WIDEN(vget_high_u8(y8), c->yoff),
+	      WIDEN(u8.val[1], 128), WIDEN(v8.val[1], 128), c);
+  }
+  pwpixel_c_yuv420_to_rgba(dst + 4 * i, y + i, u + i / 2, v + i / 2,
+			   count - i, c);
+}
+
+static void
+neon_nv12_to_rgba(guint8 *dst, const guint8 *y,
+		  const guint8 *uv, const guint8 *unused,
+		  gsize count, const PwYuvCoeffs *c)
+{
+  gsize i;
+  for (i=0; i + 16 <= count; i += 16) {
+    uint8x16_t y8 = vld1q_u8(y + i);
+    uint8x8x2_t p = vld2_u8(uv + i);
+    uint8x8x2_t u8 = vzip_u8(p.val[0], p.val[0]);
+    uint8x8x2_t v8 = vzip_u8(p.val[1], p.val[1]);
+    neon_yuv8(dst + 4 * i, WIDEN(vget_low_u8(y8), c->yoff),
+	      WIDEN(u8.val[0], 128), WIDEN(v8.val[0], 128), c);
+    neon_yuv8(dst + 4 * i + 32, WIDEN(vget_high_u8(y8), c->yoff),
+	      WIDEN(u8.val[1], 128), WIDEN(v8.val[1], 128), c);
+  }
+  pwpixel_c_nv12_to_rgba(dst + 4 * i, y + i, uv + i, NULL, count - i, c);
+}
+
+void
+pwpixel_kernels_neon(PwPixelKernels *k)
+{
+  k->swap_rb = neon_swap_rb;
+  k->rgba_to_rgb565 = neon_rgba_to_rgb565;
+  k->rgb565_to_rgba = neon_rgb565_to_rgba;
+  k->rgba_to_rgb888 = neon_rgba_to_rgb888;
+  k->rgb888_to_rgba = neon_rgb888_to_rgba;
+  k->yuv420_to_rgba = neon_yuv420_to_rgba;
+  k->nv12_to_rgba = neon_nv12_to_rgba;
+}
+
+#endif /* __ARM_NEON */
@@ -0,0 +1,173 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Pixel conversion kernels using SSE2
+ *=======================================================================*/
+#include "pwpixel_kernels.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+/* Pair of 16-bit coefficients for _mm_madd_epi16 */
+#define PAIR(lo, hi) ((gint32)(((guint32)(guint16)(hi) << 16) | (guint16)(lo)))
+
+/* RGBA <-> BGRA, 4 pixels at a time */
+static void
+sse2_swap_rb(guint8 *dst, const guint8 *src, gsize count)
+{
+  const __m128i ga = _mm_set1_epi32(0xff00ff00);
+  const __m128i lo = _mm_set1_epi32(0x000000ff);
+  gsize i;
+  for (i=0; i + 4 <= count; i += 4) {
+    __m128i p = LOAD(src + 4 * i);
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, lo), 16);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), lo);
+    STORE(dst + 4 * i, _mm_or_si128(_mm_and_si128(p, ga),
+				    _mm_or_si128(r, b)));
+  }
+  pwpixel_c_swap_rb(dst + 4 * i, src + 4 * i, count - i);
+}
+
+/* Four RGBA pixels to RGB565 in low half of 32-bit lanes, sign-extended */
+static inline __m128i
+sse2_565(__m128i p)
+{
+  __m128i r = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf8)), 8);
+  __m128i g = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xfc00)), 5);
+  __m128i b = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf80000)), 19);
+  __m128i v = _mm_or_si128(r, _mm_or_si128(g, b));
+  /* So that signed saturating pack leaves it unchanged */
+  return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+static void
+sse2_rgba_to_rgb565(guint8 *dst, const guint8 *src, gsize count)
+{
+  gsize i;
+  for (i=0; i + 8 <= count; i += 8) {
+    __m128i a = sse2_565(LOAD(src + 4 * i));
+    __m128i b = sse2_565(LOAD(src + 4 * i + 16));
+    STORE(dst + 2 * i, _mm_packs_epi32(a, b));
+  }
+  pwpixel_c_rgba_to_rgb565(dst + 2 * i, src + 4 * i, count - i);
+}
+
+/*-----------------------------------------------------------------------
+ *	YUV to RGBA, 8 pixels at a time.
+ *	y16: Y - black level; u16, v16: chroma - 128, one per pixel
+ *-----------------------------------------------------------------------*/
+static inline void
+sse2_yuv8(guint8 *dst, __m128i y16, __m128i u16, __m128i v16,
+	  const PwYuvCoeffs *c)
+{
+  const __m128i round = _mm_set1_epi32(1 << (PWPIXEL_YUV_SHIFT - 1));
+  const __m128i k_r = _mm_set1_epi32(PAIR(c->cy, c->crv));
+  const __m128i k_gu = _mm_set1_epi32(PAIR(c->cy, -c->cgu));
+  const __m128i k_gv = _mm_set1_epi32(PAIR(-c->cgv, 0));
+  const __m128i k_b = _mm_set1_epi32(PAIR(c->cy, c->cbu));
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi16(255);
+  __m128i yv, yu, v0, rl, rh, gl, gh, bl, bh, r, g, b, rg, ba, t0, t1;
+
+#define SCALE(x) _mm_srai_epi32(_mm_add_epi32((x), round), PWPIXEL_YUV_SHIFT)
+  yv = _mm_unpacklo_epi16(y16, v16);
+  yu = _mm_unpacklo_epi16(y16, u16);
+  v0 = _mm_unpacklo_epi16(v16, zero);
+  rl = SCALE(_mm_madd_epi16(yv, k_r));
+  gl = SCALE(_mm_add_epi32(_mm_madd_epi16(yu, k_gu), _mm_madd_epi16(v0, k_gv)));
+  bl = SCALE(_mm_madd_epi16(yu, k_b));
+  yv = _mm_unpackhi_epi16(y16, v16);
+  yu = _mm_unpackhi_epi16(y16, u16);
+  v0 = _mm_unpackhi_epi16(v16, zero);
+  rh = SCALE(_mm_madd_epi16(yv, k_r));
+  gh = SCALE(_mm_add_epi32(_mm_madd_epi16(yu, k_gu), _mm_madd_epi16(v0, k_gv)));
+  bh = SCALE(_mm_madd_epi16(yu, k_b));
+#undef SCALE
+  r = _mm_packs_epi32(rl, rh);
+  g = _mm_packs_epi32(gl, gh);
+  b = _mm_packs_epi32(bl, bh);
+
+  /* Saturate to bytes and interleave */
+  rg = _mm_packus_epi16(r, g);		/* r0..r7 g0..g7 */
+  ba = _mm_packus_epi16(b, alpha);	/* b0..b7 a0..a7 */
+  t0 = _mm_unpacklo_epi8(rg, ba);	/* r0 b0 r1 b1 ... */
+  t1 = _mm_unpackhi_epi8(rg, ba);	/* g0 a0 g1 a1 ... */
+  STORE(dst, _mm_unpacklo_epi8(t0, t1));
+  STORE(dst + 16, _mm_unpackhi_epi8(t0, t1));
+}
+
+static void
+sse2_yuv420_to_rgba(guint8 *dst, const guint8 *y,
+		    const guint8 *u, const guint8 *v,
+		    gsize count, const PwYuvCoeffs *c)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i yoff = _mm_set1_epi16(c->yoff);
+  const __m128i coff = _mm_set1_epi16(128);
+  gsize i;
+  for (i=0; i + 8 <= count; i += 8) {
+    __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)),
+				    zero);
+    gint32 u4, v4;
+    __m128i u16, v16;
+    memcpy(&u4, u + i / 2, 4);
+    memcpy(&v4, v + i / 2, 4);
+    u16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero), coff);
+    v16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero), coff);
+    sse2_yuv8(dst + 4 * i, _mm_sub_epi16(y16, yoff),
+	      _mm_unpacklo_epi16(u16, u16), _mm_unpacklo_epi16(v16, v16), c);
+  }
+  pwpixel_c_yuv420_to_rgba(dst + 4 * i, y + i, u + i / 2, v + i / 2,
+			   count - i, c);
+}
+
+static void
+sse2_nv12_to_rgba(guint8 *dst, const guint8 *y,
+		  const guint8 *uv, const guint8 *unused,
+		  gsize count, const PwYuvCoeffs *c)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i yoff = _mm_set1_epi16(c->yoff);
+  const __m128i coff = _mm_set1_epi16(128);
+  const __m128i lo = _mm_set1_epi16(0xff);
+  gsize i;
+  for (i=0; i + 8 <= count; i += 8) {
+    __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)),
+				    zero);
+    __m128i pairs = _mm_loadl_epi64((const __m128i *)(uv + i));
+    __m128i u16 = _mm_sub_epi16(_mm_and_si128(pairs, lo), coff);
+    __m128i v16 = _mm_sub_epi16(_mm_srli_epi16(pairs, 8), coff);
+    sse2_yuv8(dst + 4 * i, _mm_sub_epi16(y16, yoff),
+	      _mm_unpacklo_epi16(u16, u16), _mm_unpacklo_epi16(v16, v16), c);
+  }
+  pwpixel_c_nv12_to_rgba(dst + 4 * i, y + i, uv + i, NULL, count - i, c);
+}
+
+void
+pwpixel_kernels_sse2(PwPixelKernels *k)
+{
+  k->swap_rb = sse2_swap_rb;
+  k->rgba_to_rgb565 = sse2_rgba_to_rgb565;
+  k->yuv420_to_rgba = sse2_yuv420_to_rgba;
+  k->nv12_to_rgba = sse2_nv12_to_rgba;
+}
+
+#endif /* __SSE2__ */
@@ -0,0 +1,411 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Ring buffer between one writing thread and one reading thread,
+ *	as a pw_IWrite and a pw_IRead, taking no lock.
+ *
+ *	Each side counts the bytes it has ever moved, on a cache line
+ *	of its own, and keeps a copy of the other's count to look at
+ *	before going to the other's cache line.  A side finding the
+ *	ring full (or empty) says it is waiting and sleeps on a futex,
+ *	which the other wakes only if told it is waiting, so a ring
+ *	which keeps moving makes no system calls.  The flag and futex
+ *	have a line of their own too, which the other side then only
+ *	reads.
+ *
+ *	pwring_reserve()/pwring_commit() and pwring_peek()/
+ *	pwring_consume() give the space itself, to save a copy.
+ *=======================================================================*/
+#define _GNU_SOURCE
+#include "pwutil.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define PWRING_HUGEPAGE (2 * 1024 * 1024)
+
+typedef struct {
+  guint64 pos;			/* Bytes ever moved by this side */
+  guint64 other;		/* Copy of the other side's pos */
+  guint64 stalls;
+  guint64 max_used;		/* Writer only: most bytes in the ring */
+} PwRingSide;
+
+typedef struct {
+  gint wake;			/* Futex, bumped to wake this side */
+  gint waiting;
+} PwRingWait;
+
+struct _PwRing {
+  pw_IWrite iwrite;
+  pw_IRead iread;
+  guint8 *buf;
+  gsize size;			/* Power of 2 */
+  gsize map_size;
+  gint closed;
+  PwStat *used;			/* Bytes in the ring, at each commit */
+  PwStat *stalls;
+  PwRingSide writer __attribute__((aligned(64)));
+  PwRingSide reader __attribute__((aligned(64)));
+  PwRingWait writer_wait __attribute__((aligned(64)));
+  PwRingWait reader_wait __attribute__((aligned(64)));
+};
+
+static void
+_pwring_sleep(PwRingWait *side, gint wake)
+{
+#if defined(__linux__)
+  syscall(SYS_futex, &side->wake, FUTEX_WAIT_PRIVATE, wake, NULL, NULL, 0);
+#else
+  g_usleep(100);
+#endif
+}
+
+static void
+_pwring_wake(PwRingWait *side)
+{
+  if (__atomic_load_n(&side->waiting, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&side->wake, 1, __ATOMIC_SEQ_CST);
+#if defined(__linux__)
+    syscall(SYS_futex, &side->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+  }
+}
+
+/* Bytes free to write, waiting for some if asked */
+static gsize
+_pwring_space(PwRing *self, gboolean wait)
+{
+  PwRingSide *w = &self->writer;
+  PwRingWait *ww = &self->writer_wait;
+
+  for (;;) {
+    gint wake;
+    if (w->pos - w->other < self->size) break;
+    w->other = __atomic_load_n(&self->reader.pos, __ATOMIC_ACQUIRE);
+    if (w->pos - w->other < self->size || ! wait) break;
+    /* Say so, then look again, as the reader may have just missed it */
+    wake = __atomic_load_n(&ww->wake, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ww->waiting, 1, __ATOMIC_SEQ_CST);
+    w->other = __atomic_load_n(&self->reader.pos, __ATOMIC_SEQ_CST);
+    if (w->pos - w->other == self->size) {
+      w->stalls++;
+      pwstats_add(self->stalls, 1);
+      _pwring_sleep(ww, wake);
+    }
+    __atomic_store_n(&ww->waiting, 0, __ATOMIC_RELAXED);
+  }
+  return self->size - (w->pos - w->other);
+}
+
+/* Bytes to read, waiting for some if asked and not closed */
+static gsize
+_pwring_avail(PwRing *self, gboolean wait)
+{
+  PwRingSide *r = &self->reader;
+  PwRingWait *rw = &self->reader_wait;
+
+  for (;;) {
+    gint wake;
+    if (r->other != r->pos) break;
+    r->other = __atomic_load_n(&self->writer.pos, __ATOMIC_ACQUIRE);
+    if (r->other != r->pos || ! wait ||
+	__atomic_load_n(&self->closed, __ATOMIC_ACQUIRE)) break;
+    wake = __atomic_load_n(&rw->wake, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rw->waiting, 1, __ATOMIC_SEQ_CST);
+    r->other = __atomic_load_n(&self->writer.pos, __ATOMIC_SEQ_CST);
+    if (r->other == r->pos && ! __atomic_load_n(&self->closed,
+						__ATOMIC_SEQ_CST)) {
+      r->stalls++;
+      pwstats_add(self->stalls, 1);
+      _pwring_sleep(rw, wake);
+    }
+    __atomic_store_n(&rw->waiting, 0, __ATOMIC_RELAXED);
+  }
+  /* Closing made all writes visible */
+  if (r->other == r->pos) {
+    r->other = __atomic_load_n(&self->writer.pos, __ATOMIC_ACQUIRE);
+  }
+  return r->other - r->pos;
+}
+
+/*-----------------------------------------------------------------------
+ *	Zero-copy access.  Each returns the contiguous part of the space
+ *	(or data) there is, setting *len, or NULL if there is none and
+ *	it may not wait - or, for the reader, if the ring is closed.
+ *-----------------------------------------------------------------------*/
+guint8 *
+pwring_reserve(PwRing *self, gboolean wait, gsize *len)
+{
+  gsize space = _pwring_space(self, wait);
+  gsize off = self->writer.pos & (self->size - 1);
+
+  *len = MIN(space, self->size - off);
+  return (*len > 0) ? self->buf + off : NULL;
+}
+
+/* Pass on n bytes of what pwring_reserve() gave */
+void
+pwring_commit(PwRing *self, gsize n)
+{
+  PwRingSide *w = &self->writer;
+  guint64 used;
+
+  __atomic_store_n(&w->pos, w->pos + n, __ATOMIC_SEQ_CST);
+  used = w->pos - w->other;
+  if (used > w->max_used) w->max_used = used;
+  pwstats_record(self->used, used);
+  _pwring_wake(&self->reader_wait);
+}
+
+const guint8 *
+pwring_peek(PwRing *self, gboolean wait, gsize *len)
+{
+  gsize avail = _pwring_avail(self, wait);
+  gsize off = self->reader.pos & (self->size - 1);
+
+  *len = MIN(avail, self->size - off);
+  return (*len > 0) ? self->buf + off : NULL;
+}
+
+/* Done with n bytes of what pwring_peek() gave */
+void
+pwring_consume(PwRing *self, gsize n)
+{
+  PwRingSide *r = &self->reader;
+
+  __atomic_store_n(&r->pos, r->pos + n, __ATOMIC_SEQ_CST);
+  _pwring_wake(&self->writer_wait);
+}
+
+/*-----------------------------------------------------------------------
+ *	pw_IWrite and pw_IRead
+ *-----------------------------------------------------------------------*/
+static gboolean
+_pwring_write(void *priv, const void *data, gsize len, GError **error)
+{
+  PwRing *self = priv;
+  const guint8 *p = data;
+
+  while (len > 0) {
+    gsize n;
+    guint8 *space = pwring_reserve(self, TRUE, &n);
+    n = MIN(n, len);
+    memcpy(space, p, n);
+    pwring_commit(self, n);
+    p += n;
+    len -= n;
+  }
+  return TRUE;
+}
+
+static gboolean
+_pwring_read(void *priv, void *data, gsize len, GError **error)
+{
+  PwRing *self = priv;
+  guint8 *p = data;
+
+  while (len > 0) {
+    gsize n;
+    const guint8 *bytes = pwring_peek(self, TRUE, &n);
+    if (bytes == NULL) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Unexpected end of ring");
+      return FALSE;
+    }
+    n = MIN(n, len);
+    memcpy(p, bytes, n);
+    pwring_consume(self, n);
+    p += n;
+    len -= n;
+  }
+  return TRUE;
+}
+
+/* As many buffers as fit into each space, committing once for them */
+static gboolean
+_pwring_writev(void *priv, const struct iovec *iov, guint n, GError **error)
+{
+  PwRing *self = priv;
+  gsize off = 0;		/* Into iov[0] */
+
+  while (n > 0) {
+    gsize len, done = 0;
+    guint8 *space;
+
+    if (off == iov->iov_len) {
+      iov++;
+      n--;
+      off = 0;
+      continue;
+    }
+    space = pwring_reserve(self, TRUE, &len);
+    while (n > 0 && done < len) {
+      gsize take = MIN(iov->iov_len - off, len - done);
+      memcpy(space + done, (const guint8 *)iov->iov_base + off, take);
+      done += take;
+      off += take;
+      if (off == iov->iov_len) {
+	iov++;
+	n--;
+	off = 0;
+      }
+    }
+    pwring_commit(self, done);
+  }
+  return TRUE;
+}
+
+static gboolean
+_pwring_readv(void *priv, const struct iovec *iov, guint n, GError **error)
+{
+  PwRing *self = priv;
+  gsize off = 0;		/* Into iov[0] */
+
+  while (n > 0) {
+    gsize len, done = 0;
+    const guint8 *bytes;
+
+    if (off == iov->iov_len) {
+      iov++;
+      n--;
+      off = 0;
+      continue;
+    }
+    bytes = pwring_peek(self, TRUE, &len);
+    if (bytes == NULL) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+		  "Unexpected end of ring");
+      return FALSE;
+    }
+    while (n > 0 && done < len) {
+      gsize take = MIN(iov->iov_len - off, len - done);
+      memcpy((guint8 *)iov->iov_base + off, bytes + done, take);
+      done += take;
+      off += take;
+      if (off == iov->iov_len) {
+	iov++;
+	n--;
+	off = 0;
+      }
+    }
+    pwring_consume(self, done);
+  }
+  return TRUE;
+}
+
+static const pw_MIWrite pwring_miwrite = {
+  sizeof(pwring_miwrite),
+  &_pwring_write,
+  NULL,
+  &_pwring_writev,
+};
+
+static const pw_MIRead pwring_miread = {
+  sizeof(pwring_miread),
+  &_pwring_read,
+  &_pwring_readv,
+};
+
+/*-----------------------------------------------------------------------
+ *	Ring of size bytes (rounded up to a power of 2), in huge pages
+ *	if asked and there are any.  NULL if it cannot be mapped.
+ *-----------------------------------------------------------------------*/
+PwRing *
+pwring_new(gsize size, gboolean hugepages)
+{
+  PwRing *self;
+  gsize ring = 4096;
+  void *buf = MAP_FAILED;
+  gsize map_size;
+
+  while (ring < size) ring *= 2;
+  map_size = ring;
+#if defined(MAP_HUGETLB)
+  if (hugepages) {
+    map_size = (ring + PWRING_HUGEPAGE - 1) & ~(gsize)(PWRING_HUGEPAGE - 1);
+    buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (buf == MAP_FAILED) {
+    map_size = ring;
+    buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) return NULL;
+#if defined(MADV_HUGEPAGE)
+    /* Transparent huge pages, if not reserved ones */
+    if (hugepages) madvise(buf, map_size, MADV_HUGEPAGE);
+#endif
+  }
+
+  self = g_new0(PwRing, 1);
+  self->iwrite.methods = &pwring_miwrite;
+  self->iwrite.priv = self;
+  self->iread.methods = &pwring_miread;
+  self->iread.priv = self;
+  self->buf = buf;
+  self->size = ring;
+  self->map_size = map_size;
+  self->used = pwstats_histogram("pwring.used");
+  self->stalls = pwstats_counter("pwring.stalls");
+  return self;
+}
+
+const pw_IWrite *
+pwring_iwrite(PwRing *self)
+{
+  return &self->iwrite;
+}
+
+const pw_IRead *
+pwring_iread(PwRing *self)
+{
+  return &self->iread;
+}
+
+/* No more will be written: the reader gets to the end of what was */
+void
+pwring_close(PwRing *self)
+{
+  __atomic_store_n(&self->closed, 1, __ATOMIC_SEQ_CST);
+  _pwring_wake(&self->reader_wait);
+}
+
+void
+pwring_get_stats(PwRing *self, PwRingStats *stats)
+{
+  stats->written = __atomic_load_n(&self->writer.pos, __ATOMIC_RELAXED);
+  stats->read = __atomic_load_n(&self->reader.pos, __ATOMIC_RELAXED);
+  stats->max_used = self->writer.max_used;
+  stats->writer_stalls = self->writer.stalls;
+  stats->reader_stalls = self->reader.stalls;
+}
+
+/* Once neither side is using it */
+void
+pwring_free(PwRing *self)
+{
+  munmap(self->buf, self->map_size);
+  g_free(self);
+}
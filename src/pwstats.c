@@ -0,0 +1,631 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Counters and latency histograms, cheap enough to leave on.
+ *
+ *	Each thread has its own cells for each statistic, which only it
+ *	writes, so recording takes no lock.  A snapshot adds up the
+ *	cells of all threads (and of threads which have exited).
+ *
+ *	Histograms are log-linear: values below PWSTATS_SUB each have
+ *	a bucket, and each power of 2 above is split into PWSTATS_SUB
+ *	buckets, so a percentile is within 1/PWSTATS_SUB of the truth.
+ *=======================================================================*/
+#include "pwutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PWSTATS_SUB_BITS	5
+#define PWSTATS_SUB		(1 << PWSTATS_SUB_BITS)
+/* Larger values are counted in the top bucket */
+#define PWSTATS_MAX_BITS	42
+#define PWSTATS_BUCKETS	((PWSTATS_MAX_BITS - PWSTATS_SUB_BITS + 1) * PWSTATS_SUB)
+/* How often to export, unless STATSPERIOD given */
+#define PWSTATS_DEFAULT_PERIOD	1000
+
+/* One thread's share of a statistic, or a sum of them */
+typedef struct {
+  guint64 count;
+  guint64 sum;			/* Counter's value, or of recorded values */
+  guint64 min, max;
+  guint64 buckets[1];		/* PWSTATS_BUCKETS, for a histogram */
+} PwStatCells;
+
+struct _PwStat {
+  guint id;			/* Index in each thread's cells */
+  gchar *name;
+  gboolean histogram;
+  GSList *cells;		/* Of live threads */
+  PwStatCells *retired;		/* Sum from threads which have exited */
+};
+
+struct _PwStatsSnapshot {
+  gint64 time;			/* g_get_monotonic_time() */
+  guint n;
+  PwStat **stats;		/* By id, as registered at the time */
+  PwStatCells **sums;
+};
+
+typedef struct {
+  guint n;
+  PwStatCells **cells;		/* By id, NULL until first used */
+} PwStatsThread;
+
+static void _pwstats_thread_free(gpointer);
+
+static GPrivate pwstats_thread = G_PRIVATE_INIT(_pwstats_thread_free);
+/* Statistics by id, with their cells */
+static GMutex pwstats_lock;
+static GPtrArray *pwstats_all = NULL;
+
+static gsize
+_pwstats_cells_size(gboolean histogram)
+{
+  return sizeof(PwStatCells) +
+    (histogram ? (PWSTATS_BUCKETS - 1) * sizeof(guint64) : 0);
+}
+
+static PwStatCells *
+_pwstats_cells_new(gboolean histogram)
+{
+  PwStatCells *cells = g_malloc0(_pwstats_cells_size(histogram));
+  cells->min = G_MAXUINT64;
+  return cells;
+}
+
+/*-----------------------------------------------------------------------
+ *	Buckets
+ *-----------------------------------------------------------------------*/
+static inline guint
+_pwstats_bucket(guint64 value)
+{
+  guint e;
+  if (value < PWSTATS_SUB) return value;
+  if (value >> PWSTATS_MAX_BITS) return PWSTATS_BUCKETS - 1;
+  e = 63 - __builtin_clzll(value);
+  return (e - PWSTATS_SUB_BITS + 1) * PWSTATS_SUB +
+    ((value >> (e - PWSTATS_SUB_BITS)) & (PWSTATS_SUB - 1));
+}
+
+/* Smallest and largest values counted in a bucket */
+static guint64
+_pwstats_bucket_low(guint bucket)
+{
+  guint e;
+  if (bucket < PWSTATS_SUB) return bucket;
+  e = bucket / PWSTATS_SUB + PWSTATS_SUB_BITS - 1;
+  return (guint64)(PWSTATS_SUB + bucket % PWSTATS_SUB) <<
+    (e - PWSTATS_SUB_BITS);
+}
+
+static guint64
+_pwstats_bucket_high(guint bucket)
+{
+  if (bucket < PWSTATS_SUB) return bucket;
+  if (bucket == PWSTATS_BUCKETS - 1) return G_MAXUINT64;
+  return _pwstats_bucket_low(bucket + 1) - 1;
+}
+
+/*-----------------------------------------------------------------------
+ *	Registration.  Statistics are never freed; asking again for
+ *	the same name gives the same one.
+ *-----------------------------------------------------------------------*/
+static PwStat *
+_pwstats_register(const char *name, gboolean histogram)
+{
+  PwStat *stat = NULL;
+  guint i;
+
+  g_mutex_lock(&pwstats_lock);
+  if (pwstats_all == NULL) pwstats_all = g_ptr_array_new();
+  for (i=0; i < pwstats_all->len; i++) {
+    PwStat *s = g_ptr_array_index(pwstats_all, i);
+    if (strcmp(s->name, name) == 0) {
+      stat = s;
+      break;
+    }
+  }
+  if (stat == NULL) {
+    stat = g_new0(PwStat, 1);
+    stat->id = pwstats_all->len;
+    stat->name = g_strdup(name);
+    stat->histogram = histogram;
+    stat->retired = _pwstats_cells_new(histogram);
+    g_ptr_array_add(pwstats_all, stat);
+  } else if (stat->histogram != histogram) {
+    g_warning("Statistic %s is already a %s", name,
+	      stat->histogram ? "histogram" : "counter");
+  }
+  g_mutex_unlock(&pwstats_lock);
+  return stat;
+}
+
+PwStat *
+pwstats_counter(const char *name)
+{
+  return _pwstats_register(name, FALSE);
+}
+
+PwStat *
+pwstats_histogram(const char *name)
+{
+  return _pwstats_register(name, TRUE);
+}
+
+/*-----------------------------------------------------------------------
+ *	The calling thread's cells, allocated the first time it uses
+ *	a statistic
+ *-----------------------------------------------------------------------*/
+static PwStatCells *
+_pwstats_cells_slow(PwStatsThread *thread, PwStat *stat)
+{
+  PwStatCells *cells;
+
+  if (thread == NULL) {
+    thread = g_new0(PwStatsThread, 1);
+    g_private_set(&pwstats_thread, thread);
+  }
+  if (stat->id >= thread->n) {
+    guint n = MAX(stat->id + 1, 2 * thread->n);
+    thread->cells = g_renew(PwStatCells *, thread->cells, n);
+    memset(thread->cells + thread->n, 0,
+	   (n - thread->n) * sizeof(PwStatCells *));
+    thread->n = n;
+  }
+  cells = _pwstats_cells_new(stat->histogram);
+  g_mutex_lock(&pwstats_lock);
+  stat->cells = g_slist_prepend(stat->cells, cells);
+  g_mutex_unlock(&pwstats_lock);
+  thread->cells[stat->id] = cells;
+  return cells;
+}
+
+static inline PwStatCells *
+_pwstats_cells(PwStat *stat)
+{
+  PwStatsThread *thread = g_private_get(&pwstats_thread);
+  if (G_LIKELY(thread != NULL && stat->id < thread->n &&
+	       thread->cells[stat->id] != NULL)) {
+    return thread->cells[stat->id];
+  }
+  return _pwstats_cells_slow(thread, stat);
+}
+
+/* Add the cells to the sum.  Cells may be being written meanwhile. */
+static void
+_pwstats_merge(PwStatCells *sum, PwStatCells *cells, gboolean histogram)
+{
+  guint64 min = __atomic_load_n(&cells->min, __ATOMIC_RELAXED);
+  guint64 max = __atomic_load_n(&cells->max, __ATOMIC_RELAXED);
+  guint i;
+
+  sum->count += __atomic_load_n(&cells->count, __ATOMIC_RELAXED);
+  sum->sum += __atomic_load_n(&cells->sum, __ATOMIC_RELAXED);
+  if (min < sum->min) sum->min = min;
+  if (max > sum->max) sum->max = max;
+  if (histogram) {
+    for (i=0; i < PWSTATS_BUCKETS; i++) {
+      sum->buckets[i] += __atomic_load_n(&cells->buckets[i],
+					 __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Keep what an exiting thread recorded */
+static void
+_pwstats_thread_free(gpointer data)
+{
+  PwStatsThread *thread = data;
+  guint i;
+
+  g_mutex_lock(&pwstats_lock);
+  for (i=0; i < thread->n; i++) {
+    PwStatCells *cells = thread->cells[i];
+    PwStat *stat;
+    if (cells == NULL) continue;
+    stat = g_ptr_array_index(pwstats_all, i);
+    _pwstats_merge(stat->retired, cells, stat->histogram);
+    stat->cells = g_slist_remove(stat->cells, cells);
+    g_free(cells);
+  }
+  g_mutex_unlock(&pwstats_lock);
+  g_free(thread->cells);
+  g_free(thread);
+}
+
+/*-----------------------------------------------------------------------
+ *	Recording: only the calling thread writes its cells, so plain
+ *	read-modify-write is enough; the stores are atomic so that a
+ *	snapshot never sees half of one.
+ *-----------------------------------------------------------------------*/
+#define PWSTATS_SET(field, value) \
+  __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/* Add to a counter (negative to subtract) */
+void
+pwstats_add(PwStat *stat, gint64 delta)
+{
+  PwStatCells *cells = _pwstats_cells(stat);
+  PWSTATS_SET(cells->count, cells->count + 1);
+  PWSTATS_SET(cells->sum, cells->sum + delta);
+}
+
+/* Record a value (e.g. nanoseconds taken) in a histogram */
+void
+pwstats_record(PwStat *stat, guint64 value)
+{
+  PwStatCells *cells = _pwstats_cells(stat);
+  guint bucket = _pwstats_bucket(value);
+  PWSTATS_SET(cells->buckets[bucket], cells->buckets[bucket] + 1);
+  PWSTATS_SET(cells->count, cells->count + 1);
+  PWSTATS_SET(cells->sum, cells->sum + value);
+  if (value < cells->min) PWSTATS_SET(cells->min, value);
+  if (value > cells->max) PWSTATS_SET(cells->max, value);
+}
+
+/*-----------------------------------------------------------------------
+ *	Snapshots
+ *-----------------------------------------------------------------------*/
+PwStatsSnapshot *
+pwstats_snapshot(void)
+{
+  PwStatsSnapshot *self = g_new0(PwStatsSnapshot, 1);
+  guint i;
+
+  self->time = g_get_monotonic_time();
+  g_mutex_lock(&pwstats_lock);
+  self->n = (pwstats_all == NULL) ? 0 : pwstats_all->len;
+  self->stats = g_new0(PwStat *, self->n);
+  self->sums = g_new0(PwStatCells *, self->n);
+  for (i=0; i < self->n; i++) {
+    PwStat *stat = g_ptr_array_index(pwstats_all, i);
+    PwStatCells *sum = _pwstats_cells_new(stat->histogram);
+    GSList *l;
+    _pwstats_merge(sum, stat->retired, stat->histogram);
+    for (l = stat->cells; l != NULL; l = l->next) {
+      _pwstats_merge(sum, l->data, stat->histogram);
+    }
+    self->stats[i] = stat;
+    self->sums[i] = sum;
+  }
+  g_mutex_unlock(&pwstats_lock);
+  return self;
+}
+
+void
+pwstats_snapshot_free(PwStatsSnapshot *self)
+{
+  guint i;
+  if (self == NULL) return;
+  for (i=0; i < self->n; i++) {
+    g_free(self->sums[i]);
+  }
+  g_free(self->stats);
+  g_free(self->sums);
+  g_free(self);
+}
+
+/* Value given the smallest bucket holding at least rank values */
+static guint64
+_pwstats_percentile(const guint64 *buckets, guint64 rank)
+{
+  guint64 seen = 0;
+  guint i;
+  for (i=0; i < PWSTATS_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) return _pwstats_bucket_high(i);
+  }
+  return 0;
+}
+
+static void
+_pwstats_value(const PwStatsSnapshot *self, const PwStatsSnapshot *since,
+	       guint id, PwStatsValue *value)
+{
+  const PwStat *stat = self->stats[id];
+  const PwStatCells *sum = self->sums[id];
+  const PwStatCells *before = NULL;
+  guint64 *buckets;
+  guint i;
+
+  memset(value, 0, sizeof *value);
+  value->name = stat->name;
+  value->histogram = stat->histogram;
+  value->count = sum->count;
+  value->sum = sum->sum;
+  if (! stat->histogram) return;
+
+  if (since != NULL && id < since->n) before = since->sums[id];
+  buckets = g_new(guint64, PWSTATS_BUCKETS);
+  for (i=0; i < PWSTATS_BUCKETS; i++) {
+    buckets[i] = sum->buckets[i] - ((before == NULL) ? 0 : before->buckets[i]);
+  }
+  if (before != NULL) {
+    value->count -= before->count;
+    value->sum -= before->sum;
+  }
+  if (value->count != 0) {
+    guint64 n = value->count;
+    if (before == NULL) {
+      value->min = sum->min;
+      value->max = sum->max;
+    } else {
+      /* Only the buckets are known for the interval.  A value being
+       * recorded may be in the count but not yet its bucket, or the
+       * other way round, so count what the buckets hold. */
+      for (n=0, i=0; i < PWSTATS_BUCKETS; i++) n += buckets[i];
+      if (n == 0) {
+	g_free(buckets);
+	return;
+      }
+      for (i=0; buckets[i] == 0; i++) ;
+      value->min = _pwstats_bucket_low(i);
+      for (i=PWSTATS_BUCKETS - 1; buckets[i] == 0; i--) ;
+      value->max = MIN(_pwstats_bucket_high(i), sum->max);
+    }
+    value->p50 = _pwstats_percentile(buckets, (n * 500 + 999) / 1000);
+    value->p90 = _pwstats_percentile(buckets, (n * 900 + 999) / 1000);
+    value->p99 = _pwstats_percentile(buckets, (n * 990 + 999) / 1000);
+    value->p999 = _pwstats_percentile(buckets, (n * 999 + 999) / 1000);
+    value->p50 = CLAMP(value->p50, value->min, value->max);
+    value->p90 = CLAMP(value->p90, value->min, value->max);
+    value->p99 = CLAMP(value->p99, value->min, value->max);
+    value->p999 = CLAMP(value->p999, value->min, value->max);
+  }
+  g_free(buckets);
+}
+
+/*-----------------------------------------------------------------------
+ *	Value of a statistic in a snapshot.  Given an earlier snapshot
+ *	(since), a histogram shows only values recorded in between.
+ *-----------------------------------------------------------------------*/
+gboolean
+pwstats_snapshot_value(const PwStatsSnapshot *self,
+		       const PwStatsSnapshot *since,
+		       const char *name, PwStatsValue *value)
+{
+  guint i;
+  for (i=0; i < self->n; i++) {
+    if (strcmp(self->stats[i]->name, name) == 0) {
+      _pwstats_value(self, since, i, value);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Name as a JSON string */
+static void
+_pwstats_json_name(GString *str, const gchar *name)
+{
+  g_string_append_c(str, '"');
+  for (; *name; name++) {
+    if (*name == '"' || *name == '\\') g_string_append_c(str, '\\');
+    g_string_append_c(str, *name);
+  }
+  g_string_append_c(str, '"');
+}
+
+/*-----------------------------------------------------------------------
+ *	All statistics as text, one per line after a time line, and a
+ *	blank line; or as JSON on one line.  Counters are always totals.
+ *-----------------------------------------------------------------------*/
+gchar *
+pwstats_snapshot_format(const PwStatsSnapshot *self,
+			const PwStatsSnapshot *since, gboolean json)
+{
+  GString *str = g_string_new(NULL);
+  const gchar *host = g_get_host_name();
+  gboolean first;
+  guint i, pass;
+
+  if (json) {
+    g_string_append_printf(str, "{\"time\":%.3f,\"host\":",
+			   self->time / 1e6);
+    _pwstats_json_name(str, host);
+  } else {
+    g_string_append_printf(str, "time %.3f %s\n", self->time / 1e6, host);
+  }
+  /* Counters, then histograms */
+  for (pass=0; pass < 2; pass++) {
+    if (json) {
+      g_string_append(str, pass ? ",\"histograms\":{" : ",\"counters\":{");
+    }
+    first = TRUE;
+    for (i=0; i < self->n; i++) {
+      PwStatsValue v;
+      _pwstats_value(self, since, i, &v);
+      if (v.histogram != pass) continue;
+      if (json) {
+	if (! first) g_string_append_c(str, ',');
+	_pwstats_json_name(str, v.name);
+	if (v.histogram) {
+	  g_string_append_printf(str, ":{\"count\":%" G_GUINT64_FORMAT
+				 ",\"sum\":%" G_GUINT64_FORMAT
+				 ",\"min\":%" G_GUINT64_FORMAT
+				 ",\"p50\":%" G_GUINT64_FORMAT
+				 ",\"p90\":%" G_GUINT64_FORMAT
+				 ",\"p99\":%" G_GUINT64_FORMAT
+				 ",\"p999\":%" G_GUINT64_FORMAT
+				 ",\"max\":%" G_GUINT64_FORMAT "}",
+				 v.count, v.sum, v.min, v.p50, v.p90,
+				 v.p99, v.p999, v.max);
+	} else {
+	  g_string_append_printf(str, ":%" G_GINT64_FORMAT, (gint64)v.sum);
+	}
+      } else if (v.histogram) {
+	g_string_append_printf(str, "%s count %" G_GUINT64_FORMAT
+			       " sum %" G_GUINT64_FORMAT
+			       " min %" G_GUINT64_FORMAT
+			       " p50 %" G_GUINT64_FORMAT
+			       " p90 %" G_GUINT64_FORMAT
+			       " p99 %" G_GUINT64_FORMAT
+			       " p999 %" G_GUINT64_FORMAT
+			       " max %" G_GUINT64_FORMAT "\n",
+			       v.name, v.count, v.sum, v.min, v.p50, v.p90,
+			       v.p99, v.p999, v.max);
+      } else {
+	g_string_append_printf(str, "%s %" G_GINT64_FORMAT "\n",
+			       v.name, (gint64)v.sum);
+      }
+      first = FALSE;
+    }
+    if (json) g_string_append_c(str, '}');
+  }
+  g_string_append(str, json ? "}\n" : "\n");
+  return g_string_free(str, FALSE);
+}
+
+/*-----------------------------------------------------------------------
+ *	Periodic export by a thread of its own
+ *-----------------------------------------------------------------------*/
+struct _PwStatsExport {
+  FILE *file;			/* Appended to, or */
+  int fd;			/* datagram socket, sent to addr */
+  struct sockaddr_un addr;
+  gboolean json;
+  guint period;			/* ms */
+  PwStatsSnapshot *since;	/* Last exported */
+  GMutex lock;
+  GCond wake;
+  gboolean stop;
+  GThread *thread;
+};
+
+static void
+_pwstats_export_one(PwStatsExport *self, PwStatsSnapshot *snap,
+		    PwStatsSnapshot *since)
+{
+  gchar *text = pwstats_snapshot_format(snap, since, self->json);
+  if (self->file != NULL) {
+    fputs(text, self->file);
+    fflush(self->file);
+  } else {
+    /* Nobody listening is not an error */
+    sendto(self->fd, text, strlen(text), MSG_DONTWAIT,
+	   (struct sockaddr *)&self->addr, sizeof self->addr);
+  }
+  g_free(text);
+}
+
+static gpointer
+_pwstats_exporter(gpointer data)
+{
+  PwStatsExport *self = data;
+  gint64 next = g_get_monotonic_time();
+
+  g_mutex_lock(&self->lock);
+  while (! self->stop) {
+    PwStatsSnapshot *snap;
+    next += self->period * G_GINT64_CONSTANT(1000);
+    while (! self->stop &&
+	   g_cond_wait_until(&self->wake, &self->lock, next)) ;
+    snap = pwstats_snapshot();
+    _pwstats_export_one(self, snap, self->since);
+    pwstats_snapshot_free(self->since);
+    self->since = snap;
+  }
+  g_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+/* Value of ${stub}${suffix} from the environment */
+static const gchar *
+_pwstats_getenv(const gchar *stub, const gchar *suffix)
+{
+  gchar *envvar = g_strconcat(stub, suffix, NULL);
+  const gchar *value = g_getenv(envvar);
+  g_free(envvar);
+  return value;
+}
+
+/*-----------------------------------------------------------------------
+ *	Start exporting, if ${name}_STATSFILE is set: a file to append
+ *	to, or unix:PATH for a datagram socket.
+ *	Period in ms from ${name}_STATSPERIOD environment variable
+ *	${name}_STATSFORMAT=json for JSON, one snapshot per line
+ *	Histograms show only what was recorded in each period.
+ *-----------------------------------------------------------------------*/
+PwStatsExport *
+pwstats_export_open(const char *name)
+{
+  PwStatsExport *self;
+  gchar *stub;
+  const gchar *dest, *svalue;
+
+  stub = (name == NULL) ? g_strdup("") : g_strdup_printf("%s_", name);
+  dest = _pwstats_getenv(stub, "STATSFILE");
+  if (dest == NULL) {
+    g_free(stub);
+    return NULL;
+  }
+  self = g_new0(PwStatsExport, 1);
+  self->fd = -1;
+  if (g_str_has_prefix(dest, "unix:")) {
+    self->addr.sun_family = AF_UNIX;
+    strncpy(self->addr.sun_path, dest + 5, sizeof self->addr.sun_path - 1);
+    self->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (self->fd < 0) {
+      g_printerr("Cannot create socket for %s", dest);
+    }
+  } else {
+    self->file = fopen(dest, "a");
+    if (self->file == NULL) {
+      g_printerr("Cannot open %s", dest);
+    }
+  }
+  if (self->file == NULL && self->fd < 0) {
+    g_free(self);
+    g_free(stub);
+    return NULL;
+  }
+  svalue = _pwstats_getenv(stub, "STATSFORMAT");
+  self->json = (svalue != NULL && strcmp(svalue, "json") == 0);
+  svalue = _pwstats_getenv(stub, "STATSPERIOD");
+  self->period = (svalue == NULL) ? 0 : atoi(svalue);
+  if (self->period == 0) self->period = PWSTATS_DEFAULT_PERIOD;
+  g_free(stub);
+
+  g_mutex_init(&self->lock);
+  g_cond_init(&self->wake);
+  self->since = pwstats_snapshot();
+  self->thread = g_thread_new("pwstats", _pwstats_exporter, self);
+  return self;
+}
+
+/* Stop exporting, after one last snapshot */
+void
+pwstats_export_close(PwStatsExport *self)
+{
+  if (self == NULL) return;
+  g_mutex_lock(&self->lock);
+  self->stop = TRUE;
+  g_cond_signal(&self->wake);
+  g_mutex_unlock(&self->lock);
+  g_thread_join(self->thread);
+  if (self->file != NULL) fclose(self->file);
+  if (self->fd >= 0) close(self->fd);
+  pwstats_snapshot_free(self->since);
+  g_mutex_clear(&self->lock);
+  g_cond_clear(&self->wake);
+  g_free(self);
+}
@@ -0,0 +1,173 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Replay a packet trace through throttles of given rate and
+ *	buffer size on a virtual clock, and show what each does to it:
+ *	throughput, queueing delay and the largest burst.
+ *
+ *	The trace has a line per packet, its arrival time in seconds
+ *	and its size in bytes; anything after is ignored, as are lines
+ *	starting with #.  Packets queue until the throttle lets them go.
+ *=======================================================================*/
+#include "pwutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  guint64 time;			/* ns */
+  size_t size;
+} Packet;
+
+static gint
+_cmp_u64(gconstpointer a, gconstpointer b)
+{
+  guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+  return (x > y) - (x < y);
+}
+
+static GArray *
+_read_trace(const gchar *filename)
+{
+  GError *error = NULL;
+  GArray *packets;
+  gchar *data, **lines;
+  guint i;
+
+  if (! g_file_get_contents(filename, &data, NULL, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return NULL;
+  }
+  packets = g_array_new(FALSE, FALSE, sizeof(Packet));
+  lines = g_strsplit(data, "\n", -1);
+  for (i=0; lines[i] != NULL; i++) {
+    double sec;
+    unsigned long size;
+    Packet p;
+
+    if (lines[i][0] == '#' || lines[i][0] == '\0') continue;
+    if (sscanf(lines[i], "%lf %lu", &sec, &size) != 2 || sec < 0) {
+      g_printerr("%s:%u: Expected seconds and bytes\n", filename, i + 1);
+      g_array_free(packets, TRUE);
+      packets = NULL;
+      break;
+    }
+    p.time = (guint64)(sec * 1e9 + 0.5);
+    p.size = size;
+    /* Out of order arrivals queue behind those before */
+    if (packets->len > 0) {
+      Packet *last = &g_array_index(packets, Packet, packets->len - 1);
+      p.time = MAX(p.time, last->time);
+    }
+    g_array_append_val(packets, p);
+  }
+  g_strfreev(lines);
+  g_free(data);
+  return packets;
+}
+
+/* Run the trace through a throttle and show the result */
+static void
+_simulate(const GArray *packets, double rate, double buffer_size)
+{
+  PwClock *clock = pwclock_new_virtual(0);
+  PwThrottle *throttle = pwthrottle_create(buffer_size, rate);
+  GArray *delays = g_array_sized_new(FALSE, FALSE, sizeof(guint64),
+				     packets->len);
+  guint64 now = 0, wait, total = 0, burst = 0, max_burst = 0, sum = 0;
+  guint64 end = 0;
+  guint head = 0, oversize = 0;
+
+  pwthrottle_set_clock(throttle, clock);
+  while (head < packets->len) {
+    const Packet *p = &g_array_index(packets, Packet, head);
+    guint64 next;
+
+    if (p->size > buffer_size) {
+      /* Never fits, so would never go */
+      oversize++;
+      head++;
+      continue;
+    } else if (p->time > now) {
+      /* Idle until it arrives */
+      next = p->time;
+    } else if (pwthrottle_check_ns(throttle, p->size, &wait) == 0) {
+      guint64 delay = now - p->time;
+      g_array_append_val(delays, delay);
+      sum += delay;
+      total += p->size;
+      burst += p->size;
+      /* When the link will have sent it */
+      end = MAX(end, now) + (guint64)(p->size * 1e9 / rate);
+      head++;
+      continue;
+    } else {
+      next = now + wait;
+    }
+    max_burst = MAX(max_burst, burst);
+    burst = 0;
+    pwclock_set(clock, next);
+    now = next;
+  }
+  max_burst = MAX(max_burst, burst);
+
+  printf("rate %.0f buffer %.0f:", rate, buffer_size);
+  if (delays->len > 0) {
+    guint64 start = g_array_index(packets, Packet, 0).time;
+    g_array_sort(delays, _cmp_u64);
+    printf(" %.0f B/s, delay mean %.3f p99 %.3f max %.3f ms,"
+	   " burst %" G_GUINT64_FORMAT,
+	   (end > start) ? total * 1e9 / (end - start) : 0.0,
+	   sum * 1e-6 / delays->len,
+	   g_array_index(delays, guint64, (delays->len * 99 - 1) / 100) * 1e-6,
+	   g_array_index(delays, guint64, delays->len - 1) * 1e-6,
+	   max_burst);
+  }
+  if (oversize > 0) {
+    printf(" oversize %u", oversize);
+  }
+  printf("\n");
+  g_array_free(delays, TRUE);
+  pwthrottle_destroy(throttle);
+  pwclock_free(clock);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GArray *packets;
+  int i;
+
+  if (argc < 3) {
+    g_printerr("Usage: %s TRACEFILE RATE/BUFFER...\n", argv[0]);
+    return 2;
+  }
+  if ((packets = _read_trace(argv[1])) == NULL) return 1;
+  for (i=2; i < argc; i++) {
+    double rate, buffer_size;
+    if (sscanf(argv[i], "%lf/%lf", &rate, &buffer_size) != 2 ||
+	rate <= 0 || buffer_size <= 0) {
+      g_printerr("%s: Expected RATE/BUFFER\n", argv[i]);
+      return 2;
+    }
+    _simulate(packets, rate, buffer_size);
+  }
+  g_array_free(packets, TRUE);
+  return 0;
+}
@@ -1,8 +1,56 @@
 /*=======================================================================
  *	Throttle data sent to maximum bit rate
  * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ *	The bucket is the time at which the output buffer will be
+ *	empty, in nanoseconds of MY_CLOCK (or of a PwClock, which may
+ *	be virtual).  Sending n bytes moves it on by n / rate; the data
+ *	fits if it then stays within buffer_size / rate of now.  It is
+ *	one 64-bit value updated by compare and swap, so threads
+ *	sharing a link may share one throttle.
+ *
+ *	PwHtb shares a link between classes of traffic as Linux's HTB
+ *	does.  Each class is guaranteed its rate, and may borrow what
+ *	the others leave unused up to its ceiling.  Classes within
+ *	their rate go first, by priority, then those borrowing.  A
+ *	class let through is charged under the same lock, so threads
+ *	may share a link.
+ *
+ *	PwPacer sends queued packets from a thread of its own, spaced
+ *	evenly at its rate: each leaves when the one before would have
+ *	drained, with no burst.  It sleeps to an absolute time, so
+ *	errors do not add up, then spins for the last stretch.
+ *
+ *	pwthrottle_source_new() gives a GSource that wakes the main
+ *	loop when a write of a given size would be let through, timed
+ *	by a timerfd to the nanosecond rather than poll's millisecond.
+ *
+ *	PwRateControl moves a throttle's rate between a floor and a
+ *	ceiling by AIMD: up a step each interval the link keeps up,
+ *	down by a factor when it shows congestion - a standing socket
+ *	queue, sends refused with EAGAIN, loss, or round trips well
+ *	above the least seen.
+ *
+ *	PwFrameSched sends a stream's frames earliest deadline first
+ *	through a throttle.  A frame which would finish draining after
+ *	its deadline is dropped before it is sent, and optionally the
+ *	rest of its GOP, which could not be decoded without it.
+ *
+ *	PwThrottleWrite is a pw_IWrite passing writes on to another
+ *	through a throttle, sleeping until each may go or, if it must
+ *	not block, refusing those which may not go yet.
  *=======================================================================*/
 #include <pwutil.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sys/ioctl.h>		/* TIOCOUTQ */
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>	/* struct sock_txtime */
+#include <sys/timerfd.h>
+#endif
 
 #if defined(CLOCK_MONOTONIC_RAW)
 #define MY_CLOCK CLOCK_MONOTONIC_RAW
@@ -12,69 +60,1193 @@
 #define MY_CLOCK CLOCK_REALTIME
 #endif
 
-#define TIM_SECS(t) ((t).tv_sec + (t).tv_nsec * 1e-9)
-#define TIM_FROM_SECS(t, s) do {(t).tv_sec = (int)(s); (t).tv_nsec = (int)(((s) - (t).tv_sec) * 1000000000);} while (0)
-#define TIM_ZERO(t) do {(t).tv_sec = 0; (t).tv_nsec = 0;} while (0)
-#define TIM_SUB(a,b) do {if ((a).tv_nsec < (b).tv_nsec) {(a).tv_sec -= 1; (a).tv_nsec += 1000000000;} (a).tv_sec -= (b).tv_sec; (a).tv_nsec -= (b).tv_nsec;} while (0)
-#define TIM_ADD(a,b) do {(a).tv_sec += (b).tv_sec; (a).tv_nsec += (b).tv_nsec; if ((a).tv_nsec >= 1000000000) {(a).tv_sec += 1; (a).tv_nsec -= 1000000000;}} while (0)
-#define TIM_LT(a,b) ((a).tv_sec < (b).tv_sec || ((a).tv_sec == (b).tv_sec && (a).tv_nsec < (b).tv_nsec))
+#define NSEC_PER_SEC 1000000000
+
+#ifdef __GNUC__
+#  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
+#else
+#  define UNUSED(x) UNUSED_ ## x
+#endif
 
+GQuark
+pwthrottle_error_quark(void)
+{
+  return g_quark_from_static_string("pwthrottle-error");
+}
 
 struct _PwThrottle {
   /* config */
-  double buffer_size;		/* Capacity of output buffer in bytes */
-  double rate;			/* Rate at which buffer drains */
+  guint64 rate;			/* Bytes per second the buffer drains */
+  guint64 buffer_ns;		/* Time to drain a full buffer */
+  guint64 buffer_size;
+  PwClock *clock;		/* NULL for MY_CLOCK */
   /* state */
-  struct timespec empty_time;	/* When buffer will be empty */
+  guint64 empty_time;		/* ns */
+  /* statistics */
+  PwStat *sent;			/* Bytes let through */
+  PwStat *waits;		/* Nanoseconds told to wait */
 };
 
+/* Time on clock, or MY_CLOCK if NULL */
+static guint64
+_pwthrottle_now(PwClock *clock)
+{
+  struct timespec now;
+  if (clock != NULL) return pwclock_now(clock);
+  clock_gettime(MY_CLOCK, &now);
+  return (guint64)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/* Nanoseconds to drain nbytes at rate, rounded up */
+static guint64
+_pwthrottle_ns(guint64 rate, guint64 nbytes)
+{
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 ns = (unsigned __int128)nbytes * NSEC_PER_SEC;
+  return (guint64)((ns + rate - 1) / rate);
+#else
+  /* Exact while the remainder times 1e9 fits, i.e. below 18GB/s */
+  guint64 whole = nbytes / rate, part = nbytes % rate;
+  return whole * NSEC_PER_SEC + (part * NSEC_PER_SEC + rate - 1) / rate;
+#endif
+}
+
+/* Most whole bytes drained in ns at rate */
+static guint64
+_pwthrottle_bytes(guint64 rate, guint64 ns)
+{
+#if defined(__SIZEOF_INT128__)
+  return (guint64)((unsigned __int128)ns * rate / NSEC_PER_SEC);
+#else
+  guint64 whole = ns / NSEC_PER_SEC, part = ns % NSEC_PER_SEC;
+  return whole * rate + part * rate / NSEC_PER_SEC;
+#endif
+}
+
+static guint64
+_pwthrottle_rate(double rate)
+{
+  return (rate >= 1.0) ? (guint64)(rate + 0.5) : 1;
+}
+
 PwThrottle *
 pwthrottle_create(double buffer_size, double rate)
 {
   PwThrottle *self = g_new0(PwThrottle, 1);
-  self->buffer_size = buffer_size;
-  self->rate = rate;
-  TIM_ZERO(self->empty_time);
+  self->rate = _pwthrottle_rate(rate);
+  self->buffer_ns = _pwthrottle_ns(self->rate, (guint64)buffer_size);
+  self->buffer_size = (guint64)buffer_size;
+  self->empty_time = 0;
+  self->sent = pwstats_counter("pwthrottle.bytes");
+  self->waits = pwstats_histogram("pwthrottle.wait_ns");
   return self;
 }
 
+/* Time until what the throttle has let through has drained */
+static guint64
+_pwthrottle_backlog(PwThrottle *self, guint64 now)
+{
+  guint64 empty = __atomic_load_n(&self->empty_time, __ATOMIC_RELAXED);
+  return (empty > now) ? empty - now : 0;
+}
+
+/* Time until a write costing cost ns would be let through */
+static guint64
+_pwthrottle_wait(PwThrottle *self, guint64 cost, guint64 now)
+{
+  guint64 empty = __atomic_load_n(&self->empty_time, __ATOMIC_RELAXED);
+  guint64 base = MAX(empty, now);
+  return (base - now + cost > self->buffer_ns) ?
+    base - now + cost - self->buffer_ns : 0;
+}
+
 /*-----------------------------------------------------------------------
  *	Calculate if we need to wait before sending.
  *	If OK to send, return 0 and adjust for amount presumed to be sent.
- *	If not, return 1 and set *wait to time to hold off for.
+ *	If not, return 1 and set *wait_ns to time to hold off for.
+ *-----------------------------------------------------------------------*/
+int
+pwthrottle_check_ns(PwThrottle *self, size_t nbytes, guint64 *wait_ns)
+{
+  guint64 now = _pwthrottle_now(self->clock);
+  guint64 cost = _pwthrottle_ns(self->rate, nbytes);
+  guint64 empty = __atomic_load_n(&self->empty_time, __ATOMIC_RELAXED);
+  guint64 base;
+
+  do {
+    /* Not empty yet - see how much is still queued */
+    base = MAX(empty, now);
+    if (base - now + cost > self->buffer_ns) {
+      /* Note how long to wait until clear to send */
+      *wait_ns = base - now + cost - self->buffer_ns;
+      pwstats_record(self->waits, *wait_ns);
+      return 1;
+    }
+  } while (! __atomic_compare_exchange_n(&self->empty_time, &empty,
+					 base + cost, TRUE,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  pwstats_add(self->sent, nbytes);
+  return 0;
+}
+
+/*-----------------------------------------------------------------------
+ *	As pwthrottle_check_ns for a vector of n packets, reading the
+ *	clock once.  Return how many leading packets may go now, and if
+ *	not all, set *wait_ns to the time until the next may.  If
+ *	departures is not NULL, set it for each packet let through to
+ *	when the link will start on it, in ns from now.
  *-----------------------------------------------------------------------*/
+guint
+pwthrottle_check_batch(PwThrottle *self, const size_t *sizes, guint n,
+		       guint64 *wait_ns, guint64 *departures)
+{
+  guint64 now = _pwthrottle_now(self->clock);
+  guint64 empty = __atomic_load_n(&self->empty_time, __ATOMIC_RELAXED);
+  guint64 base, room, sum, cost;
+  guint i;
+
+  do {
+    /* Bytes that fit, compared without dividing for each packet */
+    base = MAX(empty, now);
+    room = (base - now < self->buffer_ns) ?
+      _pwthrottle_bytes(self->rate, self->buffer_ns - (base - now)) : 0;
+    sum = 0;
+    for (i=0; i < n && sum + sizes[i] <= room; i++) {
+      sum += sizes[i];
+    }
+    if (i == 0) break;
+    cost = _pwthrottle_ns(self->rate, sum);
+  } while (! __atomic_compare_exchange_n(&self->empty_time, &empty,
+					 base + cost, TRUE,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (i > 0) {
+    pwstats_add(self->sent, sum);
+    if (departures != NULL) {
+      guint64 before = 0;
+      guint j;
+      for (j=0; j < i; j++) {
+	departures[j] = base - now + _pwthrottle_ns(self->rate, before);
+	before += sizes[j];
+      }
+    }
+  }
+  if (i < n) {
+    /* When the next would fit after those let through */
+    guint64 backlog = base - now + ((i > 0) ? cost : 0);
+    guint64 next = _pwthrottle_ns(self->rate, sizes[i]);
+    *wait_ns = (backlog + next > self->buffer_ns) ?
+      backlog + next - self->buffer_ns : 0;
+    pwstats_record(self->waits, *wait_ns);
+  }
+  return i;
+}
+
 int
 pwthrottle_check(PwThrottle *self, size_t nbytes, struct timespec *wait)
 {
-  struct timespec now, till_empty;
-  double available;
+  guint64 wait_ns;
 
-  available = self->buffer_size;
-  clock_gettime(MY_CLOCK, &now);
-  if (TIM_LT(now, self->empty_time)) {
-    /* Not empty yet - see how long until it is */
-    till_empty = self->empty_time;
-    TIM_SUB(till_empty, now);
-    available -= TIM_SECS(till_empty) * self->rate;
+  if (pwthrottle_check_ns(self, nbytes, &wait_ns) == 0) return 0;
+  wait->tv_sec = wait_ns / NSEC_PER_SEC;
+  wait->tv_nsec = wait_ns % NSEC_PER_SEC;
+  return 1;
+}
+
+/* Time by clock (NULL for the default) instead, from empty */
+void
+pwthrottle_set_clock(PwThrottle *self, PwClock *clock)
+{
+  self->clock = clock;
+  __atomic_store_n(&self->empty_time, 0, __ATOMIC_RELAXED);
+}
+
+/* Change the rate, keeping the buffer size.  Checks racing this may
+ * see the old rate. */
+void
+pwthrottle_set_rate(PwThrottle *self, double rate)
+{
+  guint64 r = _pwthrottle_rate(rate);
+  __atomic_store_n(&self->rate, r, __ATOMIC_RELAXED);
+  __atomic_store_n(&self->buffer_ns, _pwthrottle_ns(r, self->buffer_size),
+		   __ATOMIC_RELAXED);
+}
+
+double
+pwthrottle_get_rate(PwThrottle *self)
+{
+  return __atomic_load_n(&self->rate, __ATOMIC_RELAXED);
+}
+
+void
+pwthrottle_destroy(PwThrottle *self)
+{
+  g_free(self);
+}
+
+/*-----------------------------------------------------------------------
+ *	Hierarchical throttle: a link and the classes sharing it
+ *-----------------------------------------------------------------------*/
+#define PWHTB_MAX_CLASSES 16
+
+/* Bucket as in PwThrottle, under the PwHtb's lock */
+typedef struct {
+  guint64 rate;
+  guint64 buffer_ns;
+  guint64 empty_time;
+} PwHtbBucket;
+
+typedef struct {
+  PwHtbBucket rate;		/* Guaranteed */
+  PwHtbBucket ceil;		/* Most, borrowing */
+  guint prio;			/* 0 first */
+} PwHtbClass;
+
+struct _PwHtb {
+  GMutex lock;
+  PwClock *clock;		/* NULL for MY_CLOCK */
+  PwHtbBucket link;
+  double buffer_size;
+  guint nclasses;
+  PwHtbClass classes[PWHTB_MAX_CLASSES];
+};
+
+static void
+_bucket_init(PwHtbBucket *b, double buffer_size, double rate)
+{
+  b->rate = _pwthrottle_rate(rate);
+  b->buffer_ns = _pwthrottle_ns(b->rate, (guint64)buffer_size);
+  b->empty_time = 0;
+}
+
+/* How long before nbytes fit, 0 if they do now */
+static guint64
+_bucket_wait(const PwHtbBucket *b, guint64 now, size_t nbytes)
+{
+  guint64 base = MAX(b->empty_time, now);
+  guint64 cost = _pwthrottle_ns(b->rate, nbytes);
+  return (base - now + cost > b->buffer_ns) ?
+    base - now + cost - b->buffer_ns : 0;
+}
+
+static void
+_bucket_charge(PwHtbBucket *b, guint64 now, size_t nbytes)
+{
+  b->empty_time = MAX(b->empty_time, now) + _pwthrottle_ns(b->rate, nbytes);
+}
+
+PwHtb *
+pwhtb_create(double buffer_size, double rate)
+{
+  PwHtb *self = g_new0(PwHtb, 1);
+  g_mutex_init(&self->lock);
+  _bucket_init(&self->link, buffer_size, rate);
+  self->buffer_size = buffer_size;
+  return self;
+}
+
+/* Add a class guaranteed rate, borrowing up to ceil.  Returns its
+ * number, or -1 if there are too many. */
+int
+pwhtb_add_class(PwHtb *self, double rate, double ceil, guint prio)
+{
+  PwHtbClass *cls;
+
+  if (self->nclasses == PWHTB_MAX_CLASSES) return -1;
+  cls = &self->classes[self->nclasses];
+  _bucket_init(&cls->rate, self->buffer_size, rate);
+  _bucket_init(&cls->ceil, self->buffer_size, MAX(ceil, rate));
+  cls->prio = prio;
+  return self->nclasses++;
+}
+
+/* How long before a class may send, and whether within its rate */
+static guint64
+_pwhtb_wait(PwHtb *self, guint c, guint64 now, size_t nbytes,
+	    gboolean *green)
+{
+  PwHtbClass *cls = &self->classes[c];
+  guint64 wait = MAX(_bucket_wait(&self->link, now, nbytes),
+		     _bucket_wait(&cls->ceil, now, nbytes));
+  *green = (wait == 0 && _bucket_wait(&cls->rate, now, nbytes) == 0);
+  return wait;
+}
+
+/* Account for nbytes sent by a class.  Only what it sends within
+ * its rate counts against that; borrowing counts against the link
+ * and its ceiling. */
+static void
+_pwhtb_charge(PwHtb *self, guint c, guint64 now, size_t nbytes)
+{
+  PwHtbClass *cls = &self->classes[c];
+
+  if (_bucket_wait(&cls->rate, now, nbytes) == 0) {
+    _bucket_charge(&cls->rate, now, nbytes);
+  }
+  _bucket_charge(&cls->ceil, now, nbytes);
+  _bucket_charge(&self->link, now, nbytes);
+}
+
+/*-----------------------------------------------------------------------
+ *	Given the size of the next packet of each class (0 for none),
+ *	return the class to send now, charged for it, or -1 and set
+ *	*wait_ns to when one may.  Classes within their rate come
+ *	before those borrowing, then lower prio before higher.
+ *-----------------------------------------------------------------------*/
+int
+pwhtb_next(PwHtb *self, const size_t *pending, guint64 *wait_ns)
+{
+  guint64 now = _pwthrottle_now(self->clock);
+  guint64 earliest = G_MAXUINT64;
+  int best = -1;
+  gboolean best_green = FALSE;
+  guint c;
+
+  g_mutex_lock(&self->lock);
+  for (c=0; c < self->nclasses; c++) {
+    gboolean green;
+    guint64 wait;
+    if (pending[c] == 0) continue;
+    wait = _pwhtb_wait(self, c, now, pending[c], &green);
+    if (wait != 0) {
+      earliest = MIN(earliest, wait);
+    } else if (best < 0 || (green && ! best_green) ||
+	       (green == best_green &&
+		self->classes[c].prio < self->classes[best].prio)) {
+      best = c;
+      best_green = green;
+    }
+  }
+  /* In the same hold, so no other thread takes what was seen free */
+  if (best >= 0) _pwhtb_charge(self, best, now, pending[best]);
+  g_mutex_unlock(&self->lock);
+  if (best < 0) *wait_ns = (earliest == G_MAXUINT64) ? 0 : earliest;
+  return best;
+}
+
+/* Whether one class may send nbytes now, charging it if so, as
+ * pwthrottle_check_ns */
+int
+pwhtb_check(PwHtb *self, guint c, size_t nbytes, guint64 *wait_ns)
+{
+  guint64 now = _pwthrottle_now(self->clock);
+  gboolean green;
+  guint64 wait;
+
+  g_mutex_lock(&self->lock);
+  wait = _pwhtb_wait(self, c, now, nbytes, &green);
+  if (wait == 0) _pwhtb_charge(self, c, now, nbytes);
+  g_mutex_unlock(&self->lock);
+  if (wait == 0) return 0;
+  *wait_ns = wait;
+  return 1;
+}
+
+/* Time by clock (NULL for the default) instead, from empty */
+void
+pwhtb_set_clock(PwHtb *self, PwClock *clock)
+{
+  guint i;
+
+  g_mutex_lock(&self->lock);
+  self->clock = clock;
+  self->link.empty_time = 0;
+  for (i=0; i < self->nclasses; i++) {
+    self->classes[i].rate.empty_time = 0;
+    self->classes[i].ceil.empty_time = 0;
+  }
+  g_mutex_unlock(&self->lock);
+}
+
+void
+pwhtb_destroy(PwHtb *self)
+{
+  g_mutex_clear(&self->lock);
+  g_free(self);
+}
+
+/*-----------------------------------------------------------------------
+ *	Pacer
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  gpointer data;
+  size_t nbytes;
+} PwPacerPacket;
+
+struct _PwPacer {
+  guint64 rate;
+  guint64 spin_ns;		/* Spin rather than sleep this close */
+  guint64 lead_ns;		/* Hand over this early, for SO_TXTIME */
+  PwPacerSend send;
+  gpointer userdata;
+  GAsyncQueue *queue;
+  GThread *thread;
+  /* state, for the pacer thread */
+  guint64 next;			/* When the next packet is due */
+  guint64 last_target, last_actual;
+  /* statistics */
+  GMutex lock;
+  PwPacerStats stats;
+  guint64 jitter_sum;
+  guint64 jitters;
+  PwStat *jitter;		/* Inter-packet jitter in ns */
+};
+
+/* Queued by pwpacer_destroy(), after the last packet */
+static PwPacerPacket _pwpacer_stop;
+
+/* As clock_nanosleep() needs, which will not take MY_CLOCK */
+static guint64
+_pwpacer_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (guint64)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void
+_pwpacer_wait(PwPacer *self, guint64 target)
+{
+  if (target > self->spin_ns && _pwpacer_now() < target - self->spin_ns) {
+    struct timespec wake;
+    wake.tv_sec = (target - self->spin_ns) / NSEC_PER_SEC;
+    wake.tv_nsec = (target - self->spin_ns) % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+	   == EINTR) ;
+  }
+  while (_pwpacer_now() < target) ;
+}
+
+static gpointer
+_pwpacer_thread(gpointer data)
+{
+  PwPacer *self = data;
+  PwPacerPacket *packet;
+
+  for (;;) {
+    gboolean dry = FALSE;
+    guint64 now, target, actual;
+    gboolean paced;
+
+    if ((packet = g_async_queue_try_pop(self->queue)) == NULL) {
+      packet = g_async_queue_pop(self->queue);
+      dry = TRUE;
+    }
+    if (packet == &_pwpacer_stop) break;
+    /* Catch up if late, but by no more than a packet's time rather
+     * than in a burst; start again only after running dry */
+    now = _pwpacer_now();
+    paced = (self->next != 0 && (!dry || self->next >= now));
+    target = paced ? self->next : now;
+    if (paced && now > target + _pwthrottle_ns(self->rate, packet->nbytes)) {
+      target = now;
+    }
+
+    _pwpacer_wait(self, target - MIN(target, self->lead_ns));
+    actual = _pwpacer_now() + self->lead_ns;
+    self->send(packet->data, packet->nbytes, target, self->userdata);
+
+    g_mutex_lock(&self->lock);
+    self->stats.packets++;
+    self->stats.late_max_ns = MAX(self->stats.late_max_ns, actual - target);
+    if (paced) {
+      gint64 gap = (gint64)(actual - self->last_actual) -
+	(gint64)(target - self->last_target);
+      guint64 jitter = (gap < 0) ? -gap : gap;
+      self->jitter_sum += jitter;
+      self->jitters++;
+      self->stats.jitter_max_ns = MAX(self->stats.jitter_max_ns, jitter);
+      self->stats.jitter_mean_ns = self->jitter_sum / self->jitters;
+      pwstats_record(self->jitter, jitter);
+    }
+    g_mutex_unlock(&self->lock);
+    self->last_target = target;
+    self->last_actual = actual;
+    self->next = target + _pwthrottle_ns(self->rate, packet->nbytes);
+    g_free(packet);
+  }
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ *	Send packets at rate bytes per second by calling send from a
+ *	thread of the pacer's own.  Sleep until spin_usec before each
+ *	is due, then spin.
+ *-----------------------------------------------------------------------*/
+PwPacer *
+pwpacer_create(double rate, guint spin_usec, PwPacerSend send,
+	       gpointer userdata)
+{
+  PwPacer *self = g_new0(PwPacer, 1);
+  self->rate = _pwthrottle_rate(rate);
+  self->spin_ns = (guint64)spin_usec * 1000;
+  self->send = send;
+  self->userdata = userdata;
+  self->queue = g_async_queue_new();
+  g_mutex_init(&self->lock);
+  self->jitter = pwstats_histogram("pwpacer.jitter_ns");
+  self->thread = g_thread_new("pwpacer", _pwpacer_thread, self);
+  return self;
+}
+
+/* Hand packets to send lead_usec early, with the time each is due
+ * (CLOCK_MONOTONIC ns) for SCM_TXTIME, leaving the kernel to time
+ * them exactly */
+void
+pwpacer_set_txtime_lead(PwPacer *self, guint lead_usec)
+{
+  self->lead_ns = (guint64)lead_usec * 1000;
+}
+
+/* Let a socket take SCM_TXTIME times from pwpacer */
+gboolean
+pwpacer_enable_txtime(int fd)
+{
+#if defined(SO_TXTIME) && defined(__linux__)
+  struct sock_txtime config;
+  memset(&config, 0, sizeof config);
+  config.clockid = CLOCK_MONOTONIC;
+  return setsockopt(fd, SOL_SOCKET, SO_TXTIME, &config, sizeof config) == 0;
+#else
+  (void)fd;
+  return FALSE;
+#endif
+}
+
+void
+pwpacer_push(PwPacer *self, gpointer data, size_t nbytes)
+{
+  PwPacerPacket *packet = g_new(PwPacerPacket, 1);
+  packet->data = data;
+  packet->nbytes = nbytes;
+  g_async_queue_push(self->queue, packet);
+}
+
+void
+pwpacer_get_stats(PwPacer *self, PwPacerStats *stats)
+{
+  g_mutex_lock(&self->lock);
+  *stats = self->stats;
+  g_mutex_unlock(&self->lock);
+}
+
+/* Send what is queued, then stop */
+void
+pwpacer_destroy(PwPacer *self)
+{
+  g_async_queue_push(self->queue, &_pwpacer_stop);
+  g_thread_join(self->thread);
+  g_async_queue_unref(self->queue);
+  g_mutex_clear(&self->lock);
+  g_free(self);
+}
+
+/*-----------------------------------------------------------------------
+ *	Main loop source
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  GSource source;
+  PwThrottle *throttle;
+  int timerfd;			/* -1 if none, then poll's timeout */
+  gpointer tag;
+  gboolean pending;		/* A write is waiting */
+  guint64 cost;			/* ns of the smallest write waiting */
+  guint64 armed;		/* When the timer goes off, or 0 */
+} PwThrottleSource;
+
+static void
+_pwthrottle_source_arm(PwThrottleSource *self, guint64 when, guint64 wait)
+{
+  struct itimerspec spec;
+
+  if (when == self->armed) return;
+  memset(&spec, 0, sizeof spec);
+  spec.it_value.tv_sec = wait / NSEC_PER_SEC;
+  spec.it_value.tv_nsec = wait % NSEC_PER_SEC;
+  timerfd_settime(self->timerfd, 0, &spec, NULL);
+  self->armed = when;
+}
+
+static gboolean
+_pwthrottle_source_prepare(GSource *source, gint *timeout)
+{
+  PwThrottleSource *self = (PwThrottleSource *)source;
+  guint64 now, wait;
+
+  *timeout = -1;
+  if (! self->pending) return FALSE;
+  now = _pwthrottle_now(self->throttle->clock);
+  wait = _pwthrottle_wait(self->throttle, self->cost, now);
+  if (wait == 0) return TRUE;
+  if (self->timerfd >= 0) {
+    /* Relative, as timerfd will not take MY_CLOCK */
+    _pwthrottle_source_arm(self, now + wait, wait);
   } else {
-    TIM_ZERO(till_empty);
-  }
-  if (nbytes <= available) {
-    /* Data will fit in bandwidth.  Calculate new empty time. */
-    TIM_FROM_SECS(self->empty_time, nbytes / self->rate);
-    TIM_ADD(self->empty_time, till_empty);
-    TIM_ADD(self->empty_time, now);
-    return 0;
+    *timeout = (wait + 999999) / 1000000;
+  }
+  return FALSE;
+}
+
+static gboolean
+_pwthrottle_source_check(GSource *source)
+{
+  PwThrottleSource *self = (PwThrottleSource *)source;
+  PwThrottle *throttle = self->throttle;
+  guint64 expired;
+
+  if (self->timerfd >= 0 &&
+      (g_source_query_unix_fd(source, self->tag) & G_IO_IN)) {
+    if (read(self->timerfd, &expired, sizeof expired) == sizeof expired) {
+      self->armed = 0;
+    }
+  }
+  return self->pending &&
+    _pwthrottle_wait(throttle, self->cost, _pwthrottle_now(throttle->clock)) == 0;
+}
+
+static gboolean
+_pwthrottle_source_dispatch(GSource *source, GSourceFunc callback,
+			    gpointer userdata)
+{
+  PwThrottleSource *self = (PwThrottleSource *)source;
+
+  self->pending = FALSE;
+  if (self->armed != 0) {
+    _pwthrottle_source_arm(self, 0, 0);
+  }
+  return (callback != NULL) ? callback(userdata) : G_SOURCE_CONTINUE;
+}
+
+static void
+_pwthrottle_source_finalize(GSource *source)
+{
+  PwThrottleSource *self = (PwThrottleSource *)source;
+  if (self->timerfd >= 0) close(self->timerfd);
+}
+
+static GSourceFuncs pwthrottle_source_funcs = {
+  _pwthrottle_source_prepare,
+  _pwthrottle_source_check,
+  _pwthrottle_source_dispatch,
+  _pwthrottle_source_finalize,
+  NULL, NULL
+};
+
+/*-----------------------------------------------------------------------
+ *	Create a source calling back once a write asked for by
+ *	pwthrottle_source_want() would be let through.  The throttle
+ *	must outlive it, and keep to real time.
+ *-----------------------------------------------------------------------*/
+GSource *
+pwthrottle_source_new(PwThrottle *throttle)
+{
+  GSource *source = g_source_new(&pwthrottle_source_funcs,
+				 sizeof(PwThrottleSource));
+  PwThrottleSource *self = (PwThrottleSource *)source;
+
+  g_source_set_name(source, "pwthrottle");
+  self->throttle = throttle;
+#if defined(__linux__)
+  self->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+  self->timerfd = -1;
+#endif
+  if (self->timerfd >= 0) {
+    self->tag = g_source_add_unix_fd(source, self->timerfd, G_IO_IN);
+  }
+  return source;
+}
+
+/*-----------------------------------------------------------------------
+ *	Ask for a callback when nbytes may be sent.  Writers asking
+ *	before it comes share it, which comes as soon as the smallest
+ *	may go; the callback should send what it can, then ask again.
+ *	More than the buffer holds is taken as a full buffer, as it
+ *	could never go whole.  Call from the thread running the
+ *	source's context.
+ *-----------------------------------------------------------------------*/
+void
+pwthrottle_source_want(GSource *source, size_t nbytes)
+{
+  PwThrottleSource *self = (PwThrottleSource *)source;
+  guint64 cost = MIN(_pwthrottle_ns(self->throttle->rate, nbytes),
+		     self->throttle->buffer_ns);
+
+  if (! self->pending || cost < self->cost) {
+    self->cost = cost;
+  }
+  self->pending = TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Adaptive rate
+ *-----------------------------------------------------------------------*/
+#define PWRATECTL_INCREASE 32	/* Steps from floor to ceiling */
+#define PWRATECTL_DECREASE 0.7
+#define PWRATECTL_LOSS 0.01	/* Loss taken as congestion */
+#define PWRATECTL_RTT 1.5	/* Times the least round trip */
+
+struct _PwRateControl {
+  PwThrottle *throttle;
+  double floor, ceiling;
+  double increase;		/* Bytes per second added each interval */
+  double decrease;		/* Rate kept on congestion */
+  guint64 interval_ns;
+  /* state */
+  double rate;
+  guint64 last;			/* When the rate was last changed */
+  gint64 queued;		/* At the last interval */
+  guint eagain;			/* Since the last interval */
+  gint64 min_rtt_ns;
+  /* statistics */
+  PwStat *rates;
+  PwStat *decreases;
+};
+
+/*-----------------------------------------------------------------------
+ *	Adjust throttle's rate between floor and ceiling, starting at
+ *	its present rate, at most once every interval_usec.
+ *-----------------------------------------------------------------------*/
+PwRateControl *
+pwratectl_create(PwThrottle *throttle, double floor, double ceiling,
+		 guint interval_usec)
+{
+  PwRateControl *self = g_new0(PwRateControl, 1);
+  self->throttle = throttle;
+  self->floor = floor;
+  self->ceiling = MAX(floor, ceiling);
+  self->increase = (self->ceiling - floor) / PWRATECTL_INCREASE;
+  self->decrease = PWRATECTL_DECREASE;
+  self->interval_ns = (guint64)interval_usec * 1000;
+  self->rate = CLAMP(pwthrottle_get_rate(throttle), floor, self->ceiling);
+  self->queued = -1;
+  self->min_rtt_ns = -1;
+  self->rates = pwstats_histogram("pwratectl.rate");
+  self->decreases = pwstats_counter("pwratectl.decreases");
+  pwthrottle_set_rate(throttle, self->rate);
+  return self;
+}
+
+/* Change the step added each interval and the factor kept on
+ * congestion */
+void
+pwratectl_set_aimd(PwRateControl *self, double increase, double decrease)
+{
+  self->increase = increase;
+  self->decrease = decrease;
+}
+
+/* Note a send refused with EAGAIN; any thread may call this */
+void
+pwratectl_note_eagain(PwRateControl *self)
+{
+  __atomic_add_fetch(&self->eagain, 1, __ATOMIC_RELAXED);
+}
+
+/* Bytes in fd's send queue not yet sent, or -1 */
+gint64
+pwratectl_socket_queued(int fd)
+{
+#if defined(TIOCOUTQ)
+  int queued;
+  if (ioctl(fd, TIOCOUTQ, &queued) == 0) return queued;
+#endif
+  (void)fd;
+  return -1;
+}
+
+/*-----------------------------------------------------------------------
+ *	Take feedback (NULL if none), and the send queue of fd (if not
+ *	-1), and adjust the rate if an interval has passed since the
+ *	last change.  now_ns is any steady clock, so a simulation can
+ *	run this on virtual time.  Return the rate.
+ *-----------------------------------------------------------------------*/
+double
+pwratectl_update(PwRateControl *self, int fd,
+		 const PwRateFeedback *feedback, guint64 now_ns)
+{
+  gint64 queued = (feedback != NULL) ? feedback->queued : -1;
+  gboolean congested = FALSE;
+  guint eagain;
+
+  if (fd >= 0 && queued < 0) {
+    queued = pwratectl_socket_queued(fd);
+  }
+  if (feedback != NULL && feedback->rtt_ns > 0 &&
+      (self->min_rtt_ns < 0 || feedback->rtt_ns < self->min_rtt_ns)) {
+    self->min_rtt_ns = feedback->rtt_ns;
+  }
+  if (self->last != 0 && now_ns - self->last < self->interval_ns) {
+    return self->rate;
+  }
+  self->last = now_ns;
+
+  eagain = __atomic_exchange_n(&self->eagain, 0, __ATOMIC_RELAXED);
+  if (eagain > 0) congested = TRUE;
+  /* A queue growing past half an interval's sending is standing */
+  if (queued >= 0 && self->queued >= 0 && queued > self->queued &&
+      queued > self->rate * self->interval_ns / NSEC_PER_SEC / 2) {
+    congested = TRUE;
+  }
+  self->queued = queued;
+  if (feedback != NULL) {
+    if (feedback->loss > PWRATECTL_LOSS) congested = TRUE;
+    if (feedback->rtt_ns > 0 &&
+	feedback->rtt_ns > self->min_rtt_ns * PWRATECTL_RTT) congested = TRUE;
+  }
+
+  if (congested) {
+    self->rate = MAX(self->rate * self->decrease, self->floor);
+    pwstats_add(self->decreases, 1);
   } else {
-    /* Note how long to wait until clear to send */
-    double secs = (nbytes - available) / self->rate;
-    TIM_FROM_SECS(*wait, secs);
-    return 1;
+    self->rate = MIN(self->rate + self->increase, self->ceiling);
   }
+  pwthrottle_set_rate(self->throttle, self->rate);
+  pwstats_record(self->rates, (guint64)self->rate);
+  return self->rate;
 }
 
 void
-pwthrottle_destroy(PwThrottle *self)
+pwratectl_destroy(PwRateControl *self)
+{
+  g_free(self);
+}
+
+/*-----------------------------------------------------------------------
+ *	Deadline scheduling of frames
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  gpointer data;
+  size_t nbytes;
+  guint64 deadline;
+  guint gop;
+  gboolean key;
+} PwFrame;
+
+struct _PwFrameSched {
+  PwThrottle *throttle;
+  gboolean drop_chains;
+  PwFrameDrop drop;
+  gpointer userdata;
+  GQueue frames;		/* PwFrame, earliest deadline first */
+  gboolean broken;		/* A frame of gop was dropped */
+  guint broken_gop;
+  guint64 broken_deadline;
+  PwFrameSchedStats stats;
+  PwStat *slack;		/* Deadline less expected finish, in ns */
+  PwStat *misses;
+};
+
+static gint
+_pwframe_cmp(gconstpointer a, gconstpointer b, gpointer UNUSED(data))
+{
+  const PwFrame *fa = a, *fb = b;
+  return (fa->deadline > fb->deadline) - (fa->deadline < fb->deadline);
+}
+
+/* Frames of the GOP after a dropped one depend on it */
+static gboolean
+_pwframesched_orphan(PwFrameSched *self, const PwFrame *f)
+{
+  return self->drop_chains && self->broken && f->gop == self->broken_gop &&
+    f->deadline > self->broken_deadline;
+}
+
+static void
+_pwframesched_drop(PwFrameSched *self, PwFrame *f, gboolean chained)
+{
+  if (chained) {
+    self->stats.chained++;
+  } else {
+    self->stats.missed++;
+    pwstats_add(self->misses, 1);
+    /* A dropped key frame takes the whole GOP with it */
+    if (! self->broken || f->gop != self->broken_gop) {
+      self->broken = TRUE;
+      self->broken_gop = f->gop;
+      self->broken_deadline = f->key ? 0 : f->deadline;
+    } else {
+      self->broken_deadline = MIN(self->broken_deadline,
+				  f->key ? 0 : f->deadline);
+    }
+  }
+  if (self->drop != NULL) self->drop(f->data, self->userdata);
+  g_free(f);
+  if (! chained) {
+    /* Take out those queued which depended on it */
+    GList *l = self->frames.head, *next;
+    for (; l != NULL; l = next) {
+      next = l->next;
+      if (_pwframesched_orphan(self, l->data)) {
+	PwFrame *orphan = l->data;
+	g_queue_delete_link(&self->frames, l);
+	_pwframesched_drop(self, orphan, TRUE);
+      }
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Schedule one stream's frames through throttle.  drop is called
+ *	with each frame dropped, e.g. to free it.  If drop_chains, a
+ *	dropped frame takes the later frames of its GOP with it.
+ *-----------------------------------------------------------------------*/
+PwFrameSched *
+pwframesched_create(PwThrottle *throttle, gboolean drop_chains,
+		    PwFrameDrop drop, gpointer userdata)
+{
+  PwFrameSched *self = g_new0(PwFrameSched, 1);
+  self->throttle = throttle;
+  self->drop_chains = drop_chains;
+  self->drop = drop;
+  self->userdata = userdata;
+  g_queue_init(&self->frames);
+  self->slack = pwstats_histogram("pwframesched.slack_ns");
+  self->misses = pwstats_counter("pwframesched.missed");
+  return self;
+}
+
+/* Queue a frame which must have drained by deadline_ns, on the clock
+ * the caller passes to pwframesched_next() */
+void
+pwframesched_push(PwFrameSched *self, gpointer data, size_t nbytes,
+		  guint64 deadline_ns, guint gop, gboolean key)
+{
+  PwFrame *f = g_new(PwFrame, 1);
+  f->data = data;
+  f->nbytes = nbytes;
+  f->deadline = deadline_ns;
+  f->gop = gop;
+  f->key = key;
+  if (_pwframesched_orphan(self, f)) {
+    _pwframesched_drop(self, f, TRUE);
+    return;
+  }
+  g_queue_insert_sorted(&self->frames, f, _pwframe_cmp, NULL);
+}
+
+/*-----------------------------------------------------------------------
+ *	Return the frame to send now, charged to the throttle, dropping
+ *	any which would be late.  If none may go, return NULL and set
+ *	*wait_ns to how long until one may, or 0 if none are queued.
+ *-----------------------------------------------------------------------*/
+gpointer
+pwframesched_next(PwFrameSched *self, guint64 now_ns, guint64 *wait_ns)
+{
+  PwThrottle *throttle = self->throttle;
+  PwFrame *f;
+
+  *wait_ns = 0;
+  while ((f = g_queue_peek_head(&self->frames)) != NULL) {
+    guint64 cost = _pwthrottle_ns(throttle->rate, f->nbytes);
+    guint64 finish = now_ns +
+      _pwthrottle_backlog(throttle, _pwthrottle_now(throttle->clock)) + cost;
+    gpointer data;
+
+    if (_pwframesched_orphan(self, f)) {
+      g_queue_pop_head(&self->frames);
+      _pwframesched_drop(self, f, TRUE);
+      continue;
+    }
+    if (finish > f->deadline) {
+      g_queue_pop_head(&self->frames);
+      _pwframesched_drop(self, f, FALSE);
+      continue;
+    }
+    if (pwthrottle_check_ns(throttle, f->nbytes, wait_ns) != 0) {
+      return NULL;
+    }
+    g_queue_pop_head(&self->frames);
+    self->stats.sent++;
+    pwstats_record(self->slack, f->deadline - finish);
+    data = f->data;
+    g_free(f);
+    return data;
+  }
+  return NULL;
+}
+
+void
+pwframesched_get_stats(PwFrameSched *self, PwFrameSchedStats *stats)
+{
+  *stats = self->stats;
+}
+
+/* Frames still queued are dropped without counting */
+void
+pwframesched_destroy(PwFrameSched *self)
+{
+  PwFrame *f;
+  while ((f = g_queue_pop_head(&self->frames)) != NULL) {
+    if (self->drop != NULL) self->drop(f->data, self->userdata);
+    g_free(f);
+  }
+  g_free(self);
+}
+
+/*-----------------------------------------------------------------------
+ *	Throttled writer
+ *-----------------------------------------------------------------------*/
+/* Buffers passed on in one piece */
+#define PWTHROTTLE_WRITE_IOV 16
+
+struct _PwThrottleWrite {
+  pw_IWrite iface;
+  pw_IWrite inner;
+  PwThrottle *throttle;
+  gsize chunk;			/* Largest piece, or 0 */
+  gboolean nonblock;
+  PwStat *bytes;
+  PwStat *waits;		/* Nanoseconds slept */
+};
+
+/* Sleep until the throttle lets nbytes through */
+static void
+_pwthrottle_write_wait(PwThrottleWrite *self, gsize nbytes)
+{
+  guint64 wait;
+
+  while (pwthrottle_check_ns(self->throttle, nbytes, &wait) != 0) {
+    guint64 deadline = _pwpacer_now() + wait;
+    struct timespec wake;
+    wake.tv_sec = deadline / NSEC_PER_SEC;
+    wake.tv_nsec = deadline % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+	   == EINTR) ;
+    pwstats_record(self->waits, wait);
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Write n buffers as one, in pieces of at most the chunk size and
+ *	the throttle's buffer size, passing the buffers on uncopied.
+ *	Without blocking, fail with PWTHROTTLE_ERROR_WOULD_BLOCK and
+ *	write nothing unless all may go now.  On a virtual clock, which
+ *	sleeping would not move on, it never blocks.
+ *-----------------------------------------------------------------------*/
+gboolean
+pwthrottle_write_writev(PwThrottleWrite *self, const struct iovec *iov,
+			guint n, GError **error)
+{
+  struct iovec piece[PWTHROTTLE_WRITE_IOV];
+  gsize limit = self->throttle->buffer_size, total = 0, off = 0;
+  PwClock *clock = self->throttle->clock;
+  gboolean nonblock = self->nonblock ||
+    (clock != NULL && pwclock_is_virtual(clock));
+  guint64 wait;
+  guint i = 0;
+
+  if (self->chunk != 0) limit = MIN(limit, self->chunk);
+  for (i=0; i < n; i++) total += iov[i].iov_len;
+  if (nonblock) {
+    if (total > self->throttle->buffer_size) {
+      g_set_error(error, PWTHROTTLE_ERROR, PWTHROTTLE_ERROR_TOO_BIG,
+		  "Write of %" G_GSIZE_FORMAT " bytes exceeds the buffer",
+		  total);
+      return FALSE;
+    }
+    if (pwthrottle_check_ns(self->throttle, total, &wait) != 0) {
+      g_set_error(error, PWTHROTTLE_ERROR, PWTHROTTLE_ERROR_WOULD_BLOCK,
+		  "Throttled for %" G_GUINT64_FORMAT " ns", wait);
+      return FALSE;
+    }
+  }
+
+  i = 0;
+  while (i < n) {
+    gsize len = 0;
+    guint np = 0;
+
+    /* Up to limit bytes, starting off bytes into iov[i] */
+    while (i < n && len < limit && np < PWTHROTTLE_WRITE_IOV) {
+      gsize take = MIN(iov[i].iov_len - off, limit - len);
+      if (take > 0) {
+	piece[np].iov_base = (guint8 *)iov[i].iov_base + off;
+	piece[np].iov_len = take;
+	np++;
+	len += take;
+      }
+      off += take;
+      if (off == iov[i].iov_len) {
+	i++;
+	off = 0;
+      }
+    }
+    if (np == 0) continue;
+    if (! nonblock) _pwthrottle_write_wait(self, len);
+    if (! pwio_writev(&self->inner, piece, np, error)) return FALSE;
+    pwstats_add(self->bytes, len);
+  }
+  return TRUE;
+}
+
+static gboolean
+_pwthrottle_write_write(void *priv, const void *data, gsize len,
+			GError **error)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  return pwthrottle_write_writev(priv, &iov, 1, error);
+}
+
+static gboolean
+_pwthrottle_write_writev(void *priv, const struct iovec *iov, guint n,
+			 GError **error)
+{
+  return pwthrottle_write_writev(priv, iov, n, error);
+}
+
+static gboolean
+_pwthrottle_write_flush(void *priv, GError **error)
+{
+  PwThrottleWrite *self = priv;
+  return PW_CAN(&self->inner, flush) ?
+    PW_CALL(&self->inner, flush, error) : TRUE;
+}
+
+static const pw_MIWrite pwthrottle_write_miwrite = {
+  sizeof(pwthrottle_write_miwrite),
+  &_pwthrottle_write_write,
+  &_pwthrottle_write_flush,
+  &_pwthrottle_write_writev,
+};
+
+/*-----------------------------------------------------------------------
+ *	Writer passing writes on to inner as throttle lets them, split
+ *	into pieces of at most chunk bytes (0 for no limit but the
+ *	throttle's buffer size).  Both must outlive it.
+ *-----------------------------------------------------------------------*/
+PwThrottleWrite *
+pwthrottle_write_new(const pw_IWrite *inner, PwThrottle *throttle,
+		     gsize chunk)
+{
+  PwThrottleWrite *self = g_new0(PwThrottleWrite, 1);
+  self->iface.methods = &pwthrottle_write_miwrite;
+  self->iface.priv = self;
+  self->inner = *inner;
+  self->throttle = throttle;
+  self->chunk = chunk;
+  self->bytes = pwstats_counter("pwthrottle.write_bytes");
+  self->waits = pwstats_histogram("pwthrottle.write_wait_ns");
+  return self;
+}
+
+/* Refuse writes which may not go yet, rather than sleeping */
+void
+pwthrottle_write_set_nonblock(PwThrottleWrite *self, gboolean nonblock)
+{
+  self->nonblock = nonblock;
+}
+
+const pw_IWrite *
+pwthrottle_write_iface(PwThrottleWrite *self)
+{
+  return &self->iface;
+}
+
+void
+pwthrottle_write_free(PwThrottleWrite *self)
 {
   g_free(self);
 }
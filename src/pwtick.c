@@ -0,0 +1,186 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Cheap timestamps from the CPU's counter, where it runs at a
+ *	constant rate on every core, else from CLOCK_MONOTONIC.
+ *	PWUTIL_TICKS=clock in the environment forces the latter.
+ *	The rate may take PWTICK_MEASURE_NS to find, on first use rather
+ *	than at load: pwtick_calibrate() before timing anything, as a
+ *	binary trace does when opened, keeps it out of the timings.
+ *=======================================================================*/
+#include "pwutil.h"
+#include <string.h>
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#  include <cpuid.h>
+#  include <x86intrin.h>
+#endif
+
+typedef enum {
+  PWTICK_CLOCK,
+  PWTICK_TSC,
+  PWTICK_CNTVCT,
+} PwTickSource;
+
+static const gchar *pwtick_names[] = {"clock", "tsc", "cntvct"};
+
+/* Ticks over which to measure the rate, and to refine it later */
+#define PWTICK_MEASURE_NS	2000000
+#define PWTICK_REFINE_NS	G_GUINT64_CONSTANT(100000000)
+
+static PwTickSource pwtick_src = PWTICK_CLOCK;
+static gint pwtick_ready = 0;
+static GMutex pwtick_lock;
+static PwTickCalibration pwtick_base;	/* First calibration */
+
+static guint64
+_pwtick_clock(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (guint64)now.tv_sec * G_GUINT64_CONSTANT(1000000000) + now.tv_nsec;
+}
+
+static inline guint64
+_pwtick_read(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  if (pwtick_src == PWTICK_TSC) return __rdtsc();
+#elif defined(__aarch64__)
+  if (pwtick_src == PWTICK_CNTVCT) {
+    guint64 ticks;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+  }
+#endif
+  return _pwtick_clock();
+}
+
+/* Counter and clock together: the tightest of a few tries */
+static void
+_pwtick_pair(guint64 *ticks, guint64 *ns)
+{
+  guint64 best = G_MAXUINT64;
+  guint i;
+  for (i=0; i < 5; i++) {
+    guint64 t0 = _pwtick_read();
+    guint64 clock = _pwtick_clock();
+    guint64 t1 = _pwtick_read();
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+      *ticks = t0 + (t1 - t0) / 2;
+      *ns = clock;
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Choose the source and find its rate, once
+ *-----------------------------------------------------------------------*/
+static void
+_pwtick_init(void)
+{
+  static gsize inited = 0;
+  if (g_once_init_enter(&inited)) {
+    const gchar *force = g_getenv("PWUTIL_TICKS");
+    guint64 hz = 0;
+
+    if (force == NULL || strcmp(force, "clock") != 0) {
+#if defined(__i386__) || defined(__x86_64__)
+      unsigned int eax, ebx, ecx, edx;
+      /* Invariant TSC: constant rate, and keeps going in deep C-states */
+      if (__get_cpuid_max(0x80000000, NULL) >= 0x80000007) {
+	__cpuid(0x80000007, eax, ebx, ecx, edx);
+	if (edx & (1 << 8)) {
+	  pwtick_src = PWTICK_TSC;
+	  /* Rate from the crystal ratio, where the CPU says */
+	  if (__get_cpuid_max(0, NULL) >= 0x15) {
+	    __cpuid(0x15, eax, ebx, ecx, edx);
+	    if (eax != 0 && ebx != 0 && ecx != 0) {
+	      hz = (guint64)ecx * ebx / eax;
+	    }
+	  }
+	}
+      }
+#elif defined(__aarch64__)
+      /* The generic timer always runs at a constant rate */
+      __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (hz));
+      if (hz != 0) pwtick_src = PWTICK_CNTVCT;
+#endif
+    }
+
+    _pwtick_pair(&pwtick_base.ticks, &pwtick_base.ns);
+    if (pwtick_src == PWTICK_CLOCK) {
+      hz = 1000000000;
+    } else if (hz == 0) {
+      /* Measure against the clock */
+      guint64 ticks, ns;
+      do {
+	_pwtick_pair(&ticks, &ns);
+      } while (ns - pwtick_base.ns < PWTICK_MEASURE_NS);
+      hz = (ticks - pwtick_base.ticks) * 1e9 / (ns - pwtick_base.ns);
+    }
+    pwtick_base.hz = hz;
+    g_atomic_int_set(&pwtick_ready, 1);
+    g_once_init_leave(&inited, 1);
+  }
+}
+
+/* Timestamp in ticks of the source */
+guint64
+pwtick_now(void)
+{
+  if (G_UNLIKELY(! g_atomic_int_get(&pwtick_ready))) _pwtick_init();
+  return _pwtick_read();
+}
+
+/* Name of the source: "tsc", "cntvct" or "clock" */
+const gchar *
+pwtick_source(void)
+{
+  _pwtick_init();
+  return pwtick_names[pwtick_src];
+}
+
+/*-----------------------------------------------------------------------
+ *	Current ticks and CLOCK_MONOTONIC, with the rate.  The rate is
+ *	refined from the first calibration once enough time has passed.
+ *-----------------------------------------------------------------------*/
+void
+pwtick_calibrate(PwTickCalibration *cal)
+{
+  _pwtick_init();
+  _pwtick_pair(&cal->ticks, &cal->ns);
+  g_mutex_lock(&pwtick_lock);
+  if (pwtick_src != PWTICK_CLOCK &&
+      cal->ns - pwtick_base.ns >= PWTICK_REFINE_NS) {
+    pwtick_base.hz = (cal->ticks - pwtick_base.ticks) * 1e9 /
+      (cal->ns - pwtick_base.ns);
+  }
+  cal->hz = pwtick_base.hz;
+  g_mutex_unlock(&pwtick_lock);
+}
+
+/* CLOCK_MONOTONIC nanoseconds for a timestamp */
+guint64
+pwtick_to_ns(guint64 ticks, const PwTickCalibration *cal)
+{
+  gint64 dt = (gint64)(ticks - cal->ticks);
+  return cal->ns + (gint64)(dt * (1e9 / cal->hz));
+}
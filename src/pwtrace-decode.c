@@ -0,0 +1,409 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Convert binary trace files to the text pwtracef() writes, or
+ *	with --json to Chrome trace-event JSON.  Each file is shown as
+ *	a process, e.g. one per tile of a wall.  Flight recorder files
+ *	and their dumps show the records the ring still holds.
+ *=======================================================================*/
+#include "pwtrace_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+typedef struct {
+  guint64 time;			/* Ticks, then nanoseconds */
+  guint seq;			/* Keeps order of equal times */
+  guint tid;
+  const gchar *string;		/* Format or name, if any */
+  const PwTraceRecord *rec;	/* In the file's data */
+} PwTraceEvent;
+
+/* Ticks and the clock at the same moment */
+typedef struct {
+  guint64 ticks;
+  guint64 ns;
+  guint64 hz;
+} PwTraceCalibration;
+
+/* What is known about one run's part of the file */
+typedef struct {
+  GHashTable *formats;		/* By id */
+  GArray *cals;			/* PwTraceCalibration in time order */
+  guint first, last;		/* Its events */
+} PwTraceSession;
+
+/* Session whose events start after those so far, sharing formats
+ * with another if not NULL */
+static PwTraceSession *
+_session_new(GPtrArray *sessions, GHashTable *formats, const GArray *events)
+{
+  PwTraceSession *session = g_new0(PwTraceSession, 1);
+  session->formats = (formats != NULL) ? g_hash_table_ref(formats) :
+    g_hash_table_new(g_direct_hash, g_direct_equal);
+  session->cals = g_array_new(FALSE, FALSE, sizeof(PwTraceCalibration));
+  session->first = session->last = events->len;
+  g_ptr_array_add(sessions, session);
+  return session;
+}
+
+static void
+_session_free(gpointer data)
+{
+  PwTraceSession *session = data;
+  g_hash_table_unref(session->formats);
+  g_array_free(session->cals, TRUE);
+  g_free(session);
+}
+
+static int
+_event_cmp(gconstpointer a, gconstpointer b)
+{
+  const PwTraceEvent *ea = a, *eb = b;
+  if (ea->time != eb->time) return (ea->time < eb->time) ? -1 : 1;
+  return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+/*-----------------------------------------------------------------------
+ *	Read records, collecting events.  A file appended to by more
+ *	than one run has a header (and new format ids) for each.
+ *-----------------------------------------------------------------------*/
+static gboolean
+_read_events(const guint8 *data, gsize len, GArray *events,
+	     GPtrArray *sessions, guint *dropped, GError **error)
+{
+  const guint8 *p = data, *end = data + len;
+  PwTraceSession *session = NULL;
+  guint tid = 0;
+
+  while (p < end) {
+    PwTraceRecord rec;
+    if (end - p >= sizeof(PwTraceFileHeader) &&
+	memcmp(p, PWTRACE_MAGIC, 8) == 0) {
+      PwTraceFileHeader header;
+      memcpy(&header, p, sizeof header);
+      if (header.byte_order != PWTRACE_BYTE_ORDER) {
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		    "Trace written with different byte order");
+	return FALSE;
+      }
+      if (header.version != PWTRACE_FILE_VERSION) {
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		    "Unknown trace version %u", header.version);
+	return FALSE;
+      }
+      session = _session_new(sessions, NULL, events);
+      p += sizeof header;
+      continue;
+    }
+    if (session == NULL) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Not a binary trace file");
+      return FALSE;
+    }
+    if (end - p < sizeof rec) break;
+    memcpy(&rec, p, sizeof rec);
+    if (rec.size < sizeof rec || rec.size > end - p) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "Bad record at offset %lu", (unsigned long)(p - data));
+      return FALSE;
+    }
+    if (rec.type == PWTRACE_REC_FORMAT) {
+      g_hash_table_insert(session->formats, GUINT_TO_POINTER(rec.id),
+			  (gpointer)(p + sizeof rec));
+    } else if (rec.type == PWTRACE_REC_CALIBRATION &&
+	       rec.size >= sizeof rec + 16) {
+      PwTraceCalibration cal;
+      cal.ticks = rec.time;
+      memcpy(&cal.ns, p + sizeof rec, 8);
+      memcpy(&cal.hz, p + sizeof rec + 8, 8);
+      g_array_append_val(session->cals, cal);
+    } else if (rec.type == PWTRACE_REC_THREAD) {
+      tid = rec.id;
+    } else if (rec.type == PWTRACE_REC_EVENT ||
+	       rec.type == PWTRACE_REC_BEGIN ||
+	       rec.type == PWTRACE_REC_END ||
+	       rec.type == PWTRACE_REC_COUNTER ||
+	       rec.type == PWTRACE_REC_DROP ||
+	       rec.type == PWTRACE_REC_THREAD_NAME) {
+      PwTraceEvent ev;
+      ev.time = rec.time;
+      ev.seq = events->len;
+      ev.tid = tid;
+      ev.string = NULL;
+      ev.rec = (const PwTraceRecord *)p;
+      if (rec.type == PWTRACE_REC_DROP) {
+	*dropped += rec.id;
+      } else if (rec.type != PWTRACE_REC_THREAD_NAME) {
+	ev.string = g_hash_table_lookup(session->formats,
+					GUINT_TO_POINTER(rec.id));
+	if (ev.string == NULL) {
+	  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		      "Undefined format %u", rec.id);
+	  return FALSE;
+	}
+      }
+      g_array_append_val(events, ev);
+      session->last = events->len;
+    }
+    p += rec.size;
+  }
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Read a flight recorder file: the records in the last ring's
+ *	worth of positions which are complete and not overwritten
+ *-----------------------------------------------------------------------*/
+static gboolean
+_read_flight(const guint8 *data, gsize len, GArray *events,
+	     GPtrArray *sessions, guint *dropped, GError **error)
+{
+  PwTraceFlightHeader header;
+  PwTraceSession *session;
+  PwTraceCalibration cal;
+  const guint8 *p, *end, *ring;
+  guint64 mask, pos, head;
+
+  memcpy(&header, data, sizeof header);
+  if (header.byte_order != PWTRACE_BYTE_ORDER) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		"Trace written with different byte order");
+    return FALSE;
+  }
+  if (header.version != PWTRACE_FILE_VERSION) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		"Unknown trace version %u", header.version);
+    return FALSE;
+  }
+  if (header.ring_size == 0 || (header.ring_size & (header.ring_size - 1)) ||
+      len < PWTRACE_FLIGHT_HEADER + PWTRACE_FLIGHT_FORMATS +
+      header.ring_size) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		"Truncated flight recorder file");
+    return FALSE;
+  }
+  session = _session_new(sessions, NULL, events);
+
+  p = data + PWTRACE_FLIGHT_HEADER;
+  end = p + MIN(header.formats_used, PWTRACE_FLIGHT_FORMATS);
+  while (end - p >= sizeof(PwTraceRecord)) {
+    PwTraceRecord rec;
+    memcpy(&rec, p, sizeof rec);
+    if (rec.size < sizeof rec || rec.size > end - p) break;
+    if (rec.type == PWTRACE_REC_FORMAT) {
+      g_hash_table_insert(session->formats, GUINT_TO_POINTER(rec.id),
+			  (gpointer)(p + sizeof rec));
+    }
+    p += rec.size;
+  }
+
+  *dropped += header.dropped;
+
+  ring = data + PWTRACE_FLIGHT_HEADER + PWTRACE_FLIGHT_FORMATS;
+  mask = header.ring_size - 1;
+  head = header.head;
+  pos = (head > header.ring_size) ? head - header.ring_size : 0;
+  while (pos + sizeof(PwTraceFlightRecord) <= head) {
+    gsize off = pos & mask;
+    gsize room = mask + 1 - off;
+    PwTraceFlightRecord fr;
+    PwTraceEvent ev;
+    gsize total;
+
+    if (room < sizeof fr) {
+      pos += room;
+      continue;
+    }
+    memcpy(&fr, ring + off, sizeof fr);
+    /* Incomplete, or not the start of a record */
+    if (fr.pos != pos) {
+      pos += 8;
+      continue;
+    }
+    if (fr.rec.type == PWTRACE_REC_PAD) {
+      pos += room;
+      continue;
+    }
+    total = offsetof(PwTraceFlightRecord, rec) + fr.rec.size;
+    if (fr.rec.size < sizeof fr.rec || fr.rec.size % 8 != 0 ||
+	total > room) {
+      pos += 8;
+      continue;
+    }
+    if (fr.rec.type == PWTRACE_REC_CALIBRATION &&
+	fr.rec.size >= sizeof fr.rec + 16) {
+      /* The clock changed: those before were timed by this one */
+      cal.ticks = fr.rec.time;
+      memcpy(&cal.ns, ring + off + sizeof fr, 8);
+      memcpy(&cal.hz, ring + off + sizeof fr + 8, 8);
+      g_array_append_val(session->cals, cal);
+      session = _session_new(sessions, session->formats, events);
+      pos += total;
+      continue;
+    }
+    ev.time = fr.rec.time;
+    ev.seq = events->len;
+    ev.tid = fr.tid;
+    ev.string = g_hash_table_lookup(session->formats,
+				    GUINT_TO_POINTER(fr.rec.id));
+    ev.rec = (const PwTraceRecord *)
+      (ring + off + offsetof(PwTraceFlightRecord, rec));
+    /* Formats which did not fit are lost */
+    if (ev.string != NULL) {
+      g_array_append_val(events, ev);
+      session->last = events->len;
+    }
+    pos += total;
+  }
+
+  /* The latest calibration, unless caught changing */
+  cal.ticks = header.cal[0][0];
+  cal.ns = header.cal[0][1];
+  cal.hz = header.cal[0][2];
+  g_array_append_val(session->cals, cal);
+  if (header.cal_seq % 2 == 0 && header.cal[1][0] > header.cal[0][0]) {
+    cal.ticks = header.cal[1][0];
+    cal.ns = header.cal[1][1];
+    cal.hz = header.cal[1][2];
+    g_array_append_val(session->cals, cal);
+  }
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Ticks to nanoseconds: interpolate between the calibrations
+ *	either side, or extrapolate from the nearest at the ends
+ *-----------------------------------------------------------------------*/
+static guint64
+_ticks_to_ns(guint64 ticks, const GArray *cals)
+{
+  const PwTraceCalibration *c = &g_array_index(cals, PwTraceCalibration, 0);
+  guint lo = 0, hi = cals->len - 1;
+  double rate;
+
+  /* Last calibration at or before ticks, if any */
+  while (lo < hi) {
+    guint mid = (lo + hi + 1) / 2;
+    if (c[mid].ticks <= ticks) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (lo + 1 < cals->len && c[lo].ticks <= ticks &&
+      c[lo + 1].ticks > c[lo].ticks) {
+    rate = (double)(c[lo + 1].ns - c[lo].ns) /
+      (c[lo + 1].ticks - c[lo].ticks);
+  } else {
+    rate = 1e9 / c[lo].hz;
+  }
+  return c[lo].ns + (gint64)((gint64)(ticks - c[lo].ticks) * rate);
+}
+
+static gboolean
+_convert_times(GArray *events, GPtrArray *sessions, GError **error)
+{
+  guint s, i;
+  for (s=0; s < sessions->len; s++) {
+    PwTraceSession *session = g_ptr_array_index(sessions, s);
+    if (session->first == session->last) continue;
+    if (session->cals->len == 0) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		  "No timestamp calibration");
+      return FALSE;
+    }
+    for (i=session->first; i < session->last; i++) {
+      PwTraceEvent *ev = &g_array_index(events, PwTraceEvent, i);
+      ev->time = _ticks_to_ns(ev->time, session->cals);
+    }
+  }
+  return TRUE;
+}
+
+/*-----------------------------------------------------------------------
+ *	Export one file's events in time order
+ *-----------------------------------------------------------------------*/
+static gboolean
+_decode_file(PwTraceExport *export, guint pid, const gchar *filename)
+{
+  GArray *events = g_array_new(FALSE, FALSE, sizeof(PwTraceEvent));
+  GPtrArray *sessions = g_ptr_array_new_with_free_func(_session_free);
+  GError *error = NULL;
+  gchar *data = NULL;
+  gsize len, i;
+  guint dropped = 0;
+  gboolean ok;
+
+  ok = g_file_get_contents(filename, &data, &len, &error);
+  if (ok && len >= sizeof(PwTraceFlightHeader) &&
+      memcmp(data, PWTRACE_FLIGHT_MAGIC, 8) == 0) {
+    ok = _read_flight((const guint8 *)data, len, events, sessions,
+		      &dropped, &error);
+  } else if (ok) {
+    ok = _read_events((const guint8 *)data, len, events, sessions,
+		      &dropped, &error);
+  }
+  ok = ok && _convert_times(events, sessions, &error);
+  if (! ok) {
+    g_printerr("%s: %s\n", filename, error->message);
+    g_error_free(error);
+  } else {
+    gchar *base = g_path_get_basename(filename);
+    pwtrace_export_name(export, pid, 0, base, -1);
+    g_free(base);
+    /* Each thread's records are in order, but threads are interleaved */
+    g_array_sort(events, _event_cmp);
+    for (i=0; i < events->len; i++) {
+      const PwTraceEvent *ev = &g_array_index(events, PwTraceEvent, i);
+      pwtrace_export_record(export, pid, ev->tid, ev->time, ev->rec,
+			    ev->string);
+    }
+    if (dropped != 0) {
+      g_printerr("%s: %u records dropped when rings were full\n",
+		 filename, dropped);
+    }
+  }
+  g_ptr_array_free(sessions, TRUE);
+  g_array_free(events, TRUE);
+  g_free(data);
+  return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+  PwTraceExport export;
+  gboolean json = FALSE;
+  int first = 1, i, rc = 0;
+
+  if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+    json = TRUE;
+    first = 2;
+  }
+  if (first >= argc) {
+    g_printerr("Usage: %s [--json] TRACEFILE...\n", argv[0]);
+    return 2;
+  }
+  pwtrace_export_start(&export, stdout, json);
+  for (i=first; i < argc; i++) {
+    if (! _decode_file(&export, i - first + 1, argv[i])) rc = 1;
+  }
+  pwtrace_export_finish(&export);
+  return rc;
+}
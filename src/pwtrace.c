@@ -0,0 +1,1504 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Tracing into a file, as text or as binary records.
+ *
+ *	In binary mode each thread packs its records into its own ring,
+ *	which only it writes and only the trace's writer thread reads,
+ *	so tracing takes no lock and makes no system call.  Records are
+ *	timestamped with pwtick_now(), calibrated in the file against
+ *	the clock, or with the time of a PwClock if given one.  The
+ *	writer empties the rings into the file every PWTRACE_DRAIN_USEC
+ *	and pwtrace-decode turns the file back into text, or into
+ *	Chrome trace-event JSON.  In JSON mode the writer converts the
+ *	records itself.
+ *
+ *	Besides pwtracef() lines, a trace holds spans (nested begin/end
+ *	pairs on a thread) and counters, shown as such by trace viewers.
+ *
+ *	In flight recorder mode all threads share one ring, mapped from
+ *	the trace file, which keeps the latest records for as long as
+ *	the program runs.  Nothing is written out unless asked for, or
+ *	the program crashes; the file holds the records even then.
+ *	Formats are defined in it as they are registered, and a thread
+ *	keeps its calibration current, so recording only claims space.
+ *=======================================================================*/
+#include "pwutil.h"
+#include "pwtrace_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+/* Limit tracing to this number of calls */
+#define PWTRACE_DEFAULT_COUNT	1000
+/* Size of each thread's ring in binary mode, unless BUFSIZE given */
+#define PWTRACE_DEFAULT_RING	(64 * 1024)
+#define PWTRACE_MIN_RING	4096
+/* How often the writer thread empties the rings, and records how
+ * timestamps relate to the clock */
+#define PWTRACE_DRAIN_USEC	20000
+#define PWTRACE_CALIBRATE_USEC	1000000
+/* Formats each thread remembers the id of */
+#define PWTRACE_FORMAT_CACHE	32
+/* Traces each thread finds its ring for without locking */
+#define PWTRACE_LOCAL_RINGS	4
+/* Flight recorder ring, unless BUFSIZE given */
+#define PWTRACE_FLIGHT_RING	(1024 * 1024)
+#define PWTRACE_MAX_FLIGHTS	8
+
+/*-----------------------------------------------------------------------
+ *	Ring of records from one thread
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  guint8 *buf;
+  gsize mask;			/* Size - 1, size being a power of 2 */
+  guint tid;
+  /* Written by the tracing thread */
+  const gchar *name;		/* Interned thread name, or NULL */
+  gsize head;			/* Bytes ever committed */
+  gsize next;			/* Head after the record being written */
+  guint dropped;		/* Records which did not fit */
+  /* Written by the writer thread, on its own cache line */
+  gsize tail __attribute__((aligned(64)));
+  guint reported;		/* Value of dropped already written */
+  const gchar *named;		/* Value of name already written */
+} PwTraceRing;
+
+/*-----------------------------------------------------------------------
+ *	Trace object
+ *-----------------------------------------------------------------------*/
+struct _PwTrace {
+  PwTraceHead head;
+  FILE *file;
+  guint left;			/* How many more records to write */
+  /* Binary and JSON modes only */
+  gboolean binary;
+  gboolean json;
+  gboolean limited;		/* By count, unless it was 0 */
+  PwClock *clock;		/* Instead of pwtick_now(), or NULL */
+  guint serial;			/* Distinguishes from earlier traces */
+  gsize ring_size;
+  GMutex lock;			/* Protects the rest */
+  GCond wake;
+  GPtrArray *rings;
+  GThread *writer;		/* For a flight recorder, recalibrates */
+  gboolean stop;
+  guint formats_written;
+  /* JSON mode only, used by the writer */
+  PwTraceExport export;
+  PwTickCalibration cal;
+  guint pid;
+  /* Flight recorder mode only */
+  gboolean flight;
+  PwTraceFlightHeader *map;
+  gsize map_size;
+  guint8 *ring;			/* In map */
+  gint recalibrating;
+  gchar *dump_file, *crash_file;
+};
+
+/*-----------------------------------------------------------------------
+ *	Parsed format: one item per specifier
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  gchar type;			/* i u x s b, ? if unknown, \0 if none */
+  gboolean counted;		/* Count is an argument ("*") */
+  guint count;
+} PwTraceItem;
+
+struct _PwTraceFormat {
+  guint id;			/* In binary files */
+  gchar *fmt;
+  gboolean variable;		/* Has strings or counts from arguments */
+  gsize fixed;			/* Otherwise, bytes of packed arguments */
+  guint nitems;
+  PwTraceItem items[1];
+};
+
+/* What each thread keeps */
+typedef struct {
+  guint tid;
+  const gchar *name;		/* Interned */
+  PwTrace *using;		/* Trace being recorded to, or NULL */
+  struct {
+    guint serial;
+    PwTraceRing *ring;
+  } rings[PWTRACE_LOCAL_RINGS];
+  struct {
+    const char *fmt;
+    PwTraceFormat *format;
+  } formats[PWTRACE_FORMAT_CACHE];
+} PwTraceThread;
+
+static void _pwtrace_thread_free(gpointer);
+static GPrivate pwtrace_thread = G_PRIVATE_INIT(_pwtrace_thread_free);
+static gint pwtrace_tids = 0;
+static gint pwtrace_serials = 0;
+
+/* Formats by id - 1, shared by all traces; binary traces open; and
+ * threads which have traced, for pwtrace_close() to wait for */
+static GMutex pwtrace_lock;
+static GPtrArray *pwtrace_formats = NULL;
+static GHashTable *pwtrace_format_table = NULL;
+static GSList *pwtrace_open_list = NULL;
+static GSList *pwtrace_threads = NULL;
+/* Flight recorders, to define formats in; the first few also for
+ * the signal handler */
+static GSList *pwtrace_flight_list = NULL;
+static PwTrace *volatile pwtrace_flights[PWTRACE_MAX_FLIGHTS];
+
+static gpointer _pwtrace_writer(gpointer);
+static void _pwtrace_atexit(void);
+static void _pwtrace_quiesce(PwTrace *);
+static void _pwtrace_calibrate(PwTrace *);
+
+/* Timestamp in ticks */
+static inline guint64
+_pwtrace_now(PwTrace *self)
+{
+  PwClock *clock = g_atomic_pointer_get(&self->clock);
+  return (clock != NULL) ? pwclock_now(clock) : pwtick_now();
+}
+
+/* Ticks against time: a clock's are its nanoseconds */
+static void
+_pwtrace_tick_calibrate(PwTrace *self, PwTickCalibration *cal)
+{
+  PwClock *clock = g_atomic_pointer_get(&self->clock);
+  if (clock != NULL) {
+    cal->ticks = cal->ns = pwclock_now(clock);
+    cal->hz = 1000000000;
+  } else {
+    pwtick_calibrate(cal);
+  }
+}
+
+/* Time for text mode */
+static void
+_pwtrace_time(PwTrace *self, struct timespec *now)
+{
+  PwClock *clock = g_atomic_pointer_get(&self->clock);
+  if (clock != NULL) {
+    guint64 ns = pwclock_now(clock);
+    now->tv_sec = ns / 1000000000;
+    now->tv_nsec = ns % 1000000000;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC_RAW, now);
+  }
+}
+
+static PwTrace *_pwtrace_flight_open(const gchar *, const gchar *);
+static void _pwtrace_flight_close(PwTrace *);
+static void _pwtrace_flight_formats(PwTrace *);
+
+/* Start of a binary file, or of a new session in one */
+static void
+_pwtrace_header(FILE *file)
+{
+  PwTraceFileHeader header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, PWTRACE_MAGIC, sizeof header.magic);
+  header.byte_order = PWTRACE_BYTE_ORDER;
+  header.version = PWTRACE_FILE_VERSION;
+  fwrite(&header, sizeof header, 1, file);
+}
+
+/* Value of ${stub}${suffix} from the environment */
+static const gchar *
+_pwtrace_getenv(const gchar *stub, const gchar *suffix)
+{
+  gchar *envvar = g_strconcat(stub, suffix, NULL);
+  const gchar *value = g_getenv(envvar);
+  g_free(envvar);
+  return value;
+}
+
+/*-----------------------------------------------------------------------
+ *	Open trace object
+ *	Filename from ${name}_TRACEFILE environment variable
+ *	Number of records from ${name}_COUNT environment variable
+ *	Buffer size from ${name}_BUFSIZE environment variable
+ *	(stdio buffer, or per-thread ring in binary mode)
+ *	${name}_TRACEFORMAT=binary for binary records, or json for
+ *	Chrome trace-event JSON (replacing the file, not appending),
+ *	or flight for the flight recorder (count not limited)
+ *-----------------------------------------------------------------------*/
+PwTrace *
+pwtrace_open(const char *name)
+{
+  FILE *file;
+  gchar *stub;
+  const gchar *filename, *svalue;
+  gboolean binary, json, flight;
+  PwTrace *self = NULL;
+
+  if (name == NULL) {
+    stub = g_strdup("");
+  } else {
+    stub = g_strdup_printf("%s_", name);
+  }
+  filename = _pwtrace_getenv(stub, "TRACEFILE");
+  svalue = _pwtrace_getenv(stub, "TRACEFORMAT");
+  json = (svalue != NULL && strcmp(svalue, "json") == 0);
+  binary = json || (svalue != NULL && strcmp(svalue, "binary") == 0);
+  flight = (svalue != NULL && strcmp(svalue, "flight") == 0);
+  if (filename != NULL && flight) {
+    self = _pwtrace_flight_open(stub, filename);
+  } else if (filename != NULL) {
+    file = fopen(filename, json ? "w" : binary ? "ab" : "a");
+    if (file == NULL) {
+      g_printerr("Cannot open %s", filename);
+    } else {
+      guint bufsize = 0;
+      guint count;
+
+      svalue = _pwtrace_getenv(stub, "BUFSIZE");
+      if (svalue != NULL) {
+	bufsize = atoi(svalue);
+	if (! binary) {
+	  gchar *buffer = g_malloc(bufsize);
+	  setvbuf(file, buffer, _IOFBF, bufsize);
+	}
+      }
+
+      svalue = _pwtrace_getenv(stub, "COUNT");
+      if (svalue == NULL) {
+	count = PWTRACE_DEFAULT_COUNT;
+      } else {
+	count = atoi(svalue);
+      }
+
+      self = g_new0(PwTrace, 1);
+      self->head.active = TRUE;
+      self->file = file;
+      self->left = count;
+      g_mutex_init(&self->lock);
+
+      if (json) {
+	self->json = TRUE;
+	self->pid = getpid();
+	pwtrace_export_start(&self->export, file, TRUE);
+	pwtrace_export_name(&self->export, self->pid, 0,
+			    (name == NULL) ? "pwtrace" : name, -1);
+	_pwtrace_calibrate(self);
+      } else if (binary) {
+	_pwtrace_header(file);
+	_pwtrace_calibrate(self);
+      }
+
+      if (binary) {
+	self->binary = TRUE;
+	self->limited = (count != 0);
+	self->serial = g_atomic_int_add(&pwtrace_serials, 1) + 1;
+	self->ring_size = PWTRACE_DEFAULT_RING;
+	if (bufsize != 0) {
+	  /* Round up to a power of 2 */
+	  self->ring_size = PWTRACE_MIN_RING;
+	  while (self->ring_size < bufsize) self->ring_size <<= 1;
+	}
+	g_cond_init(&self->wake);
+	self->rings = g_ptr_array_new();
+
+	g_mutex_lock(&pwtrace_lock);
+	if (pwtrace_open_list == NULL) {
+	  static gboolean registered = FALSE;
+	  if (! registered) atexit(_pwtrace_atexit);
+	  registered = TRUE;
+	}
+	pwtrace_open_list = g_slist_prepend(pwtrace_open_list, self);
+	g_mutex_unlock(&pwtrace_lock);
+
+	self->writer = g_thread_new("pwtrace", _pwtrace_writer, self);
+      }
+    }
+  }
+  g_free(stub);
+  return self;
+}
+
+void
+pwtrace_close(PwTrace *self)
+{
+  if (self == NULL) return;
+  if (self->flight) {
+    _pwtrace_flight_close(self);
+    return;
+  }
+  if (self->binary) {
+    guint i;
+    if (self->writer == NULL) return;
+    g_mutex_lock(&pwtrace_lock);
+    pwtrace_open_list = g_slist_remove(pwtrace_open_list, self);
+    g_mutex_unlock(&pwtrace_lock);
+    g_atomic_int_set(&self->head.active, FALSE);
+    _pwtrace_quiesce(self);
+    g_mutex_lock(&self->lock);
+    self->stop = TRUE;
+    g_cond_signal(&self->wake);
+    g_mutex_unlock(&self->lock);
+    g_thread_join(self->writer);
+    self->writer = NULL;
+    for (i=0; i < self->rings->len; i++) {
+      PwTraceRing *ring = g_ptr_array_index(self->rings, i);
+      g_free(ring->buf);
+      g_free(ring);
+    }
+    g_ptr_array_set_size(self->rings, 0);
+    return;
+  }
+  if (self->file == NULL) return;
+  g_atomic_int_set(&self->head.active, FALSE);
+  _pwtrace_quiesce(self);
+  fclose(self->file);
+  self->file = NULL;
+}
+
+/* Make sure binary traces reach the file even if never closed */
+static void
+_pwtrace_atexit(void)
+{
+  while (pwtrace_open_list != NULL) {
+    pwtrace_close(pwtrace_open_list->data);
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Per-thread state, rings and formats
+ *-----------------------------------------------------------------------*/
+static PwTraceThread *
+_pwtrace_thread(void)
+{
+  PwTraceThread *thread = g_private_get(&pwtrace_thread);
+  if (G_UNLIKELY(thread == NULL)) {
+    thread = g_new0(PwTraceThread, 1);
+    thread->tid = g_atomic_int_add(&pwtrace_tids, 1) + 1;
+    g_private_set(&pwtrace_thread, thread);
+    g_mutex_lock(&pwtrace_lock);
+    pwtrace_threads = g_slist_prepend(pwtrace_threads, thread);
+    g_mutex_unlock(&pwtrace_lock);
+  }
+  return thread;
+}
+
+static void
+_pwtrace_thread_free(gpointer data)
+{
+  g_mutex_lock(&pwtrace_lock);
+  pwtrace_threads = g_slist_remove(pwtrace_threads, data);
+  g_mutex_unlock(&pwtrace_lock);
+  g_free(data);
+}
+
+/* Say the thread is recording to the trace, so that pwtrace_close()
+ * waits for it; FALSE if the trace was closed meanwhile */
+static inline gboolean
+_pwtrace_enter(PwTrace *self, PwTraceThread *thread)
+{
+  __atomic_store_n(&thread->using, self, __ATOMIC_SEQ_CST);
+  if (G_LIKELY(__atomic_load_n(&self->head.active, __ATOMIC_SEQ_CST))) {
+    return TRUE;
+  }
+  __atomic_store_n(&thread->using, NULL, __ATOMIC_RELEASE);
+  return FALSE;
+}
+
+static inline void
+_pwtrace_leave(PwTraceThread *thread)
+{
+  __atomic_store_n(&thread->using, NULL, __ATOMIC_RELEASE);
+}
+
+/* Wait until no thread is recording to a trace made inactive, so
+ * its rings or file may be freed */
+static void
+_pwtrace_quiesce(PwTrace *self)
+{
+  gboolean busy = TRUE;
+
+  while (busy) {
+    GSList *l;
+    busy = FALSE;
+    g_mutex_lock(&pwtrace_lock);
+    for (l=pwtrace_threads; l != NULL; l=l->next) {
+      PwTraceThread *thread = l->data;
+      if (__atomic_load_n(&thread->using, __ATOMIC_SEQ_CST) == self) {
+	busy = TRUE;
+      }
+    }
+    g_mutex_unlock(&pwtrace_lock);
+    if (busy) g_thread_yield();
+  }
+}
+
+static PwTraceRing *
+_pwtrace_ring(PwTrace *self, PwTraceThread *thread)
+{
+  PwTraceRing *ring = NULL;
+  guint i, slot = 0;
+
+  for (i=0; i < PWTRACE_LOCAL_RINGS; i++) {
+    if (thread->rings[i].serial == self->serial) {
+      ring = thread->rings[i].ring;
+      if (G_UNLIKELY(ring->name != thread->name)) {
+	g_atomic_pointer_set(&ring->name, thread->name);
+      }
+      return ring;
+    }
+  }
+
+  /* First record from this thread, or it traces to many files */
+  g_mutex_lock(&self->lock);
+  for (i=0; i < self->rings->len; i++) {
+    PwTraceRing *r = g_ptr_array_index(self->rings, i);
+    if (r->tid == thread->tid) {
+      ring = r;
+      break;
+    }
+  }
+  if (ring == NULL) {
+    ring = g_new0(PwTraceRing, 1);
+    ring->buf = g_malloc(self->ring_size);
+    ring->mask = self->ring_size - 1;
+    ring->tid = thread->tid;
+    g_ptr_array_add(self->rings, ring);
+  }
+  g_atomic_pointer_set(&ring->name, thread->name);
+  g_mutex_unlock(&self->lock);
+
+  /* Replace the oldest trace, likely closed as serials only grow */
+  for (i=1; i < PWTRACE_LOCAL_RINGS; i++) {
+    if (thread->rings[i].serial < thread->rings[slot].serial) slot = i;
+  }
+  thread->rings[slot].serial = self->serial;
+  thread->rings[slot].ring = ring;
+  return ring;
+}
+
+/* Name the calling thread in all traces, from its next record */
+void
+pwtrace_thread_name(const char *name)
+{
+  PwTraceThread *thread = _pwtrace_thread();
+
+  thread->name = g_intern_string(name);
+}
+
+/* Format for a string, using the thread's cache */
+static PwTraceFormat *
+_pwtrace_format(PwTraceThread *thread, const char *fmt)
+{
+  guint slot = ((gsize)fmt >> 3) % PWTRACE_FORMAT_CACHE;
+  PwTraceFormat *format = thread->formats[slot].format;
+
+  /* The same pointer usually means the same constant string */
+  if (thread->formats[slot].fmt == fmt && strcmp(format->fmt, fmt) == 0) {
+    return format;
+  }
+  format = pwtrace_register_format(fmt);
+  thread->formats[slot].fmt = fmt;
+  thread->formats[slot].format = format;
+  return format;
+}
+
+/*-----------------------------------------------------------------------
+ *	Reserve space for a record of size bytes, or NULL if full.
+ *	Records never wrap: a record which would is moved to the
+ *	start, leaving a pad marker (if there is room for one).
+ *-----------------------------------------------------------------------*/
+static PwTraceRecord *
+_pwtrace_reserve(PwTraceRing *ring, gsize size)
+{
+  gsize head = ring->head;
+  gsize tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  gsize off = head & ring->mask;
+  gsize room = ring->mask + 1 - off;
+  gsize skip = (room < size) ? room : 0;
+
+  if (head + skip + size - tail > ring->mask + 1) return NULL;
+  if (skip != 0 && room >= sizeof(PwTraceRecord)) {
+    ((PwTraceRecord *)(ring->buf + off))->type = PWTRACE_REC_PAD;
+  }
+  head += skip;
+  ring->next = head + size;
+  return (PwTraceRecord *)(ring->buf + (head & ring->mask));
+}
+
+static void
+_pwtrace_commit(PwTraceRing *ring)
+{
+  __atomic_store_n(&ring->head, ring->next, __ATOMIC_RELEASE);
+}
+
+/*-----------------------------------------------------------------------
+ *	Pack arguments as described in pwtrace_file.h, returning the
+ *	number of bytes.  With dst NULL, only measure.
+ *-----------------------------------------------------------------------*/
+static gsize
+_pwtrace_pack(guint8 *dst, const PwTraceFormat *format, va_list *ap)
+{
+  const PwTraceItem *item = format->items;
+  const PwTraceItem *end = item + format->nitems;
+  guint8 *p = dst;
+  gsize n = 0;
+  guint count, i;
+  guint32 val;
+
+#define PUT(src, len) \
+  do { if (p) { memcpy(p, (src), (len)); p += (len); } n += (len); } while (0)
+  for (; item < end; item++) {
+    count = item->count;
+    if (item->counted) {
+      count = va_arg(*ap, unsigned int);
+      val = count;
+      PUT(&val, 4);
+    }
+    switch (item->type) {
+    case 'i':
+    case 'u':
+    case 'x':
+      for (i=0; i < count; i++) {
+	val = va_arg(*ap, unsigned int);
+	PUT(&val, 4);
+      }
+      break;
+    case 's':
+      for (i=0; i < count; i++) {
+	const char *str = va_arg(*ap, const char *);
+	gsize len = (str == NULL) ? 0 : strlen(str);
+	guint16 len16 = (str == NULL) ? PWTRACE_NULL_STRING :
+	  MIN(len, PWTRACE_NULL_STRING - 1);
+	PUT(&len16, 2);
+	if (str != NULL) PUT(str, len16);
+      }
+      break;
+    case 'b':
+      PUT(va_arg(*ap, const guchar *), count);
+      break;
+    }
+  }
+#undef PUT
+  return n;
+}
+
+/*-----------------------------------------------------------------------
+ *	Flight recorder ring: any thread claims the next size bytes.
+ *	The record's position, written last, says it is complete.
+ *	A record which would wrap leaves a pad marker and tries again.
+ *-----------------------------------------------------------------------*/
+static PwTraceRecord *
+_pwtrace_flight_claim(PwTrace *self, guint tid, gsize total, guint64 *pos)
+{
+  gsize mask = self->map->ring_size - 1;
+
+  while (1) {
+    guint64 p = __atomic_fetch_add(&self->map->head, total, __ATOMIC_RELAXED);
+    gsize off = p & mask;
+    gsize room = mask + 1 - off;
+    PwTraceFlightRecord *fr = (PwTraceFlightRecord *)(self->ring + off);
+    if (room >= total) {
+      fr->tid = tid;
+      *pos = p;
+      return &fr->rec;
+    }
+    if (room >= sizeof *fr) {
+      fr->tid = tid;
+      fr->rec.type = PWTRACE_REC_PAD;
+      __atomic_store_n(&fr->pos, p, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+static PwTraceRecord *
+_pwtrace_flight_reserve(PwTrace *self, PwTraceThread *thread, gsize size,
+			guint64 *pos)
+{
+  PwTraceFlightHeader *map = self->map;
+  gsize mask = map->ring_size - 1;
+  gsize total = offsetof(PwTraceFlightRecord, rec) + size;
+
+  if (size > PWTRACE_RECORD_MAX || total > (mask + 1) / 4) {
+    __atomic_fetch_add(&map->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return _pwtrace_flight_claim(self, thread->tid, total, pos);
+}
+
+static void
+_pwtrace_flight_commit(PwTraceRecord *rec, guint64 pos)
+{
+  PwTraceFlightRecord *fr = (PwTraceFlightRecord *)
+    ((guint8 *)rec - offsetof(PwTraceFlightRecord, rec));
+  __atomic_store_n(&fr->pos, pos, __ATOMIC_RELEASE);
+}
+
+static void
+_pwtrace_binary(PwTrace *self, PwTraceThread *thread,
+		const PwTraceFormat *format, va_list ap)
+{
+  PwTraceRing *ring = NULL;
+  PwTraceRecord *rec = NULL;
+  guint64 now = _pwtrace_now(self);
+  guint64 pos = 0;
+  gsize size;
+  va_list aq;
+
+  if (format->variable) {
+    va_copy(aq, ap);
+    size = _pwtrace_pack(NULL, format, &aq);
+    va_end(aq);
+  } else {
+    size = format->fixed;
+  }
+  size = PWTRACE_ALIGN(sizeof(PwTraceRecord) + size);
+  if (self->flight) {
+    rec = _pwtrace_flight_reserve(self, thread, size, &pos);
+    if (rec == NULL) return;
+  } else {
+    ring = _pwtrace_ring(self, thread);
+    if (size <= PWTRACE_RECORD_MAX) {
+      rec = _pwtrace_reserve(ring, size);
+    }
+    if (rec == NULL) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  rec->size = size;
+  rec->type = PWTRACE_REC_EVENT;
+  rec->spare = 0;
+  rec->id = format->id;
+  rec->time = now;
+  va_copy(aq, ap);
+  _pwtrace_pack((guint8 *)(rec + 1), format, &aq);
+  va_end(aq);
+  if (self->flight) {
+    _pwtrace_flight_commit(rec, pos);
+  } else {
+    _pwtrace_commit(ring);
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Writer thread: empty the rings into the file
+ *-----------------------------------------------------------------------*/
+static void
+_pwtrace_out(PwTrace *self, guint tid, const PwTraceRecord *rec)
+{
+  if (self->json) {
+    const gchar *string = NULL;
+    if (rec->type == PWTRACE_REC_EVENT ||
+	(rec->type >= PWTRACE_REC_BEGIN && rec->type <= PWTRACE_REC_COUNTER)) {
+      const PwTraceFormat *format;
+      g_mutex_lock(&pwtrace_lock);
+      format = g_ptr_array_index(pwtrace_formats, rec->id - 1);
+      g_mutex_unlock(&pwtrace_lock);
+      string = format->fmt;
+    }
+    pwtrace_export_record(&self->export, self->pid, tid,
+			  pwtick_to_ns(rec->time, &self->cal), rec, string);
+  } else {
+    fwrite(rec, rec->size, 1, self->file);
+  }
+}
+
+static void
+_pwtrace_put(PwTrace *self, guint tid, PwTraceRecordType type, guint32 id)
+{
+  PwTraceRecord rec;
+
+  rec.size = sizeof rec;
+  rec.type = type;
+  rec.spare = 0;
+  rec.id = id;
+  rec.time = _pwtrace_now(self);
+  _pwtrace_out(self, tid, &rec);
+}
+
+/* Name of a thread, before its records */
+static void
+_pwtrace_put_name(PwTrace *self, guint tid, const gchar *name)
+{
+  /* Long names are cut short */
+  guint64 buf[(sizeof(PwTraceRecord) + 256) / 8];
+  PwTraceRecord *rec = (PwTraceRecord *)buf;
+  gsize len = MIN(strlen(name), 255);
+
+  memset(buf, 0, sizeof buf);
+  rec->size = PWTRACE_ALIGN(sizeof *rec + len + 1);
+  rec->type = PWTRACE_REC_THREAD_NAME;
+  rec->id = tid;
+  rec->time = _pwtrace_now(self);
+  memcpy(rec + 1, name, len);
+  _pwtrace_out(self, tid, rec);
+}
+
+/* So that the decoder can convert ticks to time; in JSON mode, so
+ * that the writer can */
+static void
+_pwtrace_calibrate(PwTrace *self)
+{
+  PwTraceRecord rec;
+  PwTickCalibration cal;
+  guint64 payload[2];
+
+  _pwtrace_tick_calibrate(self, &cal);
+  if (self->json) {
+    self->cal = cal;
+    return;
+  }
+  rec.size = sizeof rec + sizeof payload;
+  rec.type = PWTRACE_REC_CALIBRATION;
+  rec.spare = 0;
+  rec.id = 0;
+  rec.time = cal.ticks;
+  payload[0] = cal.ns;
+  payload[1] = cal.hz;
+  fwrite(&rec, sizeof rec, 1, self->file);
+  fwrite(payload, sizeof payload, 1, self->file);
+}
+
+/* Define any formats registered since last time */
+static void
+_pwtrace_write_formats(PwTrace *self)
+{
+  g_mutex_lock(&pwtrace_lock);
+  while (self->formats_written < pwtrace_formats->len) {
+    const PwTraceFormat *format = g_ptr_array_index(pwtrace_formats,
+						    self->formats_written);
+    const gchar *fmt = format->fmt;
+    gsize len = strlen(fmt) + 1;
+    PwTraceRecord rec;
+    static const guint8 zeros[8];
+
+    self->formats_written++;
+    rec.size = PWTRACE_ALIGN(sizeof rec + len);
+    rec.type = PWTRACE_REC_FORMAT;
+    rec.spare = 0;
+    rec.id = self->formats_written;
+    rec.time = 0;
+    fwrite(&rec, sizeof rec, 1, self->file);
+    fwrite(fmt, len, 1, self->file);
+    fwrite(zeros, rec.size - sizeof rec - len, 1, self->file);
+  }
+  g_mutex_unlock(&pwtrace_lock);
+}
+
+static void
+_pwtrace_drain(PwTrace *self, PwTraceRing *ring)
+{
+  gsize head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  guint dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  const gchar *name = g_atomic_pointer_get(&ring->name);
+  gsize tail = ring->tail;
+
+  if (tail == head && dropped == ring->reported && name == ring->named) {
+    return;
+  }
+  if (! self->json) {
+    /* Formats of these records were registered before they were written */
+    _pwtrace_write_formats(self);
+    _pwtrace_put(self, ring->tid, PWTRACE_REC_THREAD, ring->tid);
+  }
+  if (name != ring->named) {
+    _pwtrace_put_name(self, ring->tid, name);
+    ring->named = name;
+  }
+  while (tail != head) {
+    gsize off = tail & ring->mask;
+    gsize room = ring->mask + 1 - off;
+    PwTraceRecord *rec = (PwTraceRecord *)(ring->buf + off);
+    if (room < sizeof *rec || rec->type == PWTRACE_REC_PAD) {
+      tail += room;
+    } else {
+      _pwtrace_out(self, ring->tid, rec);
+      tail += rec->size;
+    }
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  if (dropped != ring->reported) {
+    _pwtrace_put(self, ring->tid, PWTRACE_REC_DROP,
+		 dropped - ring->reported);
+    ring->reported = dropped;
+  }
+}
+
+static gpointer
+_pwtrace_writer(gpointer data)
+{
+  PwTrace *self = data;
+  gint64 calibrated = g_get_monotonic_time();
+  guint i;
+
+  g_mutex_lock(&self->lock);
+  while (! self->stop) {
+    gint64 now;
+    g_cond_wait_until(&self->wake, &self->lock,
+		      g_get_monotonic_time() + PWTRACE_DRAIN_USEC);
+    for (i=0; i < self->rings->len; i++) {
+      _pwtrace_drain(self, g_ptr_array_index(self->rings, i));
+    }
+    now = g_get_monotonic_time();
+    if (now - calibrated >= PWTRACE_CALIBRATE_USEC) {
+      _pwtrace_calibrate(self);
+      calibrated = now;
+    }
+    fflush(self->file);
+    /* Stop once the count is used up, after records which were
+     * being written at the time */
+    if (! g_atomic_int_get(&self->head.active)) {
+      g_mutex_unlock(&self->lock);
+      _pwtrace_quiesce(self);
+      g_mutex_lock(&self->lock);
+      break;
+    }
+  }
+  for (i=0; i < self->rings->len; i++) {
+    _pwtrace_drain(self, g_ptr_array_index(self->rings, i));
+  }
+  _pwtrace_calibrate(self);
+  if (self->json) pwtrace_export_finish(&self->export);
+  fclose(self->file);
+  self->file = NULL;
+  g_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------
+ *	Formats: parsed once, shared by all traces
+ *	No embedded text in format, just item specifiers, each optionally
+ *	preceded by a count (or * to take the count from the arguments):
+ *	i	int
+ *	u	unsigned int
+ *	x	unsigned int as hex
+ *	s	char*, null-terminated string
+ *	b	unsigned char *, (count) bytes, each as 2-digit hex
+ *-----------------------------------------------------------------------*/
+static PwTraceFormat *
+_pwtrace_parse(const char *fmt)
+{
+  /* Each item uses at least one character, and one may be left over */
+  PwTraceFormat *self = g_malloc0(sizeof(PwTraceFormat) +
+				  strlen(fmt) * sizeof(PwTraceItem));
+  PwTraceItem *item;
+  guchar c;
+
+  self->fmt = g_strdup(fmt);
+  while (1) {
+    c = *fmt++;
+    if (c == '\0') break;
+    item = &self->items[self->nitems++];
+    item->count = 1;
+    /* Optional repeat count */
+    if (isdigit(c)) {
+      item->count = 0;
+      do {
+	item->count = 10 * item->count + c-'0';
+	c = *fmt++;
+      } while (isdigit(c));
+      /* A count with nothing to count is shown as unknown */
+      if (c == '\0') c = '?';
+    } else if (c == '*') {
+      item->counted = TRUE;
+      self->variable = TRUE;
+      self->fixed += 4;
+      c = *fmt++;
+    }
+    if (c == 'i' || c == 'u' || c == 'x') {
+      self->fixed += 4 * item->count;
+    } else if (c == 'b') {
+      self->fixed += item->count;
+    } else if (c == 's') {
+      self->variable = TRUE;
+    } else if (c != '\0') {
+      c = '?';
+    }
+    item->type = c;
+    if (c == '\0' || c == '?') break;
+  }
+  return self;
+}
+
+PwTraceFormat *
+pwtrace_register_format(const char *fmt)
+{
+  PwTraceFormat *format;
+  GSList *l;
+
+  g_mutex_lock(&pwtrace_lock);
+  if (pwtrace_formats == NULL) {
+    pwtrace_formats = g_ptr_array_new();
+    pwtrace_format_table = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+  format = g_hash_table_lookup(pwtrace_format_table, fmt);
+  if (format == NULL) {
+    format = _pwtrace_parse(fmt);
+    g_ptr_array_add(pwtrace_formats, format);
+    format->id = pwtrace_formats->len;
+    g_hash_table_insert(pwtrace_format_table, format->fmt, format);
+    for (l=pwtrace_flight_list; l != NULL; l=l->next) {
+      _pwtrace_flight_formats(l->data);
+    }
+  }
+  g_mutex_unlock(&pwtrace_lock);
+  return format;
+}
+
+/*-----------------------------------------------------------------------
+ *	Text output
+ *-----------------------------------------------------------------------*/
+static void
+_pwtrace_text_done(PwTrace *self)
+{
+  /* Close if requested count reached */
+  if (-- self->left == 0) {
+    self->head.active = FALSE;
+    fclose(self->file);
+    self->file = NULL;
+  }
+}
+
+static void
+_pwtrace_text(PwTrace *self, const PwTraceFormat *format, va_list ap)
+{
+  const PwTraceItem *item = format->items;
+  const PwTraceItem *end = item + format->nitems;
+  struct timespec now;
+  guint count, i;
+
+  _pwtrace_time(self, &now);
+  fprintf(self->file, "%lu.%06ld",
+	  now.tv_sec, now.tv_nsec / 1000);
+
+  for (; item < end; item++) {
+    count = item->counted ? va_arg(ap, unsigned int) : item->count;
+    if (item->type == 'i') {
+      for (i=0; i < count; i++) {
+	int ival = va_arg(ap, int);
+	fprintf(self->file, " %d", ival);
+      }
+    } else if (item->type == 'u') {
+      for (i=0; i < count; i++) {
+	unsigned int ival = va_arg(ap, unsigned int);
+	fprintf(self->file, " %u", ival);
+      }
+    } else if (item->type == 'x') {
+      for (i=0; i < count; i++) {
+	unsigned int ival = va_arg(ap, unsigned int);
+	fprintf(self->file, " %x", ival);
+      }
+    } else if (item->type == 's') {
+      for (i=0; i < count; i++) {
+	const char *str = va_arg(ap, const char *);
+	fprintf(self->file, " %s", str);
+      }
+    } else if (item->type == 'b') {
+      const guchar *bytes = va_arg(ap, const guchar *);
+      for (i=0; i < count; i++) {
+	guchar b = *bytes++;
+	fprintf(self->file, " %02x", b);
+      }
+    } else if (item->type == '?') {
+      fprintf(self->file, "?");
+    }
+  }
+  fprintf(self->file, "\n");
+  _pwtrace_text_done(self);
+}
+
+/* Claim one of the count before writing a binary record, as other
+ * threads may be racing.  The writer thread closes the file when
+ * it is used up. */
+static gboolean
+_pwtrace_claim(PwTrace *self)
+{
+  if (self->limited) {
+    gint left = g_atomic_int_add((gint *)&self->left, -1);
+    if (left <= 0) return FALSE;
+    if (left == 1) g_atomic_int_set(&self->head.active, FALSE);
+  }
+  return TRUE;
+}
+
+static void
+_pwtrace_vemit(PwTrace *self, PwTraceThread *thread,
+	       const PwTraceFormat *format, va_list ap)
+{
+  if (self->binary) {
+    if (! _pwtrace_claim(self)) return;
+    _pwtrace_binary(self, thread, format, ap);
+  } else {
+    _pwtrace_text(self, format, ap);
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Formatted trace output, format as above
+ *-----------------------------------------------------------------------*/
+void
+pwtracef(PwTrace *self, const char *fmt, ...)
+{
+  PwTraceThread *thread;
+  va_list ap;
+
+  if (! pwtrace_enabled(self)) return;
+  thread = _pwtrace_thread();
+  if (! _pwtrace_enter(self, thread)) return;
+  va_start(ap, fmt);
+  _pwtrace_vemit(self, thread, _pwtrace_format(thread, fmt), ap);
+  va_end(ap);
+  _pwtrace_leave(thread);
+}
+
+/* Same with format already registered */
+void
+pwtrace_emit(PwTrace *self, const PwTraceFormat *format, ...)
+{
+  PwTraceThread *thread;
+  va_list ap;
+
+  if (! pwtrace_enabled(self)) return;
+  thread = _pwtrace_thread();
+  if (! _pwtrace_enter(self, thread)) return;
+  va_start(ap, format);
+  _pwtrace_vemit(self, thread, format, ap);
+  va_end(ap);
+  _pwtrace_leave(thread);
+}
+
+/*-----------------------------------------------------------------------
+ *	Spans and counters, the name interned like a format
+ *-----------------------------------------------------------------------*/
+static void
+_pwtrace_mark(PwTrace *self, PwTraceThread *thread, PwTraceRecordType type,
+	      const char *name, gint64 value)
+{
+  if (self->binary) {
+    guint64 now = _pwtrace_now(self);
+    const PwTraceFormat *format = _pwtrace_format(thread, name);
+    PwTraceRing *ring = NULL;
+    PwTraceRecord *rec;
+    gsize size = sizeof *rec + ((type == PWTRACE_REC_COUNTER) ? 8 : 0);
+    guint64 pos = 0;
+
+    if (! _pwtrace_claim(self)) return;
+    if (self->flight) {
+      rec = _pwtrace_flight_reserve(self, thread, size, &pos);
+      if (rec == NULL) return;
+    } else {
+      ring = _pwtrace_ring(self, thread);
+      rec = _pwtrace_reserve(ring, size);
+      if (rec == NULL) {
+	__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+	return;
+      }
+    }
+    rec->size = size;
+    rec->type = type;
+    rec->spare = 0;
+    rec->id = format->id;
+    rec->time = now;
+    if (type == PWTRACE_REC_COUNTER) memcpy(rec + 1, &value, 8);
+    if (self->flight) {
+      _pwtrace_flight_commit(rec, pos);
+    } else {
+      _pwtrace_commit(ring);
+    }
+  } else {
+    struct timespec now;
+    _pwtrace_time(self, &now);
+    fprintf(self->file, "%lu.%06ld %c %s",
+	    now.tv_sec, now.tv_nsec / 1000,
+	    "BEC"[type - PWTRACE_REC_BEGIN], name);
+    if (type == PWTRACE_REC_COUNTER) {
+      fprintf(self->file, " %" G_GINT64_FORMAT, value);
+    }
+    fprintf(self->file, "\n");
+    _pwtrace_text_done(self);
+  }
+}
+
+void
+pwtrace_begin(PwTrace *self, const char *name)
+{
+  PwTraceThread *thread;
+
+  if (! pwtrace_enabled(self)) return;
+  thread = _pwtrace_thread();
+  if (! _pwtrace_enter(self, thread)) return;
+  _pwtrace_mark(self, thread, PWTRACE_REC_BEGIN, name, 0);
+  _pwtrace_leave(thread);
+}
+
+void
+pwtrace_end(PwTrace *self, const char *name)
+{
+  PwTraceThread *thread;
+
+  if (! pwtrace_enabled(self)) return;
+  thread = _pwtrace_thread();
+  if (! _pwtrace_enter(self, thread)) return;
+  _pwtrace_mark(self, thread, PWTRACE_REC_END, name, 0);
+  _pwtrace_leave(thread);
+}
+
+void
+pwtrace_counter(PwTrace *self, const char *name, gint64 value)
+{
+  PwTraceThread *thread;
+
+  if (! pwtrace_enabled(self)) return;
+  thread = _pwtrace_thread();
+  if (! _pwtrace_enter(self, thread)) return;
+  _pwtrace_mark(self, thread, PWTRACE_REC_COUNTER, name, value);
+  _pwtrace_leave(thread);
+}
+
+/*-----------------------------------------------------------------------
+ *	Flight recorder: the file is mapped and written in place
+ *-----------------------------------------------------------------------*/
+
+/* Define formats registered since last time, while there is room,
+ * pwtrace_lock held: when opened, then as each is registered, so
+ * before any record using it */
+static void
+_pwtrace_flight_formats(PwTrace *self)
+{
+  PwTraceFlightHeader *map = self->map;
+  guint8 *area = (guint8 *)map + PWTRACE_FLIGHT_HEADER;
+
+  while (map->formats < pwtrace_formats->len) {
+    const PwTraceFormat *format = g_ptr_array_index(pwtrace_formats,
+						    map->formats);
+    gsize len = strlen(format->fmt) + 1;
+    PwTraceRecord *rec = (PwTraceRecord *)(area + map->formats_used);
+    gsize size = PWTRACE_ALIGN(sizeof *rec + len);
+
+    if (map->formats_used + size > PWTRACE_FLIGHT_FORMATS) break;
+    memset(rec, 0, size);
+    rec->size = size;
+    rec->type = PWTRACE_REC_FORMAT;
+    rec->id = format->id;
+    memcpy(rec + 1, format->fmt, len);
+    map->formats_used += size;
+    __atomic_store_n(&map->formats, format->id, __ATOMIC_RELEASE);
+  }
+}
+
+/* Calibration at start (slot 0) or latest (slot 1), which may be
+ * read by a dump while it changes */
+static void
+_pwtrace_flight_calibrate(PwTrace *self, gint slot)
+{
+  PwTraceFlightHeader *map = self->map;
+  PwTickCalibration cal;
+
+  _pwtrace_tick_calibrate(self, &cal);
+  __atomic_fetch_add(&map->cal_seq, 1, __ATOMIC_ACQ_REL);
+  map->cal[slot][0] = cal.ticks;
+  map->cal[slot][1] = cal.ns;
+  map->cal[slot][2] = cal.hz;
+  __atomic_fetch_add(&map->cal_seq, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Keep the latest calibration current, away from the record path */
+static gpointer
+_pwtrace_flight_thread(gpointer data)
+{
+  PwTrace *self = data;
+
+  g_mutex_lock(&self->lock);
+  while (! self->stop) {
+    g_cond_wait_until(&self->wake, &self->lock,
+		      g_get_monotonic_time() + PWTRACE_CALIBRATE_USEC);
+    if (! self->stop &&
+	g_atomic_int_compare_and_exchange(&self->recalibrating, 0, 1)) {
+      _pwtrace_flight_calibrate(self, 1);
+      g_atomic_int_set(&self->recalibrating, 0);
+    }
+  }
+  g_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+/* Calibration record in the ring, for the records before it, which
+ * a change of clock leaves behind */
+static void
+_pwtrace_flight_mark(PwTrace *self)
+{
+  PwTickCalibration cal;
+  PwTraceRecord *rec;
+  guint64 payload[2], pos;
+  gsize size = sizeof *rec + sizeof payload;
+
+  rec = _pwtrace_flight_claim(self, 0, offsetof(PwTraceFlightRecord, rec) +
+			      size, &pos);
+  _pwtrace_tick_calibrate(self, &cal);
+  rec->size = size;
+  rec->type = PWTRACE_REC_CALIBRATION;
+  rec->spare = 0;
+  rec->id = 0;
+  rec->time = cal.ticks;
+  payload[0] = cal.ns;
+  payload[1] = cal.hz;
+  memcpy(rec + 1, payload, sizeof payload);
+  _pwtrace_flight_commit(rec, pos);
+}
+
+/* Copy of the mapping, using only what a signal handler may.  Other
+ * threads go on recording meanwhile, so the copy's head is made the
+ * one after it: a record overwritten during the copy then lies a
+ * whole ring behind, where the decoder does not look. */
+static gboolean
+_pwtrace_flight_dump(PwTrace *self, const char *filename)
+{
+  const guint8 *p = (const guint8 *)self->map;
+  gsize left = self->map_size;
+  guint64 head;
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) return FALSE;
+  while (left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n <= 0) break;
+    p += n;
+    left -= n;
+  }
+  head = __atomic_load_n(&self->map->head, __ATOMIC_ACQUIRE);
+  if (pwrite(fd, &head, sizeof head, offsetof(PwTraceFlightHeader, head)) !=
+      sizeof head) {
+    left = 1;
+  }
+  close(fd);
+  return left == 0;
+}
+
+static struct sigaction pwtrace_old_actions[NSIG];
+static const int pwtrace_crash_signals[] = {SIGSEGV, SIGBUS, SIGABRT, SIGFPE,
+					    SIGILL};
+
+/* Dump every flight recorder: on a crash, then die as before */
+static void
+_pwtrace_signal(int sig)
+{
+  gboolean crash = (sig != SIGUSR2);
+  guint i;
+
+  for (i=0; i < PWTRACE_MAX_FLIGHTS; i++) {
+    PwTrace *self = pwtrace_flights[i];
+    if (self == NULL) continue;
+    if (crash) msync(self->map, self->map_size, MS_ASYNC);
+    _pwtrace_flight_dump(self, crash ? self->crash_file : self->dump_file);
+  }
+  if (crash) {
+    sigaction(sig, &pwtrace_old_actions[sig], NULL);
+    raise(sig);
+  } else if (pwtrace_old_actions[sig].sa_handler != SIG_DFL &&
+	     pwtrace_old_actions[sig].sa_handler != SIG_IGN &&
+	     ! (pwtrace_old_actions[sig].sa_flags & SA_SIGINFO)) {
+    pwtrace_old_actions[sig].sa_handler(sig);
+  }
+}
+
+static void
+_pwtrace_flight_signals(void)
+{
+  static gsize done = 0;
+  if (g_once_init_enter(&done)) {
+    struct sigaction action;
+    guint i;
+
+    memset(&action, 0, sizeof action);
+    action.sa_handler = _pwtrace_signal;
+    sigemptyset(&action.sa_mask);
+    for (i=0; i < G_N_ELEMENTS(pwtrace_crash_signals); i++) {
+      int sig = pwtrace_crash_signals[i];
+      sigaction(sig, &action, &pwtrace_old_actions[sig]);
+    }
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, &pwtrace_old_actions[SIGUSR2]);
+    g_once_init_leave(&done, 1);
+  }
+}
+
+/*-----------------------------------------------------------------------
+ *	Create the file, sized for ${name}_BUFSIZE bytes of ring
+ *	Dumps go to the same name with .dump (SIGUSR2) or .crash added
+ *-----------------------------------------------------------------------*/
+static PwTrace *
+_pwtrace_flight_open(const gchar *stub, const gchar *filename)
+{
+  const gchar *svalue = _pwtrace_getenv(stub, "BUFSIZE");
+  gsize ring_size = PWTRACE_FLIGHT_RING;
+  gsize map_size;
+  PwTraceFlightHeader *map;
+  PwTrace *self;
+  int fd;
+  guint i;
+
+  if (svalue != NULL && atoi(svalue) > 0) {
+    /* Round up to a power of 2 */
+    ring_size = PWTRACE_MIN_RING;
+    while (ring_size < atoi(svalue)) ring_size <<= 1;
+  }
+  map_size = PWTRACE_FLIGHT_HEADER + PWTRACE_FLIGHT_FORMATS + ring_size;
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, map_size) != 0) {
+    g_printerr("Cannot open %s", filename);
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    g_printerr("Cannot map %s", filename);
+    return NULL;
+  }
+
+  self = g_new0(PwTrace, 1);
+  self->head.active = TRUE;
+  self->binary = TRUE;
+  self->flight = TRUE;
+  g_mutex_init(&self->lock);
+  self->map = map;
+  self->map_size = map_size;
+  self->ring = (guint8 *)map + PWTRACE_FLIGHT_HEADER + PWTRACE_FLIGHT_FORMATS;
+  self->dump_file = g_strconcat(filename, ".dump", NULL);
+  self->crash_file = g_strconcat(filename, ".crash", NULL);
+  memcpy(map->magic, PWTRACE_FLIGHT_MAGIC, sizeof map->magic);
+  map->byte_order = PWTRACE_BYTE_ORDER;
+  map->version = PWTRACE_FILE_VERSION;
+  map->ring_size = ring_size;
+  _pwtrace_flight_calibrate(self, 0);
+  _pwtrace_flight_calibrate(self, 1);
+
+  g_mutex_lock(&pwtrace_lock);
+  if (pwtrace_formats == NULL) {
+    pwtrace_formats = g_ptr_array_new();
+    pwtrace_format_table = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+  _pwtrace_flight_formats(self);
+  pwtrace_flight_list = g_slist_prepend(pwtrace_flight_list, self);
+  for (i=0; i < PWTRACE_MAX_FLIGHTS; i++) {
+    if (pwtrace_flights[i] == NULL) {
+      pwtrace_flights[i] = self;
+      break;
+    }
+  }
+  g_mutex_unlock(&pwtrace_lock);
+  if (i == PWTRACE_MAX_FLIGHTS) {
+    g_printerr("%s: %d flight recorders already open, so no dumps on"
+	       " signals\n", filename, PWTRACE_MAX_FLIGHTS);
+  }
+  _pwtrace_flight_signals();
+  self->writer = g_thread_new("pwtrace-flight", _pwtrace_flight_thread, self);
+  return self;
+}
+
+static void
+_pwtrace_flight_close(PwTrace *self)
+{
+  guint i;
+
+  if (self->map == NULL) return;
+  g_atomic_int_set(&self->head.active, FALSE);
+  _pwtrace_quiesce(self);
+  g_mutex_lock(&pwtrace_lock);
+  pwtrace_flight_list = g_slist_remove(pwtrace_flight_list, self);
+  for (i=0; i < PWTRACE_MAX_FLIGHTS; i++) {
+    if (pwtrace_flights[i] == self) pwtrace_flights[i] = NULL;
+  }
+  g_mutex_unlock(&pwtrace_lock);
+  g_mutex_lock(&self->lock);
+  self->stop = TRUE;
+  g_cond_signal(&self->wake);
+  g_mutex_unlock(&self->lock);
+  g_thread_join(self->writer);
+  self->writer = NULL;
+  _pwtrace_flight_calibrate(self, 1);
+  munmap(self->map, self->map_size);
+  self->map = NULL;
+}
+
+/*-----------------------------------------------------------------------
+ *	Take timestamps from clock, or pwtick_now() if NULL, from now
+ *	on.  Records already made keep the old clock's calibration: in
+ *	binary mode they are written out and the file starts a new
+ *	session, and a flight recorder puts a calibration record in
+ *	the ring behind them.  A record being made by another thread
+ *	as the clock changes may be timed by either.
+ *-----------------------------------------------------------------------*/
+void
+pwtrace_set_clock(PwTrace *self, PwClock *clock)
+{
+  guint i;
+
+  if (self == NULL) return;
+  g_mutex_lock(&self->lock);
+  if (self->flight) {
+    while (! g_atomic_int_compare_and_exchange(&self->recalibrating, 0, 1)) {
+      g_thread_yield();
+    }
+    if (self->map != NULL) _pwtrace_flight_mark(self);
+    g_atomic_pointer_set(&self->clock, clock);
+    if (self->map != NULL) {
+      _pwtrace_flight_calibrate(self, 0);
+      _pwtrace_flight_calibrate(self, 1);
+    }
+    g_atomic_int_set(&self->recalibrating, 0);
+  } else if (self->binary && self->file != NULL) {
+    for (i=0; i < self->rings->len; i++) {
+      _pwtrace_drain(self, g_ptr_array_index(self->rings, i));
+    }
+    _pwtrace_calibrate(self);
+    g_atomic_pointer_set(&self->clock, clock);
+    if (! self->json) {
+      /* Formats and thread names again, for the new session */
+      _pwtrace_header(self->file);
+      self->formats_written = 0;
+      for (i=0; i < self->rings->len; i++) {
+	((PwTraceRing *)g_ptr_array_index(self->rings, i))->named = NULL;
+      }
+    }
+    _pwtrace_calibrate(self);
+  } else {
+    g_atomic_pointer_set(&self->clock, clock);
+  }
+  g_mutex_unlock(&self->lock);
+}
+
+/* Copy what a flight recorder holds now to a file (NULL for the
+ * trace file with .dump added), e.g. on spotting a glitch */
+gboolean
+pwtrace_dump(PwTrace *self, const char *filename)
+{
+  if (self == NULL || ! self->flight || self->map == NULL) return FALSE;
+  if (g_atomic_int_compare_and_exchange(&self->recalibrating, 0, 1)) {
+    _pwtrace_flight_calibrate(self, 1);
+    g_atomic_int_set(&self->recalibrating, 0);
+  }
+  return _pwtrace_flight_dump(self, (filename == NULL) ?
+			      self->dump_file : filename);
+}
@@ -0,0 +1,249 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Write trace records as the text pwtracef() writes, or as Chrome
+ *	trace-event JSON for chrome://tracing or ui.perfetto.dev.
+ *	Shared by the library's live JSON mode and pwtrace-decode.
+ *=======================================================================*/
+#include "pwtrace_file.h"
+#include <string.h>
+#include <ctype.h>
+
+void
+pwtrace_export_start(PwTraceExport *self, FILE *file, gboolean json)
+{
+  self->file = file;
+  self->json = json;
+  self->started = FALSE;
+  if (json) fprintf(file, "[\n");
+}
+
+/* Closing bracket.  Viewers accept the file without it, e.g. after
+ * a crash. */
+void
+pwtrace_export_finish(PwTraceExport *self)
+{
+  if (self->json) fprintf(self->file, "\n]\n");
+}
+
+/* Quoted JSON string of len bytes (-1 for null-terminated) */
+static void
+_json_string(FILE *out, const gchar *str, gssize len)
+{
+  const gchar *end = str + ((len < 0) ? strlen(str) : len);
+
+  putc('"', out);
+  for (; str < end; str++) {
+    guchar c = *str;
+    if (c == '"' || c == '\\') {
+      putc('\\', out);
+      putc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      putc(c, out);
+    }
+  }
+  putc('"', out);
+}
+
+/* Start of a JSON event, up to the timestamp */
+static void
+_json_event(PwTraceExport *self, const gchar *name, const gchar *ph)
+{
+  if (self->started) fprintf(self->file, ",\n");
+  self->started = TRUE;
+  fprintf(self->file, "{\"name\":");
+  _json_string(self->file, name, -1);
+  fprintf(self->file, ",\"ph\":\"%s\"", ph);
+}
+
+/* Timestamp in microseconds, and who it happened to */
+static void
+_json_where(PwTraceExport *self, guint pid, guint tid, guint64 ns)
+{
+  fprintf(self->file, ",\"ts\":%lu.%03u,\"pid\":%u,\"tid\":%u",
+	  (unsigned long)(ns / 1000), (guint)(ns % 1000), pid, tid);
+}
+
+/* Name a process (tid 0) or thread */
+void
+pwtrace_export_name(PwTraceExport *self, guint pid, guint tid,
+		    const gchar *name, gssize len)
+{
+  if (! self->json) return;
+  _json_event(self, (tid == 0) ? "process_name" : "thread_name", "M");
+  fprintf(self->file, ",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", pid, tid);
+  _json_string(self->file, name, len);
+  fprintf(self->file, "}}");
+}
+
+/*-----------------------------------------------------------------------
+ *	Event arguments as pwtracef() shows them, each preceded by a space
+ *-----------------------------------------------------------------------*/
+static void
+_pwtrace_values(GString *str, const gchar *fmt,
+		const guint8 *p, const guint8 *end)
+{
+  guint count, i;
+  guint32 val;
+  guchar c;
+
+#define GET(dst, len) \
+  do { if (p + (len) > end) goto short_record; \
+       memcpy((dst), p, (len)); p += (len); } while (0)
+  while (1) {
+    c = *fmt++;
+    if (c == '\0') break;
+    /* Optional repeat count */
+    if (isdigit(c)) {
+      count = 0;
+      do {
+	count = 10 * count + c-'0';
+	c = *fmt++;
+	if (c == '\0') break;
+      } while (isdigit(c));
+    } else if (c == '*') {
+      GET(&count, 4);
+      c = *fmt++;
+      if (c == '\0') break;
+    } else {
+      count = 1;
+    }
+    if (c == 'i') {
+      for (i=0; i < count; i++) {
+	GET(&val, 4);
+	g_string_append_printf(str, " %d", (gint32)val);
+      }
+    } else if (c == 'u') {
+      for (i=0; i < count; i++) {
+	GET(&val, 4);
+	g_string_append_printf(str, " %u", val);
+      }
+    } else if (c == 'x') {
+      for (i=0; i < count; i++) {
+	GET(&val, 4);
+	g_string_append_printf(str, " %x", val);
+      }
+    } else if (c == 's') {
+      for (i=0; i < count; i++) {
+	guint16 len;
+	GET(&len, 2);
+	if (len == PWTRACE_NULL_STRING) {
+	  g_string_append(str, " (null)");
+	} else {
+	  if (p + len > end) goto short_record;
+	  g_string_append_c(str, ' ');
+	  g_string_append_len(str, (const gchar *)p, len);
+	  p += len;
+	}
+      }
+    } else if (c == 'b') {
+      for (i=0; i < count; i++) {
+	guint8 b;
+	GET(&b, 1);
+	g_string_append_printf(str, " %02x", b);
+      }
+    } else {
+      g_string_append(str, "?");
+      break;
+    }
+  }
+#undef GET
+  return;
+
+ short_record:
+  g_string_append(str, " ?");
+}
+
+/*-----------------------------------------------------------------------
+ *	One record, its time already in nanoseconds.  string is the
+ *	format of an event, or the name of a span or counter.  Text
+ *	shows spans as B or E and counters as C, then the name.
+ *-----------------------------------------------------------------------*/
+void
+pwtrace_export_record(PwTraceExport *self, guint pid, guint tid, guint64 ns,
+		      const PwTraceRecord *rec, const gchar *string)
+{
+  const guint8 *args = (const guint8 *)(rec + 1);
+  const guint8 *end = (const guint8 *)rec + rec->size;
+  gint64 value = 0;
+
+  if (rec->type == PWTRACE_REC_COUNTER) {
+    if (end - args < 8) return;
+    memcpy(&value, args, 8);
+  }
+  if (! self->json) {
+    const gchar *marks = "BEC";
+    if (rec->type == PWTRACE_REC_EVENT) {
+      GString *values = g_string_new(NULL);
+      _pwtrace_values(values, string, args, end);
+      fprintf(self->file, "%lu.%06ld%s\n",
+	      (unsigned long)(ns / 1000000000),
+	      (long)(ns % 1000000000) / 1000, values->str);
+      g_string_free(values, TRUE);
+    } else if (rec->type >= PWTRACE_REC_BEGIN &&
+	       rec->type <= PWTRACE_REC_COUNTER) {
+      fprintf(self->file, "%lu.%06ld %c %s",
+	      (unsigned long)(ns / 1000000000),
+	      (long)(ns % 1000000000) / 1000,
+	      marks[rec->type - PWTRACE_REC_BEGIN], string);
+      if (rec->type == PWTRACE_REC_COUNTER) {
+	fprintf(self->file, " %" G_GINT64_FORMAT, value);
+      }
+      fprintf(self->file, "\n");
+    }
+    return;
+  }
+
+  switch (rec->type) {
+  case PWTRACE_REC_EVENT:
+    {
+      GString *values = g_string_new(NULL);
+      _pwtrace_values(values, string, args, end);
+      _json_event(self, string, "i");
+      _json_where(self, pid, tid, ns);
+      fprintf(self->file, ",\"s\":\"t\",\"args\":{\"values\":");
+      _json_string(self->file, values->str + (values->len > 0), -1);
+      fprintf(self->file, "}}");
+      g_string_free(values, TRUE);
+    }
+    break;
+  case PWTRACE_REC_BEGIN:
+  case PWTRACE_REC_END:
+    _json_event(self, string, (rec->type == PWTRACE_REC_BEGIN) ? "B" : "E");
+    _json_where(self, pid, tid, ns);
+    fprintf(self->file, "}");
+    break;
+  case PWTRACE_REC_COUNTER:
+    _json_event(self, string, "C");
+    _json_where(self, pid, tid, ns);
+    fprintf(self->file, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}}",
+	    value);
+    break;
+  case PWTRACE_REC_DROP:
+    _json_event(self, "dropped", "i");
+    _json_where(self, pid, tid, ns);
+    fprintf(self->file, ",\"s\":\"t\",\"args\":{\"count\":%u}}", rec->id);
+    break;
+  case PWTRACE_REC_THREAD_NAME:
+    pwtrace_export_name(self, pid, rec->id, (const gchar *)args,
+			strnlen((const char *)args, end - args));
+    break;
+  }
+}
@@ -0,0 +1,125 @@
+/*=======================================================================
+ * pwlibs - Libraries used by the PiWall video wall
+ * Copyright (C) 2013-2015  Colin Hogben <colin@piwall.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *-----------------------------------------------------------------------
+ *	Layout of binary trace files (internal to pwlibs)
+ *
+ *	A file is a PwTraceFileHeader followed by records, each starting
+ *	with a PwTraceRecord and padded to a multiple of 8 bytes.  Values
+ *	are in the byte order of the machine which wrote the file.
+ *	Times are in ticks, converted to nanoseconds by interpolating
+ *	between the calibration records written at start, end and
+ *	every second or so.
+ *
+ *	Event arguments follow the pwtracef() format, packed unaligned:
+ *	i, u, x		4 bytes each
+ *	s		2-byte length (PWTRACE_NULL_STRING for NULL), then text
+ *	b		the bytes themselves
+ *	*		4-byte count, before the item it applies to
+ *
+ *	Span and counter names share the ids of formats.
+ *=======================================================================*/
+#ifndef INC_pwtrace_file_h
+#define INC_pwtrace_file_h
+
+#include <glib.h>
+#include <stdio.h>
+
+#define PWTRACE_MAGIC		"PWTRACE\n"
+#define PWTRACE_BYTE_ORDER	0x01020304
+#define PWTRACE_FILE_VERSION	2
+
+typedef struct {
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 version;
+} PwTraceFileHeader;
+
+typedef enum {
+  PWTRACE_REC_PAD,		/* Skip to end of ring buffer (never in file) */
+  PWTRACE_REC_FORMAT,		/* id = format id, format string follows */
+  PWTRACE_REC_THREAD,		/* id = thread id of records which follow */
+  PWTRACE_REC_EVENT,		/* id = format id, arguments follow */
+  PWTRACE_REC_DROP,		/* id = count of events lost */
+  PWTRACE_REC_CALIBRATION,	/* CLOCK_MONOTONIC ns and ticks/s follow */
+  PWTRACE_REC_BEGIN,		/* id = name id of span starting */
+  PWTRACE_REC_END,		/* id = name id of span ending */
+  PWTRACE_REC_COUNTER,		/* id = name id, gint64 value follows */
+  PWTRACE_REC_THREAD_NAME,	/* id = thread id, null-terminated name follows */
+} PwTraceRecordType;
+
+typedef struct {
+  guint16 size;			/* Including this header */
+  guint8 type;			/* PwTraceRecordType */
+  guint8 spare;
+  guint32 id;
+  guint64 time;			/* pwtick_now() */
+} PwTraceRecord;
+
+#define PWTRACE_ALIGN(n)	(((n) + 7) & ~(gsize)7)
+#define PWTRACE_RECORD_MAX	0xfff8
+#define PWTRACE_NULL_STRING	0xffff
+
+/*-----------------------------------------------------------------------
+ *	A flight recorder file (or dump of one) is a PwTraceFlightHeader,
+ *	padded to PWTRACE_FLIGHT_HEADER, then PWTRACE_FLIGHT_FORMATS
+ *	bytes of format records, then the ring.  Each record in the ring
+ *	is preceded by its position, set when complete, so that the
+ *	records not yet overwritten can be found.  No records wrap.
+ *-----------------------------------------------------------------------*/
+#define PWTRACE_FLIGHT_MAGIC	"PWFLIGHT"
+#define PWTRACE_FLIGHT_HEADER	4096
+#define PWTRACE_FLIGHT_FORMATS	65536
+
+typedef struct {
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 version;
+  guint64 ring_size;		/* A power of 2 */
+  guint64 head;			/* Bytes of ring ever claimed */
+  guint32 formats;		/* Highest format id defined */
+  guint32 formats_used;		/* Bytes of format records */
+  guint32 dropped;		/* Records too big for the ring */
+  guint32 cal_seq;		/* Odd while cal is changing */
+  guint64 cal[2][3];		/* Ticks, ns and hz at start and latest */
+} PwTraceFlightHeader;
+
+typedef struct {
+  guint64 pos;			/* Ring bytes claimed before this */
+  guint32 tid;
+  guint32 spare;
+  PwTraceRecord rec;		/* Size not including pos and tid */
+} PwTraceFlightRecord;
+
+/* Records written out as text or Chrome trace-event JSON */
+typedef struct {
+  FILE *file;
+  gboolean json;
+  gboolean started;		/* Written a JSON event, so need a comma */
+} PwTraceExport;
+
+extern void pwtrace_export_start(PwTraceExport *, FILE *, gboolean /*json*/);
+extern void pwtrace_export_name(PwTraceExport *, guint /*pid*/,
+				guint /*tid, 0 for process*/,
+				const gchar */*name*/, gssize /*len*/);
+extern void pwtrace_export_record(PwTraceExport *, guint /*pid*/,
+				  guint /*tid*/, guint64 /*ns*/,
+				  const PwTraceRecord *,
+				  const gchar */*format or name*/);
+extern void pwtrace_export_finish(PwTraceExport *);
+
+#endif /* INC_pwtrace_file_h */
@@ -107,4 +107,22 @@ typedef struct {
   guint8 r, g, b, a;
 } PwRGBA;
 
+/* Pixel layouts, e.g. for pw_IPaint rows */
+typedef enum {
+  PW_PIXEL_RGBA8888,		/* Bytes R,G,B,A */
+  PW_PIXEL_BGRA8888,		/* Bytes B,G,R,A */
+  PW_PIXEL_RGB888,		/* Bytes R,G,B */
+  PW_PIXEL_RGB565,		/* 16-bit native word, red in top bits */
+  PW_PIXEL_YUV420,		/* Planes Y,U,V; chroma halved both ways */
+  PW_PIXEL_NV12			/* Planes Y,UV; chroma halved both ways */
+} PwPixelFormat;
+
+/* Colour matrix and range for YUV conversion */
+typedef enum {
+  PW_YUV_BT601,			/* Limited (16-235) range */
+  PW_YUV_BT601_FULL,
+  PW_YUV_BT709,			/* Limited (16-235) range */
+  PW_YUV_BT709_FULL
+} PwYuvMatrix;
+
 #endif /* INC_pwtypes_h */
@@ -23,7 +23,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <time.h>
 
 #define PWUTIL_ERROR pwutil_error_quark()
 
@@ -33,19 +32,154 @@ pwutil_error_quark(void)
   return g_quark_from_static_string("pwutil-error");
 }
 
-static GRegex *pwintrect_rx = NULL;
-static GRegex *pwrectp_rx = NULL;
+#define RECT_SIZE 0x1		/* Size needed | set */
+#define RECT_POS  0x2		/* Position needed | set */
+#define RECT_ABS  0x4		/* Absolute (no %) needed | set */
 
-static void
-_compile_rx(void)
+/*-----------------------------------------------------------------------
+ *	Hand-coded scanners for rectangle geometry.  These accept the
+ *	same syntax as the regular expressions previously used, i.e.
+ *	  int:   ^(\d+)x(\d+)([-+]\d+)([-+]\d+)$
+ *	  real:  ^((FP)x(FP))?(([-+]FP)([-+]FP))?(%)?$
+ *	where FP is \d+(\.\d+)?, but work on a counted string so that
+ *	lines in a buffer can be parsed in place.
+ *-----------------------------------------------------------------------*/
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/* Exact powers of ten (all representable in a double) */
+static const gdouble pow10_exact[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Scan unsigned decimal \d+ */
+static gboolean
+_scan_uint(const gchar **pp, const gchar *end, guint *value)
+{
+  const gchar *p = *pp;
+  guint v = 0;
+  if (p == end || ! IS_DIGIT(*p)) return FALSE;
+  do {
+    v = 10 * v + (*p++ - '0');
+  } while (p < end && IS_DIGIT(*p));
+  *value = v;
+  *pp = p;
+  return TRUE;
+}
+
+/* Scan signed decimal [-+]\d+ */
+static gboolean
+_scan_sint(const gchar **pp, const gchar *end, gint *value)
+{
+  const gchar *p = *pp;
+  gboolean neg;
+  guint v;
+  if (p == end || (*p != '+' && *p != '-')) return FALSE;
+  neg = (*p++ == '-');
+  if (! _scan_uint(&p, end, &v)) return FALSE;
+  *value = neg ? -(gint)v : (gint)v;
+  *pp = p;
+  return TRUE;
+}
+
+/* Scan real number \d+(\.\d+)? */
+static gboolean
+_scan_real(const gchar **pp, const gchar *end, gdouble *value)
+{
+  const gchar *start = *pp;
+  const gchar *p = start;
+  guint64 mant = 0;
+  guint ndigits = 0, nfrac = 0;
+
+  if (p == end || ! IS_DIGIT(*p)) return FALSE;
+  do {
+    mant = 10 * mant + (*p++ - '0');
+    ndigits++;
+  } while (p < end && IS_DIGIT(*p));
+  if (p + 1 < end && p[0] == '.' && IS_DIGIT(p[1])) {
+    p++;
+    do {
+      mant = 10 * mant + (*p++ - '0');
+      ndigits++;
+      nfrac++;
+    } while (p < end && IS_DIGIT(*p));
+  }
+
+  if (ndigits <= 15) {
+    /* Both operands exact, so the quotient is correctly rounded */
+    *value = (gdouble)mant / pow10_exact[nfrac];
+  } else {
+    /* Too long for the fast path - let strtod handle it */
+    gchar *copy = g_strndup(start, p - start);
+    *value = g_ascii_strtod(copy, NULL);
+    g_free(copy);
+  }
+  *pp = p;
+  return TRUE;
+}
+
+/* Scan signed real number [-+]FP */
+static gboolean
+_scan_sreal(const gchar **pp, const gchar *end, gdouble *value)
 {
-#define FP_RX "\\d+(?:\\.\\d+)?"
-  pwintrect_rx = g_regex_new("^(\\d+)x(\\d+)([-+]\\d+)([-+]\\d+)$",
-			  0, 0, NULL);
-  pwrectp_rx = g_regex_new("^(("FP_RX")x("FP_RX"))?"
-			   "(([-+]"FP_RX")([-+]"FP_RX"))?(%)?$",
-			   0, 0, NULL);
-#undef FP_RX
+  const gchar *p = *pp;
+  gboolean neg;
+  if (p == end || (*p != '+' && *p != '-')) return FALSE;
+  neg = (*p++ == '-');
+  if (! _scan_real(&p, end, value)) return FALSE;
+  if (neg) *value = -*value;
+  *pp = p;
+  return TRUE;
+}
+
+static gboolean
+_scan_intrect(const gchar *str, const gchar *end, PwIntRect *rect)
+{
+  const gchar *p = str;
+  guint width, height;
+  gint x, y;
+
+  if (! _scan_uint(&p, end, &width)) return FALSE;
+  if (p == end || *p++ != 'x') return FALSE;
+  if (! _scan_uint(&p, end, &height)) return FALSE;
+  if (! _scan_sint(&p, end, &x)) return FALSE;
+  if (! _scan_sint(&p, end, &y)) return FALSE;
+  if (p != end) return FALSE;
+
+  rect->x0 = x;
+  rect->y0 = y;
+  rect->x1 = x + (gint)width;
+  rect->y1 = y + (gint)height;
+  return TRUE;
+}
+
+/* Set bits in *avail (RECT_*) for parts found */
+static gboolean
+_scan_rectp(const gchar *str, const gchar *end, PwRect *rect, guint *avail)
+{
+  const gchar *p = str;
+  gdouble width = 0, height = 0, x = 0, y = 0;
+
+  *avail = RECT_ABS;
+  if (p < end && IS_DIGIT(*p)) {
+    if (! _scan_real(&p, end, &width)) return FALSE;
+    if (p == end || *p++ != 'x') return FALSE;
+    if (! _scan_real(&p, end, &height)) return FALSE;
+    *avail |= RECT_SIZE;
+  }
+  if (p < end && (*p == '+' || *p == '-')) {
+    if (! _scan_sreal(&p, end, &x)) return FALSE;
+    if (! _scan_sreal(&p, end, &y)) return FALSE;
+    *avail |= RECT_POS;
+  }
+  if (p < end && *p == '%') {
+    p++;
+    *avail &= ~RECT_ABS;
+  }
+  if (p != end) return FALSE;
+
+  PWRECT_SET(*rect, x, y, x + width, y + height);
+  return TRUE;
 }
 
 /* Parse e.g. "example.com:8765" as host and port */
@@ -74,105 +208,57 @@ pwhostport_from_string(const gchar *hostport,
 }
 
 /* Convert e.g. "400x300+100+0" to PwRect or PwIntRect */
-gboolean
-pwintrect_from_string(PwIntRect *rect, const gchar *str, GError **error)
+static gboolean
+_pwintrect_parse(const gchar *str, const gchar *end, PwIntRect *rect,
+		 GError **error)
 {
-  GMatchInfo *match = NULL;
-
-  /* Compile regex on demand */
-  if (pwintrect_rx == NULL) {
-    _compile_rx();
-  }
-
-  if (! g_regex_match(pwintrect_rx, str, 0, &match)) {
-    g_set_error(error, PWUTIL_ERROR, 0, "Invalid rectangle \"%s\"", str);
+  if (! _scan_intrect(str, end, rect)) {
+    g_set_error(error, PWUTIL_ERROR, 0, "Invalid rectangle \"%.*s\"",
+		(int)(end - str), str);
     return FALSE;
   }
-
-  rect->x0 = atoi(g_match_info_fetch(match, 3));
-  rect->y0 = atoi(g_match_info_fetch(match, 4));
-  rect->x1 = rect->x0 + atoi(g_match_info_fetch(match, 1));
-  rect->y1 = rect->y0 + atoi(g_match_info_fetch(match, 2));
-
-  g_match_info_free(match);
   return TRUE;
 }
 
-#define RECT_SIZE 0x1		/* Size needed | set */
-#define RECT_POS  0x2		/* Position needed | set */
-#define RECT_ABS  0x4		/* Absolute (no %) needed | set */
+gboolean
+pwintrect_from_string(PwIntRect *rect, const gchar *str, GError **error)
+{
+  return _pwintrect_parse(str, str + strlen(str), rect, error);
+}
 
 /*-----------------------------------------------------------------------
  *	Parse rectangle in the most lax way, then check constraints.
  *-----------------------------------------------------------------------*/
 static gboolean
-_pwrectp_parse(const gchar *str, guint need,
+_pwrectp_parse(const gchar *str, const gchar *end, guint need,
 	       PwRect *rect, guint *avail, GError **error)
 {
-  GMatchInfo *match;
-  gboolean ok = FALSE;
-  const gchar *part;
-#define HAS_MATCH(n) ((part = g_match_info_fetch(match, n)) && part[0] != '\0')
-
-  /* Compile regex on demand */
-  if (pwrectp_rx == NULL) {
-    _compile_rx();
-  }
-
-  if (! g_regex_match(pwrectp_rx, str, 0, &match)) {
-    g_set_error(error, PWUTIL_ERROR, 0, "Invalid rectangle \"%s\"", str);
+  if (! _scan_rectp(str, end, rect, avail)) {
+    g_set_error(error, PWUTIL_ERROR, 0, "Invalid rectangle \"%.*s\"",
+		(int)(end - str), str);
     return FALSE;
   }
-
-  *avail = 0;
-  if (HAS_MATCH(4)) {
-    rect->x0 = g_ascii_strtod(g_match_info_fetch(match, 5), NULL);
-    rect->y0 = g_ascii_strtod(g_match_info_fetch(match, 6), NULL);
-    *avail |= RECT_POS;
-  } else {
-    if (need & RECT_POS) {
-      g_set_error(error, PWUTIL_ERROR, 0, "Position missing");
-      goto fail;
-    }
-    rect->x0 = 0;
-    rect->y0 = 0;
+  if ((need & RECT_POS) && ! (*avail & RECT_POS)) {
+    g_set_error(error, PWUTIL_ERROR, 0, "Position missing");
+    return FALSE;
   }
-  
-  if (HAS_MATCH(1)) {
-    rect->x1 = rect->x0 + g_ascii_strtod(g_match_info_fetch(match, 2), NULL);
-    rect->y1 = rect->y0 + g_ascii_strtod(g_match_info_fetch(match, 3), NULL);
-    *avail |= RECT_SIZE;
-  } else {
-    if (need & RECT_SIZE) {
-      g_set_error(error, PWUTIL_ERROR, 0, "Size of rectangle missing");
-      goto fail;
-    }
-    rect->x1 = rect->x0;
-    rect->y1 = rect->y0;
+  if ((need & RECT_SIZE) && ! (*avail & RECT_SIZE)) {
+    g_set_error(error, PWUTIL_ERROR, 0, "Size of rectangle missing");
+    return FALSE;
   }
-
-  if (! HAS_MATCH(7)) {
-    /* Absence of "%" means absolute coordinates */
-    *avail |= RECT_ABS;
-  } else {
-    if (need & RECT_ABS) {
-      g_set_error(error, PWUTIL_ERROR, 0, "Percentage not allowed");
-      goto fail;
-    }
+  if ((need & RECT_ABS) && ! (*avail & RECT_ABS)) {
+    g_set_error(error, PWUTIL_ERROR, 0, "Percentage not allowed");
+    return FALSE;
   }
-  ok = TRUE;
-  
- fail:
-  g_match_info_free(match);
-  return ok;
-#undef HAS_MATCH
+  return TRUE;
 }
 	       
 gboolean
 pwrect_from_string(PwRect *rect, const gchar *str, GError **error)
 {
   guint avail;
-  if (! _pwrectp_parse(str, RECT_SIZE | RECT_POS | RECT_ABS,
+  if (! _pwrectp_parse(str, str + strlen(str),
+		       RECT_SIZE | RECT_POS | RECT_ABS,
 		       rect, &avail, error)) {
     return FALSE;
   }
@@ -184,7 +270,7 @@ pwrectp_from_string(PwRect *rect, gboolean *percent, const gchar *str,
 		    GError **error)
 {
   guint avail;
-  if (! _pwrectp_parse(str, RECT_SIZE,
+  if (! _pwrectp_parse(str, str + strlen(str), RECT_SIZE,
 		       rect, &avail, error)) {
     return FALSE;
   }
@@ -198,7 +284,8 @@ pwpos_from_string(gdouble *x, gdouble *y, gboolean *percent, const gchar *str,
 {
   PwRect rect;
   guint avail;
-  if (! _pwrectp_parse(str, RECT_POS, &rect, &avail, error)) {
+  if (! _pwrectp_parse(str, str + strlen(str), RECT_POS,
+		       &rect, &avail, error)) {
     return FALSE;
   }
   if (avail & RECT_SIZE) {
@@ -211,6 +298,242 @@ pwpos_from_string(gdouble *x, gdouble *y, gboolean *percent, const gchar *str,
   return TRUE;
 }
 
+/*-----------------------------------------------------------------------
+ *	Bulk conversion of many rectangles.  Errors are reported per
+ *	element: errors[i] (if errors is non-NULL) is set for each
+ *	element which fails, and the number of failures returned.
+ *-----------------------------------------------------------------------*/
+static gboolean
+_pwrect_parse_one(const gchar *str, const gchar *end,
+		  PwRect *rect, gboolean *percent, GError **error)
+{
+  guint avail;
+  if (percent == NULL) {
+    return _pwrectp_parse(str, end, RECT_SIZE | RECT_POS | RECT_ABS,
+			  rect, &avail, error);
+  }
+  if (! _pwrectp_parse(str, end, RECT_SIZE, rect, &avail, error)) {
+    return FALSE;
+  }
+  *percent = ! (avail & RECT_ABS);
+  return TRUE;
+}
+
+gsize
+pwrect_from_strings(PwRect *rects, gboolean *percent,
+		    gsize n, const gchar *const strs[], GError **errors)
+{
+  gsize i, nfail = 0;
+  for (i=0; i < n; i++) {
+    if (! _pwrect_parse_one(strs[i], strs[i] + strlen(strs[i]), &rects[i],
+			    percent ? &percent[i] : NULL,
+			    errors ? &errors[i] : NULL)) {
+      nfail++;
+    }
+  }
+  return nfail;
+}
+
+gsize
+pwintrect_from_strings(PwIntRect *rects,
+		       gsize n, const gchar *const strs[], GError **errors)
+{
+  gsize i, nfail = 0;
+  for (i=0; i < n; i++) {
+    if (! _pwintrect_parse(strs[i], strs[i] + strlen(strs[i]), &rects[i],
+			   errors ? &errors[i] : NULL)) {
+      nfail++;
+    }
+  }
+  return nfail;
+}
+
+/* Find end of next line in buffer, ignoring any trailing CR */
+static const gchar *
+_line_end(const gchar *line, const gchar *bufend, const gchar **next)
+{
+  const gchar *nl = memchr(line, '\n', bufend - line);
+  if (nl == NULL) {
+    *next = bufend;
+    nl = bufend;
+  } else {
+    *next = nl + 1;
+  }
+  if (nl > line && nl[-1] == '\r') nl--;
+  return nl;
+}
+
+gsize
+pwrect_from_lines(PwRect *rects, gboolean *percent, gsize max,
+		  const gchar *buf, gssize len, gsize *nlines,
+		  GError **errors)
+{
+  const gchar *bufend = buf + (len < 0 ? strlen(buf) : (gsize)len);
+  const gchar *line, *next;
+  gsize i, nfail = 0;
+
+  for (i=0, line=buf; line < bufend; i++, line=next) {
+    const gchar *end = _line_end(line, bufend, &next);
+    if (i < max &&
+	! _pwrect_parse_one(line, end, &rects[i],
+			    percent ? &percent[i] : NULL,
+			    errors ? &errors[i] : NULL)) {
+      nfail++;
+    }
+  }
+  if (nlines) *nlines = i;
+  return nfail;
+}
+
+gsize
+pwintrect_from_lines(PwIntRect *rects, gsize max,
+		     const gchar *buf, gssize len, gsize *nlines,
+		     GError **errors)
+{
+  const gchar *bufend = buf + (len < 0 ? strlen(buf) : (gsize)len);
+  const gchar *line, *next;
+  gsize i, nfail = 0;
+
+  for (i=0, line=buf; line < bufend; i++, line=next) {
+    const gchar *end = _line_end(line, bufend, &next);
+    if (i < max &&
+	! _pwintrect_parse(line, end, &rects[i],
+			   errors ? &errors[i] : NULL)) {
+      nfail++;
+    }
+  }
+  if (nlines) *nlines = i;
+  return nfail;
+}
+
+/*-----------------------------------------------------------------------
+ *	Format rectangles without printf.  Output is identical to
+ *	PWRECT_FORMAT / PWINTRECT_FORMAT, but always in the C locale.
+ *	Like snprintf, the return value is the length which would have
+ *	been written given enough space.
+ *-----------------------------------------------------------------------*/
+
+/* Write decimal integer, return pointer past end */
+static gchar *
+_put_int(gchar *p, gint64 value, gboolean plus)
+{
+  gchar digits[24];
+  gchar *d = digits + sizeof(digits);
+  guint64 u = value < 0 ? -(guint64)value : (guint64)value;
+  do {
+    *--d = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (value < 0) {
+    *p++ = '-';
+  } else if (plus) {
+    *p++ = '+';
+  }
+  memcpy(p, d, digits + sizeof(digits) - d);
+  return p + (digits + sizeof(digits) - d);
+}
+
+/* Write real number as "%g" (or "%+g"), return pointer past end */
+static gchar *
+_put_real(gchar *p, gdouble value, gboolean plus)
+{
+  /* Integers of up to six digits are the overwhelmingly common case,
+     and %g prints them exactly as an integer. */
+  if (value > -1e6 && value < 1e6 && value == (gdouble)(gint)value &&
+      ! (value == 0 && 1/value < 0)) {
+    return _put_int(p, (gint)value, plus);
+  } else {
+    gchar tmp[G_ASCII_DTOSTR_BUF_SIZE];
+    gsize len;
+    g_ascii_formatd(tmp, sizeof(tmp), "%g", value);
+    if (plus && tmp[0] != '-') {
+      *p++ = '+';
+    }
+    len = strlen(tmp);
+    memcpy(p, tmp, len);
+    return p + len;
+  }
+}
+
+/* Copy formatted item into caller's buffer at offset, as far as fits */
+static void
+_put_output(gchar *buf, gsize size, gsize offset,
+	    const gchar *item, gsize len)
+{
+  if (offset < size) {
+    memcpy(buf + offset, item, MIN(len, size - offset));
+  }
+}
+
+static gsize
+_format_rect(gchar *out, const PwRect *rect, gboolean percent)
+{
+  gchar *p = out;
+  p = _put_real(p, PWRECT_WIDTH(*rect), FALSE);
+  *p++ = 'x';
+  p = _put_real(p, PWRECT_HEIGHT(*rect), FALSE);
+  p = _put_real(p, rect->x0, TRUE);
+  p = _put_real(p, rect->y0, TRUE);
+  if (percent) *p++ = '%';
+  return p - out;
+}
+
+static gsize
+_format_intrect(gchar *out, const PwIntRect *rect)
+{
+  gchar *p = out;
+  p = _put_int(p, PWRECT_WIDTH(*rect), FALSE);
+  *p++ = 'x';
+  p = _put_int(p, PWRECT_HEIGHT(*rect), FALSE);
+  p = _put_int(p, rect->x0, TRUE);
+  p = _put_int(p, rect->y0, TRUE);
+  return p - out;
+}
+
+gsize
+pwrect_to_string(gchar *buf, gsize size, const PwRect *rect, gboolean percent)
+{
+  return pwrect_to_lines(buf, size, rect, percent ? &percent : NULL, 1);
+}
+
+gsize
+pwintrect_to_string(gchar *buf, gsize size, const PwIntRect *rect)
+{
+  return pwintrect_to_lines(buf, size, rect, 1);
+}
+
+/* Format n rectangles, separated by newlines */
+gsize
+pwrect_to_lines(gchar *buf, gsize size, const PwRect *rects,
+		const gboolean *percent, gsize n)
+{
+  gchar item[PWRECT_STRING_MAX + 1];
+  gsize i, len, total = 0;
+  for (i=0; i < n; i++) {
+    len = _format_rect(item, &rects[i], percent ? percent[i] : FALSE);
+    if (i + 1 < n) item[len++] = '\n';
+    _put_output(buf, size, total, item, len);
+    total += len;
+  }
+  if (size > 0) buf[MIN(total, size - 1)] = '\0';
+  return total;
+}
+
+gsize
+pwintrect_to_lines(gchar *buf, gsize size, const PwIntRect *rects, gsize n)
+{
+  gchar item[PWRECT_STRING_MAX + 1];
+  gsize i, len, total = 0;
+  for (i=0; i < n; i++) {
+    len = _format_intrect(item, &rects[i]);
+    if (i + 1 < n) item[len++] = '\n';
+    _put_output(buf, size, total, item, len);
+    total += len;
+  }
+  if (size > 0) buf[MIN(total, size - 1)] = '\0';
+  return total;
+}
+
 /* Convert e.g. "up" to PwOrient */
 gboolean
 pworient_from_string(PwOrient *orient, const gchar *str, GError **error)
@@ -349,162 +672,3 @@ pwrgba_from_string(PwRGBA *rgba, const gchar *str, GError **error)
     return FALSE;
   }
 }
-
-/*-----------------------------------------------------------------------
- *	Trace object
- *-----------------------------------------------------------------------*/
-struct _PwTrace {
-  FILE *file;
-  guint left;			/* How many more records to write */
-};
-
-/* Limit tracing to this number of calls */
-#define PWTRACE_DEFAULT_COUNT	1000
-
-/*-----------------------------------------------------------------------
- *	Open trace object
- *	Filename from ${name}_TRACEFILE environment variable
- *	Number of records from ${name}_COUNT environment variable
- *-----------------------------------------------------------------------*/
-PwTrace *
-pwtrace_open(const char *name)
-{
-  FILE *file;
-  gchar *envvar;
-  const gchar *filename, *svalue;
-  PwTrace *self = NULL;
-
-  if (name == NULL) {
-    envvar = g_strdup("TRACEFILE");
-  } else {
-    envvar = g_strdup_printf("%s_TRACEFILE", name);
-  }
-  filename = g_getenv(envvar);
-  if (filename != NULL) {
-    file = fopen(filename, "a");
-    if (file == NULL) {
-      g_printerr("Cannot open %s", filename);
-    } else {
-      guint stublen = strlen(envvar) - 9;
-      guint count;
-      gchar *buffer = NULL;
-
-      /* Replace TRACEFILE with BUFSIZE */
-      strcpy(envvar + stublen, "BUFSIZE");
-      svalue = g_getenv(envvar);
-      if (svalue != NULL) {
-	guint bufsize = atoi(svalue);
-	buffer = g_malloc(bufsize);
-	setvbuf(file, buffer, _IOFBF, bufsize);
-      }
-	
-      /* Replace TRACEFILE with COUNT */
-      strcpy(envvar + stublen, "COUNT");
-      svalue = g_getenv(envvar);
-      if (svalue == NULL) {
-	count = PWTRACE_DEFAULT_COUNT;
-      } else {
-	count = atoi(svalue);
-      }
-
-      self = g_new(PwTrace, 1);
-      self->file = file;
-      self->left = count;
-    }
-  }
-  g_free(envvar);
-  return self;
-}
-
-void
-pwtrace_close(PwTrace *self)
-{
-  if (self == NULL || self->file == NULL) return;
-  fclose(self->file);
-  self->file = NULL;
-}
-
-/*-----------------------------------------------------------------------
- *	Formatted trace output
- *	No embedded text in format, just item specifiers, each optionally
- *	preceded by a count:
- *	i	int
- *	u	unsigned int
- *	x	unsigned int as hex
- *	s	char*, null-terminated string
- *	b	unsigned char *, (count) bytes, each as 2-digit hex
- *-----------------------------------------------------------------------*/
-void
-pwtracef(PwTrace *self, const char *fmt, ...)
-{
-  va_list ap;
-  struct timespec now;
-  guint count, i;
-  guchar c;
-
-  if (self == NULL || self->file == NULL) return;
-
-  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-  fprintf(self->file, "%lu.%06ld",
-	  now.tv_sec, now.tv_nsec / 1000);
-
-  va_start(ap, fmt);
-  while (1) {
-    c = *fmt++;
-    if (c == '\0') break;
-    /* Optional repeat count */
-    if (isdigit(c)) {
-      count = 0;
-      do {
-	count = 10 * count + c-'0';
-	c = *fmt++;
-	if (c == '\0') break;
-      } while (isdigit(c));
-    } else if (c == '*') {
-      count = va_arg(ap, unsigned int);
-      c = *fmt++;
-      if (c == '\0') break;
-    } else {
-      count = 1;
-    }
-    if (c == 'i') {
-      for (i=0; i < count; i++) {
-	int ival = va_arg(ap, int);
-	fprintf(self->file, " %d", ival);
-      }
-    } else if (c == 'u') {
-      for (i=0; i < count; i++) {
-	unsigned int ival = va_arg(ap, unsigned int);
-	fprintf(self->file, " %u", ival);
-      }
-    } else if (c == 'x') {
-      for (i=0; i < count; i++) {
-	unsigned int ival = va_arg(ap, unsigned int);
-	fprintf(self->file, " %x", ival);
-      }
-    } else if (c == 's') {
-      for (i=0; i < count; i++) {
-	const char *str = va_arg(ap, const char *);
-	fprintf(self->file, " %s", str);
-      }
-    } else if (c == 'b') {
-      const guchar *bytes = va_arg(ap, const guchar *);
-      for (i=0; i < count; i++) {
-	guchar b = *bytes++;
-	fprintf(self->file, " %02x", b);
-      }
-    } else {
-      fprintf(self->file, "?");
-      break;
-    }
-  }
-  va_end(ap);
-  fprintf(self->file, "\n");
-
-  /* Close if requested count reached */
-  if (-- self->left == 0) {
-    fclose(self->file);
-    self->file = NULL;
-  }
-}
-
@@ -23,7 +23,10 @@
 
 #include <pwtypes.h>
 #include <pw_IPaint.h>
+#include <pw_IRead.h>
+#include <pw_IWrite.h>
 #include <time.h>		/* struct timespec */
+#include <sys/uio.h>		/* struct iovec */
 
 /* Parse e.g. "example.com:8765" as host and port */
 extern gboolean pwhostport_from_string(const gchar */*hostport*/,
@@ -42,6 +45,38 @@ extern gboolean pwrectp_from_string(PwRect *, gboolean */*percent*/,
 extern gboolean pwpos_from_string(gdouble *, gdouble *, gboolean */*percent*/,
 				  const gchar *, GError **error);
 
+/* Convert many rectangles at once, as pwrect_from_string or (if
+ * percent is non-NULL) pwrectp_from_string.  Returns the number of
+ * failures, with errors[i] set for each failing element if errors
+ * is non-NULL. */
+extern gsize pwrect_from_strings(PwRect *, gboolean */*percent*/,
+				 gsize /*n*/, const gchar *const [],
+				 GError **/*errors*/);
+extern gsize pwintrect_from_strings(PwIntRect *,
+				    gsize /*n*/, const gchar *const [],
+				    GError **/*errors*/);
+/* Similar, from one rectangle per line of a buffer (len -1 if
+ * null-terminated).  At most max are converted, but *nlines is set to
+ * the number of lines in the buffer. */
+extern gsize pwrect_from_lines(PwRect *, gboolean */*percent*/, gsize /*max*/,
+			       const gchar */*buf*/, gssize /*len*/,
+			       gsize */*nlines*/, GError **/*errors*/);
+extern gsize pwintrect_from_lines(PwIntRect *, gsize /*max*/,
+				  const gchar */*buf*/, gssize /*len*/,
+				  gsize */*nlines*/, GError **/*errors*/);
+
+/* Format as PWRECT_FORMAT (with "%" if percent) without printf.
+ * Returns length needed, like snprintf */
+#define PWRECT_STRING_MAX 64
+extern gsize pwrect_to_string(gchar *, gsize, const PwRect *,
+			      gboolean /*percent*/);
+extern gsize pwintrect_to_string(gchar *, gsize, const PwIntRect *);
+/* Similar, for many rectangles separated by newlines */
+extern gsize pwrect_to_lines(gchar *, gsize, const PwRect *,
+			     const gboolean */*percent*/, gsize /*n*/);
+extern gsize pwintrect_to_lines(gchar *, gsize, const PwIntRect *,
+				gsize /*n*/);
+
 /* Convert e.g. "up" to PwOrient */
 extern gboolean pworient_from_string(PwOrient *, const gchar *, GError **);
 
@@ -57,6 +92,30 @@ extern gboolean pwanchor_from_string(PwAnchor *, const gchar *, GError **);
 /* Convert e.g. "#996631" to colour */
 extern gboolean pwrgba_from_string(PwRGBA *, const gchar *, GError **);
 
+/* Clock for timing code: real, or virtual and moved on by hand */
+typedef struct _PwClock PwClock;
+
+extern PwClock *pwclock_new(clockid_t);
+extern PwClock *pwclock_new_virtual(guint64 /*start_ns*/);
+extern guint64 pwclock_now(PwClock *);
+extern gboolean pwclock_is_virtual(PwClock *);
+extern void pwclock_advance(PwClock *, guint64 /*ns*/);
+extern void pwclock_set(PwClock *, guint64 /*ns*/);
+extern void pwclock_free(PwClock *);
+
+/* Cheap timestamps in CPU counter ticks (or nanoseconds, if the
+ * counter is unsuitable), converted using a calibration */
+typedef struct {
+  guint64 ticks;
+  guint64 ns;			/* CLOCK_MONOTONIC at the same moment */
+  guint64 hz;			/* Ticks per second */
+} PwTickCalibration;
+
+extern guint64 pwtick_now(void);
+extern const gchar *pwtick_source(void);
+extern void pwtick_calibrate(PwTickCalibration *);
+extern guint64 pwtick_to_ns(guint64 /*ticks*/, const PwTickCalibration *);
+
 /* Trace into a file, controlled by environment variable(s) */
 typedef struct _PwTrace PwTrace;
 
@@ -64,6 +123,86 @@ extern PwTrace *pwtrace_open(const char */*name*/);
 extern void pwtracef(PwTrace *, const char */*format*/, ...);
 extern void pwtrace_close(PwTrace *);
 
+/* Format parsed once, for pwtrace_emit().  Never freed. */
+typedef struct _PwTraceFormat PwTraceFormat;
+
+extern PwTraceFormat *pwtrace_register_format(const char */*format*/);
+extern void pwtrace_emit(PwTrace *, const PwTraceFormat *, ...);
+
+/* Spans, which must nest on each thread, and counters.  Names are
+ * interned like formats. */
+extern void pwtrace_begin(PwTrace *, const char */*name*/);
+extern void pwtrace_end(PwTrace *, const char */*name*/);
+extern void pwtrace_counter(PwTrace *, const char */*name*/, gint64);
+
+/* Name the calling thread in traces (binary and JSON modes) */
+extern void pwtrace_thread_name(const char *);
+
+/* Take timestamps from a clock (NULL for the default) from now on */
+extern void pwtrace_set_clock(PwTrace *, PwClock *);
+
+/* Copy a flight recorder's records to a file (NULL for the default) */
+extern gboolean pwtrace_dump(PwTrace *, const char */*filename*/);
+
+/* Start of every PwTrace, so that a disabled trace costs one test */
+typedef struct {
+  gint active;			/* Still accepting records */
+} PwTraceHead;
+
+#define pwtrace_enabled(trace) \
+  G_UNLIKELY((trace) != NULL && ((const PwTraceHead *)(trace))->active)
+
+/* Trace with a constant format, registered on first use */
+#define PWTRACE(trace, format, ...)					\
+  G_STMT_START {							\
+    static PwTraceFormat *_pwtrace_format = NULL;			\
+    if (pwtrace_enabled(trace)) {					\
+      PwTraceFormat *_f = g_atomic_pointer_get(&_pwtrace_format);	\
+      if (_f == NULL) {							\
+	_f = pwtrace_register_format(format);				\
+	g_atomic_pointer_set(&_pwtrace_format, _f);			\
+      }									\
+      pwtrace_emit((trace), _f, ##__VA_ARGS__);				\
+    }									\
+  } G_STMT_END
+
+/*-----------------------------------------------------------------------
+ *	Statistics: counters and latency histograms, recorded per thread
+ *	without locking and added up on snapshot
+ *-----------------------------------------------------------------------*/
+typedef struct _PwStat PwStat;
+typedef struct _PwStatsSnapshot PwStatsSnapshot;
+typedef struct _PwStatsExport PwStatsExport;
+
+/* Registered once by name, never freed */
+extern PwStat *pwstats_counter(const char */*name*/);
+extern PwStat *pwstats_histogram(const char */*name*/);
+
+extern void pwstats_add(PwStat *, gint64 /*delta*/);
+extern void pwstats_record(PwStat *, guint64 /*value, e.g. ns*/);
+
+typedef struct {
+  const gchar *name;
+  gboolean histogram;
+  guint64 count;		/* Number of adds, or of values recorded */
+  guint64 sum;			/* Counter's value (as gint64) or total */
+  /* Histograms only: percentiles within 1 in 32 */
+  guint64 min, p50, p90, p99, p999, max;
+} PwStatsValue;
+
+extern PwStatsSnapshot *pwstats_snapshot(void);
+extern gboolean pwstats_snapshot_value(const PwStatsSnapshot *,
+				       const PwStatsSnapshot */*since*/,
+				       const char */*name*/, PwStatsValue *);
+extern gchar *pwstats_snapshot_format(const PwStatsSnapshot *,
+				      const PwStatsSnapshot */*since*/,
+				      gboolean /*json*/);
+extern void pwstats_snapshot_free(PwStatsSnapshot *);
+
+/* Export snapshots periodically, controlled by environment variables */
+extern PwStatsExport *pwstats_export_open(const char */*name*/);
+extern void pwstats_export_close(PwStatsExport *);
+
 /*-----------------------------------------------------------------------
  *	Definitions from INI-style files
  *-----------------------------------------------------------------------*/
@@ -106,16 +245,73 @@ extern gchar **pwdefs_keys(PwDefs *, const gchar */*section*/,
 /*-----------------------------------------------------------------------
  *	Logging support
  *-----------------------------------------------------------------------*/
+extern void
+pwglog_to_stderr(void);
+
 extern void
 pwglog_to_syslog(void);
 
+/* Send messages to journald, or a stand-in listening at path */
+extern gboolean
+pwglog_to_journal(const gchar */*path or NULL*/);
+
+/* Append messages to a ring file of fixed size */
+extern gboolean
+pwglog_to_ring(const gchar */*filename*/, gsize /*size*/,
+	       guint /*sync_msec*/);
+
+/* Sent to the journal with each message */
+extern void
+pwglog_set_tile(const gchar *);
+
+extern void
+pwglog_set_frame(guint64);
+
 extern void
 pwglog_set_level(GLogLevelFlags);
 
+/* Set logging level for one domain */
+extern void
+pwglog_set_domain_level(const gchar */*domain*/, GLogLevelFlags);
+
+/* Limit a domain (NULL for each domain) to rate messages per second */
+extern void
+pwglog_set_rate_limit(const gchar */*domain*/, gdouble /*rate*/,
+		      guint /*burst*/);
+
+/* Whether pwglog_handler would write a message */
+extern gboolean
+pwglog_enabled(const gchar */*domain*/, GLogLevelFlags);
+
+/* As pwglog_enabled, but quick when no domain has the level enabled.
+ * Use before formatting costly debug messages. */
+extern GLogLevelFlags pwglog_any_levels;
+#define PWGLOG_ENABLED(domain, level) \
+  (((level) & pwglog_any_levels) != 0 && pwglog_enabled((domain), (level)))
+
 extern void
 pwglog_handler(const gchar */*domain*/, GLogLevelFlags /*level*/,
 	       const gchar */*message*/, gpointer /*userdata*/);
 
+/* For g_log_set_writer_func(), to write structured messages */
+extern GLogWriterOutput
+pwglog_writer(GLogLevelFlags, const GLogField *, gsize /*n_fields*/,
+	      gpointer /*userdata*/);
+
+/* What to do with a message when the async queue is full */
+typedef enum {
+  PWGLOG_DROP_NEW,
+  PWGLOG_DROP_OLDEST,
+  PWGLOG_BLOCK,
+} PwGLogOverflow;
+
+/* Write messages from a thread of our own, queueing up to nslots */
+extern void
+pwglog_start_async(guint /*nslots*/, PwGLogOverflow);
+
+extern void
+pwglog_stop_async(void);
+
 /*-----------------------------------------------------------------------
  *	Network throttling
  *-----------------------------------------------------------------------*/
@@ -124,8 +320,223 @@ typedef struct _PwThrottle PwThrottle;
 extern PwThrottle *pwthrottle_create(double /*buffer_size*/, double /*rate*/);
 extern int pwthrottle_check(PwThrottle *, size_t /*nbytes*/,
 			    struct timespec */*wait*/);
+extern int pwthrottle_check_ns(PwThrottle *, size_t /*nbytes*/,
+			       guint64 */*wait_ns*/);
+extern guint pwthrottle_check_batch(PwThrottle *, const size_t */*sizes*/,
+				    guint /*n*/, guint64 */*wait_ns*/,
+				    guint64 */*departures or NULL*/);
+extern void pwthrottle_set_clock(PwThrottle *, PwClock * /*or NULL*/);
+extern void pwthrottle_set_rate(PwThrottle *, double /*rate*/);
+extern double pwthrottle_get_rate(PwThrottle *);
 extern void pwthrottle_destroy(PwThrottle *);
 
+/* Main loop source ready when a write of nbytes would be let through */
+extern GSource *pwthrottle_source_new(PwThrottle *);
+extern void pwthrottle_source_want(GSource *, size_t /*nbytes*/);
+
+/* Adjusts a throttle's rate by AIMD from feedback on congestion */
+typedef struct _PwRateControl PwRateControl;
+
+typedef struct {
+  gint64 queued;		/* Bytes in the send queue, or -1 */
+  double loss;			/* Fraction lost, or -1 */
+  gint64 rtt_ns;		/* Round trip, or -1 */
+} PwRateFeedback;
+
+extern PwRateControl *pwratectl_create(PwThrottle *, double /*floor*/,
+				       double /*ceiling*/,
+				       guint /*interval_usec*/);
+extern void pwratectl_set_aimd(PwRateControl *, double /*increase*/,
+			       double /*decrease*/);
+extern void pwratectl_note_eagain(PwRateControl *);
+extern gint64 pwratectl_socket_queued(int /*fd*/);
+extern double pwratectl_update(PwRateControl *, int /*fd or -1*/,
+			       const PwRateFeedback * /*or NULL*/,
+			       guint64 /*now_ns*/);
+extern void pwratectl_destroy(PwRateControl *);
+
+/* Sends a stream's frames earliest deadline first, dropping those
+ * which would be late */
+typedef struct _PwFrameSched PwFrameSched;
+
+typedef void (*PwFrameDrop)(gpointer /*data*/, gpointer /*userdata*/);
+
+typedef struct {
+  guint64 sent;
+  guint64 missed;		/* Dropped as they would be late */
+  guint64 chained;		/* Dropped with an earlier frame of the GOP */
+} PwFrameSchedStats;
+
+extern PwFrameSched *pwframesched_create(PwThrottle *,
+					 gboolean /*drop_chains*/,
+					 PwFrameDrop, gpointer /*userdata*/);
+extern void pwframesched_push(PwFrameSched *, gpointer /*data*/,
+			      size_t /*nbytes*/, guint64 /*deadline_ns*/,
+			      guint /*gop*/, gboolean /*key*/);
+extern gpointer pwframesched_next(PwFrameSched *, guint64 /*now_ns*/,
+				  guint64 */*wait_ns*/);
+extern void pwframesched_get_stats(PwFrameSched *, PwFrameSchedStats *);
+extern void pwframesched_destroy(PwFrameSched *);
+
+/*-----------------------------------------------------------------------
+ *	Scatter-gather I/O, by the interface's own method if it has one
+ *-----------------------------------------------------------------------*/
+extern gboolean pwio_writev(const pw_IWrite *, const struct iovec *,
+			    guint /*n*/, GError **);
+extern gboolean pwio_readv(const pw_IRead *, const struct iovec *,
+			   guint /*n*/, GError **);
+
+/* pw_IWrite and pw_IRead on a file descriptor, which is not closed */
+typedef struct _PwFd PwFd;
+
+extern PwFd *pwfd_new(int /*fd*/);
+extern const pw_IWrite *pwfd_iwrite(PwFd *);
+extern const pw_IRead *pwfd_iread(PwFd *);
+extern void pwfd_free(PwFd *);
+
+/* Ring buffer from one thread to another, taking no lock */
+typedef struct _PwRing PwRing;
+
+typedef struct {
+  guint64 written;
+  guint64 read;
+  guint64 max_used;		/* Most bytes in the ring at once */
+  guint64 writer_stalls;	/* Times a side slept */
+  guint64 reader_stalls;
+} PwRingStats;
+
+extern PwRing *pwring_new(gsize /*size*/, gboolean /*hugepages*/);
+extern const pw_IWrite *pwring_iwrite(PwRing *);
+extern const pw_IRead *pwring_iread(PwRing *);
+extern guint8 *pwring_reserve(PwRing *, gboolean /*wait*/, gsize */*len*/);
+extern void pwring_commit(PwRing *, gsize);
+extern const guint8 *pwring_peek(PwRing *, gboolean /*wait*/, gsize */*len*/);
+extern void pwring_consume(PwRing *, gsize);
+extern void pwring_close(PwRing *);
+extern void pwring_get_stats(PwRing *, PwRingStats *);
+extern void pwring_free(PwRing *);
+
+/* Writer passing writes on to another through a throttle */
+typedef struct _PwThrottleWrite PwThrottleWrite;
+
+#define PWTHROTTLE_ERROR pwthrottle_error_quark()
+typedef enum {
+  PWTHROTTLE_ERROR_WOULD_BLOCK,	/* Not yet, without blocking */
+  PWTHROTTLE_ERROR_TOO_BIG,	/* Never, without blocking */
+} PwThrottleError;
+
+extern GQuark pwthrottle_error_quark(void);
+extern PwThrottleWrite *pwthrottle_write_new(const pw_IWrite * /*inner*/,
+					     PwThrottle *, gsize /*chunk*/);
+extern void pwthrottle_write_set_nonblock(PwThrottleWrite *, gboolean);
+extern const pw_IWrite *pwthrottle_write_iface(PwThrottleWrite *);
+extern gboolean pwthrottle_write_writev(PwThrottleWrite *,
+					const struct iovec *, guint /*n*/,
+					GError **);
+extern void pwthrottle_write_free(PwThrottleWrite *);
+
+/* Link shared by classes of traffic, each guaranteed a rate and
+ * borrowing unused bandwidth up to a ceiling */
+typedef struct _PwHtb PwHtb;
+
+extern PwHtb *pwhtb_create(double /*buffer_size*/, double /*rate*/);
+extern int pwhtb_add_class(PwHtb *, double /*rate*/, double /*ceil*/,
+			   guint /*prio*/);
+extern int pwhtb_next(PwHtb *, const size_t */*pending*/,
+		      guint64 */*wait_ns*/);
+extern int pwhtb_check(PwHtb *, guint /*class*/, size_t /*nbytes*/,
+		       guint64 */*wait_ns*/);
+extern void pwhtb_set_clock(PwHtb *, PwClock * /*or NULL*/);
+extern void pwhtb_destroy(PwHtb *);
+
+/* Sends queued packets evenly spaced at its rate */
+typedef struct _PwPacer PwPacer;
+
+typedef void (*PwPacerSend)(gpointer /*data*/, size_t /*nbytes*/,
+			    guint64 /*txtime_ns*/, gpointer /*userdata*/);
+
+typedef struct {
+  guint64 packets;
+  guint64 jitter_mean_ns;	/* Interval between packets, against due */
+  guint64 jitter_max_ns;
+  guint64 late_max_ns;		/* Sent after due */
+} PwPacerStats;
+
+extern PwPacer *pwpacer_create(double /*rate*/, guint /*spin_usec*/,
+			       PwPacerSend, gpointer /*userdata*/);
+extern void pwpacer_set_txtime_lead(PwPacer *, guint /*lead_usec*/);
+extern gboolean pwpacer_enable_txtime(int /*fd*/);
+extern void pwpacer_push(PwPacer *, gpointer /*data*/, size_t /*nbytes*/);
+extern void pwpacer_get_stats(PwPacer *, PwPacerStats *);
+extern void pwpacer_destroy(PwPacer *);
+
+/*-----------------------------------------------------------------------
+ *	CPU features, detected once at load.  PWUTIL_FORCE_ISA in the
+ *	environment (c, sse2, ssse3, sse4.1, avx2 or neon) limits which
+ *	may be used, e.g. to compare against the plain C code.
+ *-----------------------------------------------------------------------*/
+typedef enum {
+  PWCPU_SSE2	= 1 << 0,
+  PWCPU_SSSE3	= 1 << 1,
+  PWCPU_SSE41	= 1 << 2,
+  PWCPU_AVX2	= 1 << 3,
+  PWCPU_NEON	= 1 << 8,
+} PwCpuFeatures;
+
+extern PwCpuFeatures pwcpu_features(void);
+extern const gchar *pwcpu_isa_name(void);
+
+/*-----------------------------------------------------------------------
+ *	Pixel format conversion
+ *-----------------------------------------------------------------------*/
+typedef struct {
+  PwPixelFormat format;
+  const gchar *name;
+  guint bytes_per_pixel;	/* In first plane */
+  guint nplanes;
+  guint chroma_shift;		/* log2 of chroma subsampling */
+} PwPixelFormatInfo;
+
+/* Image or part of one, in up to three planes */
+typedef struct {
+  PwPixelFormat format;
+  guint width, height;
+  guint8 *data[3];
+  gsize stride[3];
+} PwPixelImage;
+
+extern const PwPixelFormatInfo *pwpixel_format_info(PwPixelFormat);
+
+/* Convert e.g. "rgb565" to PwPixelFormat */
+extern gboolean pwpixel_format_from_string(PwPixelFormat *, const gchar *,
+					   GError **);
+
+/* Pixel value for fill_rect, i.e. one packed pixel in the low-addressed
+ * bytes of a guint */
+extern guint pwpixel_from_rgba(PwPixelFormat, const PwRGBA *);
+
+/* Convert one row between packed (non-YUV) formats */
+extern gboolean pwpixel_convert_row(PwPixelFormat /*dst_format*/,
+				    void */*dst*/,
+				    PwPixelFormat /*src_format*/,
+				    const void */*src*/, gsize /*count*/,
+				    GError **);
+
+/* Convert one row of YUV420 (uvstep 1) or NV12 (uvstep 2, v=u+1) to a
+ * packed format.  Chroma pointers are for the pair containing pixel 0. */
+extern gboolean pwpixel_convert_yuv_row(PwPixelFormat /*dst_format*/,
+					void */*dst*/,
+					const guint8 */*y*/,
+					const guint8 */*u*/,
+					const guint8 */*v*/,
+					guint /*uvstep*/, gsize /*count*/,
+					PwYuvMatrix, GError **);
+
+/* Convert whole image between any formats of the same size */
+extern gboolean pwpixel_convert_image(const PwPixelImage */*dst*/,
+				      const PwPixelImage */*src*/,
+				      PwYuvMatrix, GError **);
+
 /*-----------------------------------------------------------------------
  *	Null interface implementations
  *-----------------------------------------------------------------------*/
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Throughput of pixel conversions, in megapixels per second */
+
+#define WIDTH 1920
+#define HEIGHT 1080
+
+static gdouble
+elapsed(gint64 start, guint64 pixels)
+{
+  gdouble secs = (g_get_monotonic_time() - start) * 1e-6;
+  return pixels / secs * 1e-6;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const PwPixelFormat packed[] = {
+    PW_PIXEL_RGBA8888, PW_PIXEL_BGRA8888, PW_PIXEL_RGB888, PW_PIXEL_RGB565
+  };
+  guint frames = (argc > 1) ? atoi(argv[1]) : 20;
+  guint8 *src = g_malloc(4 * WIDTH * HEIGHT);
+  guint8 *dst = g_malloc(4 * WIDTH * HEIGHT);
+  guint i, j, f, row;
+  gint64 start;
+
+  for (i=0; i < 4 * WIDTH * HEIGHT; i++) src[i] = rand();
+  printf("Using %s (set PWUTIL_FORCE_ISA to compare)\n", pwcpu_isa_name());
+
+  for (i=0; i < G_N_ELEMENTS(packed); i++) {
+    for (j=0; j < G_N_ELEMENTS(packed); j++) {
+      if (i == j) continue;
+      start = g_get_monotonic_time();
+      for (f=0; f < frames; f++) {
+	for (row=0; row < HEIGHT; row++) {
+	  pwpixel_convert_row(packed[j], dst + row * 4 * WIDTH,
+			      packed[i], src + row * 4 * WIDTH, WIDTH, NULL);
+	}
+      }
+      printf("%-8s -> %-8s %8.1f Mpix/s\n",
+	     pwpixel_format_info(packed[i])->name,
+	     pwpixel_format_info(packed[j])->name,
+	     elapsed(start, (guint64)frames * WIDTH * HEIGHT));
+    }
+  }
+
+  for (i=0; i < G_N_ELEMENTS(packed); i++) {
+    for (j=1; j <= 2; j++) {
+      const guint8 *y = src, *u = src + WIDTH * HEIGHT;
+      const guint8 *v = (j == 2) ? u + 1 : u + WIDTH * HEIGHT / 4;
+      guint cstride = (j == 2) ? WIDTH : WIDTH / 2;
+      start = g_get_monotonic_time();
+      for (f=0; f < frames; f++) {
+	for (row=0; row < HEIGHT; row++) {
+	  pwpixel_convert_yuv_row(packed[i], dst + row * 4 * WIDTH,
+				  y + row * WIDTH,
+				  u + (row / 2) * cstride,
+				  v + (row / 2) * cstride,
+				  j, WIDTH, PW_YUV_BT709, NULL);
+	}
+      }
+      printf("%-8s -> %-8s %8.1f Mpix/s\n", j == 2 ? "nv12" : "yuv420",
+	     pwpixel_format_info(packed[i])->name,
+	     elapsed(start, (guint64)frames * WIDTH * HEIGHT));
+    }
+  }
+  return 0;
+}
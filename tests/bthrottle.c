@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Cost of pwthrottle_check() with 1 to 16 threads sharing one
+ * throttle, alone and with a mutex around it as senders used to */
+
+#define MAX_THREADS 16
+
+static PwThrottle *throttle;
+static GMutex lock;
+static gboolean use_lock;
+static guint checks;
+
+static gpointer
+worker(gpointer data)
+{
+  struct timespec wait;
+  guint i;
+
+  for (i=0; i < checks; i++) {
+    if (use_lock) g_mutex_lock(&lock);
+    pwthrottle_check(throttle, 1400, &wait);
+    if (use_lock) g_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+static gdouble
+run(guint nthreads)
+{
+  GThread *threads[MAX_THREADS];
+  gint64 start = g_get_monotonic_time();
+  guint i;
+
+  for (i=0; i < nthreads; i++) {
+    threads[i] = g_thread_new("worker", worker, NULL);
+  }
+  for (i=0; i < nthreads; i++) {
+    g_thread_join(threads[i]);
+  }
+  return (g_get_monotonic_time() - start) * 1e3 / ((gdouble)checks * nthreads);
+}
+
+int
+main(int argc, char *argv[])
+{
+  guint n;
+
+  checks = (argc > 1) ? atoi(argv[1]) : 200000;
+  /* Never full, so every check updates the bucket */
+  throttle = pwthrottle_create(1e15, 1e15);
+  printf("threads  ns/check  with mutex\n");
+  for (n=1; n <= MAX_THREADS; n *= 2) {
+    gdouble alone, locked;
+    use_lock = FALSE;
+    alone = run(n);
+    use_lock = TRUE;
+    locked = run(n);
+    printf("%7u %9.1f %11.1f\n", n, alone, locked);
+  }
+  pwthrottle_destroy(throttle);
+  return 0;
+}
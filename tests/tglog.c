@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Log from several threads through the async queue:
+ * tglog POLICY NSLOTS [stop].
+ * Every message should come out in order or be counted as dropped,
+ * including when going back to synchronous while logging (stop).
+ * With --fatal, queued messages should come out before g_error's.
+ * With --levels, show which domains are enabled as settings change.
+ * With --storm, log too fast for a limit set in G_DEBUG, then stop.
+ * With --journal PATH, log to journal stand-in at PATH and show
+ * the fields it gets.  With --ring FILE N, append N lines to a ring,
+ * then one to stderr. */
+
+#define NTHREADS 4
+#define NMESSAGES 500
+
+static guint formatted = 0;
+
+static guint
+costly(void)
+{
+  return ++formatted;
+}
+
+static void
+show(const char *domain)
+{
+  printf("%s debug %d warning %d\n", domain ? domain : "(none)",
+	 pwglog_enabled(domain, G_LOG_LEVEL_DEBUG),
+	 pwglog_enabled(domain, G_LOG_LEVEL_WARNING));
+}
+
+static void
+levels(void)
+{
+  guint i;
+
+  /* Setting the default first still takes in G_DEBUG */
+  pwglog_set_level(G_LOG_LEVEL_WARNING);
+  printf("enabled %d\n", PWGLOG_ENABLED("tglog.net", G_LOG_LEVEL_DEBUG) != 0);
+  show(NULL);
+  show("tglog.net");
+  show("tglog.disk");
+  for (i=0; i < 1000; i++) {
+    if (PWGLOG_ENABLED("tglog.disk", G_LOG_LEVEL_DEBUG)) {
+      g_log("tglog.disk", G_LOG_LEVEL_DEBUG, "%u", costly());
+    }
+  }
+  printf("formatted %u\n", formatted);
+
+  pwglog_set_domain_level("tglog.net", G_LOG_LEVEL_WARNING);
+  pwglog_set_domain_level("tglog.disk", G_LOG_LEVEL_DEBUG);
+  show("tglog.net");
+  show("tglog.disk");
+  pwglog_set_level(G_LOG_LEVEL_DEBUG);
+  show(NULL);
+  show("tglog.net");
+  g_log("tglog.disk", G_LOG_LEVEL_DEBUG, "%u", costly());
+  g_log("tglog.net", G_LOG_LEVEL_DEBUG, "%u", costly());
+}
+
+static gpointer
+worker(gpointer data)
+{
+  guint n = GPOINTER_TO_UINT(data);
+  guint i;
+
+  for (i=0; i < NMESSAGES; i++) {
+    g_warning("thread %u message %u", n, i);
+  }
+  return NULL;
+}
+
+/* Structured message from a given line */
+static void
+log_at(const char *domain, const char *line, const char *message)
+{
+  GLogField fields[] = {
+    { "MESSAGE", message, -1 },
+    { "GLIB_DOMAIN", domain, -1 },
+    { "CODE_FILE", "tglog.c", -1 },
+    { "CODE_LINE", line, -1 },
+  };
+  pwglog_writer(G_LOG_LEVEL_WARNING, fields, G_N_ELEMENTS(fields), NULL);
+}
+
+static void
+storm(void)
+{
+  gchar text[32];
+  guint i;
+
+  for (i=0; i < 100; i++) {
+    g_log("tglog.net", G_LOG_LEVEL_WARNING, "link down");
+  }
+  for (i=0; i < 100; i++) {
+    g_log("tglog.net", G_LOG_LEVEL_WARNING, "lost %u", i);
+  }
+  for (i=0; i < 3; i++) {
+    g_log("tglog.disk", G_LOG_LEVEL_WARNING, "not limited");
+  }
+  /* One line's storm leaves another's tokens alone */
+  for (i=0; i < 20; i++) {
+    g_snprintf(text, sizeof text, "spin %u", i);
+    log_at("tglog.io", "10", text);
+  }
+  log_at("tglog.io", "20", "other");
+  /* The held back counts come out though no more messages do */
+  g_usleep(2500000);
+  g_log("tglog.net", G_LOG_LEVEL_WARNING, "back");
+}
+
+/* Fields of one journal datagram, long values shown by length */
+static void
+show_fields(const char *data, gsize len)
+{
+  const char *end = data + len;
+
+  while (data < end) {
+    const char *nl = memchr(data, '\n', end - data);
+    const char *eq;
+    if (nl == NULL) break;
+    eq = memchr(data, '=', nl - data);
+    if (eq != NULL) {
+      if (nl - eq > 40) {
+	printf("%.*s<%d bytes>\n", (int)(eq + 1 - data), data,
+	       (int)(nl - eq - 1));
+      } else {
+	printf("%.*s\n", (int)(nl - data), data);
+      }
+      data = nl + 1;
+    } else {
+      guint64 vlen;
+      memcpy(&vlen, nl + 1, 8);
+      vlen = GUINT64_FROM_LE(vlen);
+      printf("%.*s=", (int)(nl - data), data);
+      data = nl + 9;
+      if (vlen > 40) {
+	printf("<%d bytes>\n", (int)vlen);
+      } else {
+	const char *p;
+	for (p=data; p < data + vlen; p++) {
+	  if (*p == '\n') fputs("\\n", stdout); else putchar(*p);
+	}
+	putchar('\n');
+      }
+      data += vlen + 1;
+    }
+  }
+  printf("--\n");
+}
+
+static void
+journal(const char *path)
+{
+  struct sockaddr_un addr;
+  static char buf[65536];
+  GLogField fields[] = {
+    { "MESSAGE", "structured", -1 },
+    { "GLIB_DOMAIN", "tglog.net", -1 },
+    { "CODE_FILE", "tglog.c", -1 },
+    { "CODE_LINE", "99", -1 },
+    { "CODE_FUNC", "journal", -1 },
+    { "PRIORITY", "4", -1 },
+  };
+  gchar *big;
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    perror(path);
+    return;
+  }
+  g_set_prgname("tglog");
+  if (! pwglog_to_journal(path)) {
+    printf("cannot reach %s\n", path);
+    return;
+  }
+  g_log("tglog.net", G_LOG_LEVEL_WARNING, "plain");
+  pwglog_set_tile("tile3");
+  pwglog_set_frame(42);
+  g_log("tglog.net", G_LOG_LEVEL_CRITICAL, "two\nlines");
+  pwglog_writer(G_LOG_LEVEL_WARNING, fields, G_N_ELEMENTS(fields), NULL);
+  big = g_strnfill(1000000, 'x');
+  g_log(NULL, G_LOG_LEVEL_WARNING, "%s", big);
+  g_free(big);
+
+  while (1) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = buf;
+    iov.iov_len = sizeof buf;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof control;
+    n = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n < 0) break;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+      /* Too big, so passed in a memfd */
+      int mfd;
+      gchar *data;
+      off_t size;
+      memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+      size = lseek(mfd, 0, SEEK_END);
+      data = g_malloc(size);
+      if (pread(mfd, data, size, 0) == size) {
+	printf("memfd\n");
+	show_fields(data, size);
+      }
+      g_free(data);
+      close(mfd);
+    } else {
+      show_fields(buf, n);
+    }
+  }
+  close(fd);
+  unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GThread *threads[NTHREADS];
+  PwGLogOverflow overflow = PWGLOG_BLOCK;
+  guint i;
+
+  g_log_set_default_handler(pwglog_handler, NULL);
+  if (argc > 1 && strcmp(argv[1], "--fatal") == 0) {
+    pwglog_start_async(16, PWGLOG_BLOCK);
+    g_warning("first");
+    g_warning("second");
+    g_error("last");
+  }
+  if (argc > 3 && strcmp(argv[1], "--ring") == 0) {
+    if (! pwglog_to_ring(argv[2], 4096, 100)) {
+      perror(argv[2]);
+      return 1;
+    }
+    for (i=0; i < atoi(argv[3]); i++) {
+      g_log("tglog", G_LOG_LEVEL_WARNING, "ring message %u", i);
+    }
+    /* Closes the ring */
+    pwglog_to_stderr();
+    g_log("tglog", G_LOG_LEVEL_WARNING, "after ring");
+    return 0;
+  }
+  if (argc > 2 && strcmp(argv[1], "--journal") == 0) {
+    journal(argv[2]);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--storm") == 0) {
+    storm();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--levels") == 0) {
+    levels();
+    return 0;
+  }
+  if (argc > 2) {
+    if (strcmp(argv[1], "drop-new") == 0) {
+      overflow = PWGLOG_DROP_NEW;
+    } else if (strcmp(argv[1], "drop-oldest") == 0) {
+      overflow = PWGLOG_DROP_OLDEST;
+    }
+    pwglog_start_async(atoi(argv[2]), overflow);
+  }
+  for (i=0; i < NTHREADS; i++) {
+    threads[i] = g_thread_new("worker", worker, GUINT_TO_POINTER(i));
+  }
+  if (argc > 3 && strcmp(argv[3], "stop") == 0) {
+    /* While they are logging */
+    pwglog_stop_async();
+  }
+  for (i=0; i < NTHREADS; i++) {
+    g_thread_join(threads[i]);
+  }
+  pwglog_stop_async();
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Write a header and payload with one writev through a pipe, and read
+ * them back into separate buffers with readv.  Then the same through
+ * a writer and reader made before writev and readv, so the helpers
+ * fall back to a call per buffer.  Then the ends of a pipe and a
+ * socket. */
+
+typedef struct {
+  PwFd *fd;
+  guint calls;
+} Old;
+
+static gboolean
+old_write(void *priv, const void *data, gsize len, GError **error)
+{
+  Old *old = priv;
+  old->calls++;
+  return PW_CALL(pwfd_iwrite(old->fd), write, data, len, error);
+}
+
+static gboolean
+old_read(void *priv, void *data, gsize len, GError **error)
+{
+  Old *old = priv;
+  old->calls++;
+  return PW_CALL(pwfd_iread(old->fd), read, data, len, error);
+}
+
+/* As they were before writev and readv */
+static const struct {
+  gsize size;
+  pw_IWrite_write *write;
+  pw_IWrite_flush *flush;
+} old_miwrite = { sizeof(old_miwrite), &old_write, NULL };
+
+static const struct {
+  gsize size;
+  pw_IRead_read *read;
+} old_miread = { sizeof(old_miread), &old_read };
+
+static void
+roundtrip(const char *what, const pw_IWrite *out, const pw_IRead *in)
+{
+  static const char header[8] = "HDR:0042";
+  char payload[42], rheader[8], rpayload[42];
+  struct iovec iov[2];
+  GError *error = NULL;
+
+  memset(payload, 'p', sizeof payload);
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = sizeof header;
+  iov[1].iov_base = payload;
+  iov[1].iov_len = sizeof payload;
+  if (! pwio_writev(out, iov, 2, &error)) {
+    printf("%s writev: %s\n", what, error->message);
+    g_clear_error(&error);
+    return;
+  }
+  iov[0].iov_base = rheader;
+  iov[1].iov_base = rpayload;
+  if (! pwio_readv(in, iov, 2, &error)) {
+    printf("%s readv: %s\n", what, error->message);
+    g_clear_error(&error);
+    return;
+  }
+  printf("%s %s\n", what,
+	 (memcmp(header, rheader, sizeof header) == 0 &&
+	  memcmp(payload, rpayload, sizeof payload) == 0) ? "same" : "differ");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fds[2];
+  PwFd *rfd, *wfd;
+  Old oldw, oldr;
+  pw_IWrite owrite, *iw = &owrite;
+  pw_IRead oread, *ir = &oread;
+  char byte;
+  GError *error = NULL;
+
+  if (pipe(fds) != 0) return 1;
+  rfd = pwfd_new(fds[0]);
+  wfd = pwfd_new(fds[1]);
+  printf("fd can writev %d readv %d\n",
+	 PW_CAN(pwfd_iwrite(wfd), writev) ? 1 : 0,
+	 PW_CAN(pwfd_iread(rfd), readv) ? 1 : 0);
+  roundtrip("fd", pwfd_iwrite(wfd), pwfd_iread(rfd));
+
+  oldw.fd = wfd;
+  oldw.calls = 0;
+  oldr.fd = rfd;
+  oldr.calls = 0;
+  owrite.methods = (const pw_MIWrite *)&old_miwrite;
+  owrite.priv = &oldw;
+  oread.methods = (const pw_MIRead *)&old_miread;
+  oread.priv = &oldr;
+  printf("old can writev %d readv %d\n",
+	 PW_CAN(iw, writev) ? 1 : 0, PW_CAN(ir, readv) ? 1 : 0);
+  roundtrip("old", iw, ir);
+  printf("old calls %u %u\n", oldw.calls, oldr.calls);
+
+  /* Reading past the end fails, unless reading nothing */
+  close(fds[1]);
+  if (! PW_CALL(pwfd_iread(rfd), read, &byte, 1, &error)) {
+    printf("%s\n", error->message);
+    g_clear_error(&error);
+  }
+  printf("empty read %s\n",
+	 PW_CALL(pwfd_iread(rfd), read, &byte, 0, NULL) ? "ok" : "failed");
+  pwfd_free(rfd);
+  pwfd_free(wfd);
+  close(fds[0]);
+
+  /* Writing to a socket with no reader fails, without SIGPIPE */
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 1;
+  close(fds[1]);
+  wfd = pwfd_new(fds[0]);
+  if (! PW_CALL(pwfd_iwrite(wfd), write, &byte, 1, &error)) {
+    printf("%s\n", error->message);
+    g_clear_error(&error);
+  }
+  pwfd_free(wfd);
+  close(fds[0]);
+  return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Check pixel conversions against straightforward reference code */
+
+#define MAXW 203		/* Odd, and more than any vector width */
+
+static guint8 rgba[4 * MAXW];
+static guint8 planes[3][MAXW * 2];
+static int failures = 0;
+
+static void
+fail(const char *what, int width, int x, int c, int got, int want)
+{
+  printf("FAIL %s width %d pixel %d channel %d: %d != %d\n",
+	 what, width, x, c, got, want);
+  failures++;
+}
+
+/* Reference RGBA8888 for pixel x of a packed format */
+static void
+ref_unpack(PwPixelFormat format, const guint8 *src, int x, int out[4])
+{
+  const guint8 *p;
+  guint16 w;
+  switch (format) {
+  case PW_PIXEL_RGBA8888:
+    p = src + 4 * x;
+    out[0] = p[0]; out[1] = p[1]; out[2] = p[2]; out[3] = p[3];
+    break;
+  case PW_PIXEL_BGRA8888:
+    p = src + 4 * x;
+    out[0] = p[2]; out[1] = p[1]; out[2] = p[0]; out[3] = p[3];
+    break;
+  case PW_PIXEL_RGB888:
+    p = src + 3 * x;
+    out[0] = p[0]; out[1] = p[1]; out[2] = p[2]; out[3] = 255;
+    break;
+  case PW_PIXEL_RGB565:
+    memcpy(&w, src + 2 * x, 2);
+    /* Replicate top bits into bottom */
+    out[0] = ((w >> 8) & 0xf8) | (w >> 13);
+    out[1] = ((w >> 3) & 0xfc) | ((w >> 9) & 3);
+    out[2] = ((w << 3) & 0xf8) | ((w >> 2) & 7);
+    out[3] = 255;
+    break;
+  default:
+    abort();
+  }
+}
+
+/* Check packed to packed conversion, via reference unpack of both */
+static void
+check_row(PwPixelFormat dfmt, PwPixelFormat sfmt)
+{
+  const PwPixelFormatInfo *dinfo = pwpixel_format_info(dfmt);
+  const PwPixelFormatInfo *sinfo = pwpixel_format_info(sfmt);
+  guint8 dst[4 * MAXW + 1];
+  int width, x, c, s[4], d[4];
+  gchar *what = g_strdup_printf("%s->%s", sinfo->name, dinfo->name);
+
+  for (width = 1; width <= MAXW; width += 13) {
+    dst[width * dinfo->bytes_per_pixel] = 0xa5;
+    pwpixel_convert_row(dfmt, dst, sfmt, rgba, width, NULL);
+    if (dst[width * dinfo->bytes_per_pixel] != 0xa5) {
+      fail(what, width, width, 0, 0, 0);
+      goto done;
+    }
+    for (x=0; x < width; x++) {
+      ref_unpack(sfmt, rgba, x, s);
+      ref_unpack(dfmt, dst, x, d);
+      for (c=0; c < 4; c++) {
+	int want = s[c];
+	/* Reduce source to destination precision */
+	if (dfmt == PW_PIXEL_RGB565 && c < 3) {
+	  int bits = (c == 1) ? 6 : 5;
+	  want = (want >> (8 - bits)) << (8 - bits);
+	  want |= want >> bits;
+	}
+	if ((dfmt == PW_PIXEL_RGB888 || dfmt == PW_PIXEL_RGB565) && c == 3) {
+	  want = 255;
+	}
+	if (d[c] != want) {
+	  fail(what, width, x, c, d[c], want);
+	  goto done;
+	}
+      }
+    }
+  }
+  printf("ok %s\n", what);
+ done:
+  g_free(what);
+}
+
+/* Reference YUV to RGB */
+static void
+ref_yuv(int y, int u, int v, PwYuvMatrix matrix, int out[3])
+{
+  double kr, kb, yy, uu, vv, r, g, b;
+  int c;
+  if (matrix == PW_YUV_BT709 || matrix == PW_YUV_BT709_FULL) {
+    kr = 0.2126; kb = 0.0722;
+  } else {
+    kr = 0.299; kb = 0.114;
+  }
+  if (matrix == PW_YUV_BT601_FULL || matrix == PW_YUV_BT709_FULL) {
+    yy = y; uu = u - 128; vv = v - 128;
+  } else {
+    yy = (y - 16) * 255 / 219.0;
+    uu = (u - 128) * 255 / 224.0;
+    vv = (v - 128) * 255 / 224.0;
+  }
+  r = yy + 2 * (1 - kr) * vv;
+  b = yy + 2 * (1 - kb) * uu;
+  g = (yy - kr * r - kb * b) / (1 - kr - kb);
+  out[0] = r + 0.5; out[1] = g + 0.5; out[2] = b + 0.5;
+  for (c=0; c < 3; c++) out[c] = CLAMP(out[c], 0, 255);
+}
+
+static guint32
+check_yuv(PwPixelFormat dfmt, guint uvstep, PwYuvMatrix matrix)
+{
+  const PwPixelFormatInfo *dinfo = pwpixel_format_info(dfmt);
+  guint8 dst[4 * MAXW];
+  const guint8 *y = planes[0], *u = planes[1];
+  const guint8 *v = (uvstep == 2) ? planes[1] + 1 : planes[2];
+  int width, x, c, d[4], want[3];
+  guint32 sum = 0;
+  gchar *what = g_strdup_printf("%s->%s/%d", uvstep == 2 ? "nv12" : "yuv420",
+				dinfo->name, (int)matrix);
+
+  for (width = 1; width <= MAXW; width += 13) {
+    pwpixel_convert_yuv_row(dfmt, dst, y, u, v, uvstep, width, matrix, NULL);
+    for (x=0; x < width; x++) {
+      ref_unpack(dfmt, dst, x, d);
+      ref_yuv(y[x], u[(x / 2) * uvstep], v[(x / 2) * uvstep], matrix, want);
+      for (c=0; c < 3; c++) {
+	int tol = (dfmt == PW_PIXEL_RGB565) ? 9 : 1;
+	sum = sum * 31 + d[c];
+	if (ABS(d[c] - want[c]) > tol) {
+	  fail(what, width, x, c, d[c], want[c]);
+	  goto done;
+	}
+      }
+    }
+  }
+  printf("ok %s %08x\n", what, sum);
+ done:
+  g_free(what);
+  return sum;
+}
+
+static void
+check_image(PwPixelFormat yuvfmt, PwYuvMatrix matrix)
+{
+  enum { W = 37, H = 9 };
+  guint8 src[4 * W * H], back[4 * W * H], yuv[3 * W * H];
+  PwPixelImage rgbimg = {PW_PIXEL_RGBA8888, W, H, {src}, {4 * W}};
+  PwPixelImage backimg = {PW_PIXEL_RGBA8888, W, H, {back}, {4 * W}};
+  PwPixelImage yuvimg = {yuvfmt, W, H, {yuv, yuv + W * H}, {W, W}};
+  int i, worst = 0;
+
+  if (yuvfmt == PW_PIXEL_YUV420) {
+    yuvimg.data[2] = yuv + 2 * W * H;
+    yuvimg.stride[1] = yuvimg.stride[2] = (W + 1) / 2;
+  } else {
+    yuvimg.stride[1] = W + 1;
+  }
+  /* Smooth image so chroma subsampling loses little */
+  for (i=0; i < W * H; i++) {
+    src[4 * i] = 40 + 4 * (i % W);
+    src[4 * i + 1] = 60 + 10 * (i / W);
+    src[4 * i + 2] = 200 - 3 * (i % W);
+    src[4 * i + 3] = 255;
+  }
+  pwpixel_convert_image(&yuvimg, &rgbimg, matrix, NULL);
+  pwpixel_convert_image(&backimg, &yuvimg, matrix, NULL);
+  for (i=0; i < 4 * W * H; i++) {
+    worst = MAX(worst, ABS(src[i] - back[i]));
+  }
+  printf("%s %s round trip %d\n", worst <= 8 ? "ok" : "FAIL",
+	 pwpixel_format_info(yuvfmt)->name, (int)matrix);
+  if (worst > 8) failures++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const PwPixelFormat packed[] = {
+    PW_PIXEL_RGBA8888, PW_PIXEL_BGRA8888, PW_PIXEL_RGB888, PW_PIXEL_RGB565
+  };
+  PwRGBA white = {255, 255, 255, 255};
+  guint i, j;
+  int m;
+
+  srand(42);
+  for (i=0; i < sizeof(rgba); i++) rgba[i] = rand();
+  for (i=0; i < 3; i++) {
+    for (j=0; j < sizeof(planes[i]); j++) planes[i][j] = rand();
+  }
+  /* Include the extremes */
+  planes[0][0] = 0; planes[0][1] = 255; planes[0][2] = 16; planes[0][3] = 235;
+
+  for (i=0; i < G_N_ELEMENTS(packed); i++) {
+    for (j=0; j < G_N_ELEMENTS(packed); j++) {
+      check_row(packed[j], packed[i]);
+    }
+  }
+  for (m = PW_YUV_BT601; m <= PW_YUV_BT709_FULL; m++) {
+    check_yuv(PW_PIXEL_RGBA8888, 1, m);
+    check_yuv(PW_PIXEL_RGBA8888, 2, m);
+  }
+  check_yuv(PW_PIXEL_BGRA8888, 1, PW_YUV_BT709);
+  check_yuv(PW_PIXEL_RGB888, 2, PW_YUV_BT601);
+  check_yuv(PW_PIXEL_RGB565, 1, PW_YUV_BT601_FULL);
+  check_image(PW_PIXEL_YUV420, PW_YUV_BT601);
+  check_image(PW_PIXEL_NV12, PW_YUV_BT709_FULL);
+
+  printf("white rgb565 %04x bgra8888 %08x\n",
+	 pwpixel_from_rgba(PW_PIXEL_RGB565, &white),
+	 pwpixel_from_rgba(PW_PIXEL_BGRA8888, &white));
+  return failures ? 1 : 0;
+}
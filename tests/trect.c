@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Parse rectangles from arguments in bulk, then format them again */
+int
+main(int argc, char *argv[])
+{
+  gboolean intrect = FALSE, lines = FALSE, abs = FALSE;
+  gboolean *percent;
+  PwRect *rects;
+  PwIntRect *irects;
+  GError **errors;
+  gchar *buffer, *small;
+  gsize n, i, nfail, total, size = 0;
+  int argi = 1;
+
+  while (argi < argc && argv[argi][0] == '-' && argv[argi][1] == '-') {
+    if (strcmp(argv[argi], "--int") == 0) {
+      intrect = TRUE;
+    } else if (strcmp(argv[argi], "--lines") == 0) {
+      lines = TRUE;
+    } else if (strcmp(argv[argi], "--abs") == 0) {
+      abs = TRUE;
+    } else if (strcmp(argv[argi], "--size") == 0 && argi + 1 < argc) {
+      size = atoi(argv[++argi]);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[argi]);
+      return 2;
+    }
+    argi++;
+  }
+  n = argc - argi;
+  rects = g_new0(PwRect, n);
+  irects = g_new0(PwIntRect, n);
+  percent = g_new0(gboolean, n);
+  errors = g_new0(GError *, n);
+
+  if (lines) {
+    gchar *joined = g_strjoinv("\n", argv + argi);
+    gsize nlines;
+    if (intrect) {
+      nfail = pwintrect_from_lines(irects, n, joined, -1, &nlines, errors);
+    } else {
+      nfail = pwrect_from_lines(rects, abs ? NULL : percent, n,
+				joined, -1, &nlines, errors);
+    }
+    if (nlines != n) {
+      printf("nlines: %u\n", (guint)nlines);
+    }
+    g_free(joined);
+  } else if (intrect) {
+    nfail = pwintrect_from_strings(irects, n,
+				   (const gchar *const *)argv + argi, errors);
+  } else {
+    nfail = pwrect_from_strings(rects, abs ? NULL : percent, n,
+				(const gchar *const *)argv + argi, errors);
+  }
+
+  for (i=0; i < n; i++) {
+    if (errors[i] != NULL) {
+      printf("error %u: %s\n", (guint)i, errors[i]->message);
+      g_error_free(errors[i]);
+      errors[i] = NULL;
+      PWRECT_SET(rects[i], 0, 0, 0, 0);
+      PWRECT_SET(irects[i], 0, 0, 0, 0);
+    } else {
+      /* Check against printf */
+      gchar fast[PWRECT_STRING_MAX + 1], slow[PWRECT_STRING_MAX + 1];
+      if (intrect) {
+	pwintrect_to_string(fast, sizeof(fast), &irects[i]);
+	snprintf(slow, sizeof(slow), PWINTRECT_FORMAT, PWRECT_ARGS(irects[i]));
+      } else {
+	pwrect_to_string(fast, sizeof(fast), &rects[i], percent[i]);
+	snprintf(slow, sizeof(slow), PWRECT_FORMAT "%s", PWRECT_ARGS(rects[i]),
+		 percent[i] ? "%" : "");
+      }
+      if (strcmp(fast, slow) != 0) {
+	printf("mismatch %u: %s != %s\n", (guint)i, fast, slow);
+      }
+    }
+  }
+  if (nfail) {
+    printf("failed: %u\n", (guint)nfail);
+  }
+
+  /* Format all in one buffer; then, if given a size, in one that
+   * small, which should hold as much as fits */
+  buffer = g_malloc(1024);
+  if (intrect) {
+    total = pwintrect_to_lines(buffer, 1024, irects, n);
+  } else {
+    total = pwrect_to_lines(buffer, 1024, rects, abs ? NULL : percent, n);
+  }
+  if (total != strlen(buffer)) {
+    printf("length: %u != %u\n", (guint)total, (guint)strlen(buffer));
+  }
+  if (size > 0) {
+    small = g_malloc(size);
+    if (intrect) {
+      n = pwintrect_to_lines(small, size, irects, n);
+    } else {
+      n = pwrect_to_lines(small, size, rects, abs ? NULL : percent, n);
+    }
+    if (n != total) {
+      printf("truncated length: %u != %u\n", (guint)n, (guint)total);
+    }
+    if (strlen(small) != MIN(total, size - 1) ||
+	strncmp(small, buffer, size - 1) != 0) {
+      printf("truncated wrongly: %s\n", small);
+    }
+    printf("%s\n", small);
+  } else {
+    printf("%s\n", buffer);
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Pass a counting sequence through a small ring from one thread to
+ * another, half of it by copying and half in place, and check it
+ * comes out whole.  Then vectors each way across the end. */
+
+#define NVALUES 200000
+
+static gpointer
+producer(gpointer data)
+{
+  PwRing *ring = data;
+  const pw_IWrite *iw = pwring_iwrite(ring);
+  guint32 v = 0, chunk[37];
+  guint i, n;
+
+  /* Copying, in odd sized pieces */
+  while (v < NVALUES / 2) {
+    n = MIN(v % 37 + 1, NVALUES / 2 - v);
+    for (i=0; i < n; i++) chunk[i] = v++;
+    PW_CALL(iw, write, chunk, n * sizeof(chunk[0]), NULL);
+  }
+  /* In place, a whole value at a time */
+  while (v < NVALUES) {
+    gsize len;
+    guint8 *space = pwring_reserve(ring, TRUE, &len);
+    n = MIN(len / sizeof(v), NVALUES - v);
+    for (i=0; i < n; i++, v++) memcpy(space + i * sizeof(v), &v, sizeof(v));
+    pwring_commit(ring, n * sizeof(v));
+  }
+  pwring_close(ring);
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  PwRing *ring = pwring_new(1000, FALSE);
+  const pw_IRead *ir = pwring_iread(ring);
+  GThread *thread;
+  PwRingStats stats;
+  GError *error = NULL;
+  guint32 v = 0, got;
+  const guint8 *bytes;
+  gsize i, len;
+  guint bad = 0;
+  static const char header[] = "HDR:", payload[] = "payload";
+  char filler[4090], rfirst[6], rrest[6];
+  struct iovec iov[3];
+
+  thread = g_thread_new("producer", producer, ring);
+  while (v < NVALUES / 3) {
+    PW_CALL(ir, read, &got, sizeof(got), NULL);
+    if (got != v++) bad++;
+  }
+  while ((bytes = pwring_peek(ring, TRUE, &len)) != NULL) {
+    len -= len % sizeof(got);
+    if (len == 0) {
+      /* A value split by the end of the ring */
+      PW_CALL(ir, read, &got, sizeof(got), NULL);
+      if (got != v++) bad++;
+      continue;
+    }
+    for (i=0; i < len; i += sizeof(got)) {
+      memcpy(&got, bytes + i, sizeof(got));
+      if (got != v++) bad++;
+    }
+    pwring_consume(ring, len);
+  }
+  g_thread_join(thread);
+  printf("values %u bad %u\n", v, bad);
+
+  pwring_get_stats(ring, &stats);
+  printf("written %" G_GUINT64_FORMAT " read %" G_GUINT64_FORMAT "\n",
+	 stats.written, stats.read);
+  printf("max used %s\n", (stats.max_used > 0 && stats.max_used <= 4096) ?
+	 "ok" : "wrong");
+  if (! PW_CALL(ir, read, &got, sizeof(got), &error)) {
+    printf("%s\n", error->message);
+    g_error_free(error);
+  }
+  pwring_free(ring);
+
+  /* Huge pages or not, it is usable */
+  ring = pwring_new(1, TRUE);
+  PW_CALL(pwring_iwrite(ring), write, "hello", 6, NULL);
+  pwring_close(ring);
+  bytes = pwring_peek(ring, FALSE, &len);
+  printf("%s %lu\n", bytes, (unsigned long)len);
+  pwring_free(ring);
+
+  /* Vectors each way, across the end of the ring */
+  ring = pwring_new(4096, FALSE);
+  ir = pwring_iread(ring);
+  memset(filler, 'f', sizeof filler);
+  PW_CALL(pwring_iwrite(ring), write, filler, sizeof filler, NULL);
+  PW_CALL(ir, read, filler, sizeof filler, NULL);
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = NULL;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = (void *)payload;
+  iov[2].iov_len = 7;
+  pwio_writev(pwring_iwrite(ring), iov, 3, NULL);
+  iov[0].iov_base = rfirst;
+  iov[0].iov_len = 6;
+  iov[1].iov_base = rrest;
+  iov[1].iov_len = 5;
+  pwio_readv(ir, iov, 2, NULL);
+  printf("vectors native %d %d, %s\n",
+	 PW_CAN(pwring_iwrite(ring), writev) ? 1 : 0,
+	 PW_CAN(ir, readv) ? 1 : 0,
+	 (memcmp(rfirst, "HDR:pa", 6) == 0 &&
+	  memcmp(rrest, "yload", 5) == 0) ? "same" : "differ");
+  pwring_free(ring);
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Record known values from several threads and check the sums and
+ * percentiles.  With --export, record slowly while TS_STATSFILE
+ * collects snapshots. */
+
+#define NTHREADS 4
+#define NVALUES 100000
+
+static PwStat *latency;
+static PwStat *count;
+
+static gpointer
+worker(gpointer data)
+{
+  guint n = GPOINTER_TO_UINT(data);
+  guint v;
+
+  for (v=1; v <= NVALUES; v++) {
+    if (v % NTHREADS != n) continue;
+    pwstats_record(latency, v);
+    pwstats_add(count, 2);
+  }
+  return NULL;
+}
+
+/* Within the histogram's precision */
+static void
+check(const char *what, guint64 value, guint64 expect)
+{
+  if (value * 32 < expect * 31 || value * 32 > expect * 33) {
+    printf("FAIL %s %" G_GUINT64_FORMAT " not %" G_GUINT64_FORMAT "\n",
+	   what, value, expect);
+  } else {
+    printf("ok %s\n", what);
+  }
+}
+
+static void
+export(void)
+{
+  PwStatsExport *exp = pwstats_export_open("TS");
+  guint i;
+
+  if (exp == NULL) {
+    fprintf(stderr, "TS_STATSFILE not set\n");
+    return;
+  }
+  for (i=0; i < 1000; i++) {
+    pwstats_record(latency, 5);
+    if (i % 100 == 99) g_usleep(20000);
+  }
+  pwstats_export_close(exp);
+}
+
+int
+main(int argc, char *argv[])
+{
+  GThread *threads[NTHREADS];
+  PwStatsSnapshot *before, *after;
+  PwStatsValue v;
+  PwThrottle *throttle;
+  struct timespec wait;
+  gchar *text, *line;
+  guint i;
+
+  latency = pwstats_histogram("t.latency");
+  count = pwstats_counter("t.count");
+  if (argc > 1 && strcmp(argv[1], "--export") == 0) {
+    export();
+    return 0;
+  }
+
+  /* From threads which have exited */
+  for (i=0; i < NTHREADS; i++) {
+    threads[i] = g_thread_new("worker", worker, GUINT_TO_POINTER(i));
+  }
+  for (i=0; i < NTHREADS; i++) {
+    g_thread_join(threads[i]);
+  }
+  before = pwstats_snapshot();
+  pwstats_snapshot_value(before, NULL, "t.count", &v);
+  printf("count %" G_GUINT64_FORMAT " sum %" G_GINT64_FORMAT "\n",
+	 v.count, (gint64)v.sum);
+  pwstats_snapshot_value(before, NULL, "t.latency", &v);
+  printf("count %" G_GUINT64_FORMAT " sum %" G_GUINT64_FORMAT
+	 " min %" G_GUINT64_FORMAT " max %" G_GUINT64_FORMAT "\n",
+	 v.count, v.sum, v.min, v.max);
+  check("p50", v.p50, NVALUES / 2);
+  check("p90", v.p90, NVALUES * 9 / 10);
+  check("p99", v.p99, NVALUES * 99 / 100);
+  check("p999", v.p999, NVALUES * 999 / 1000);
+
+  /* From this thread, since the first snapshot */
+  for (i=0; i < 10; i++) {
+    pwstats_record(latency, 7);
+  }
+  pwstats_add(count, -5);
+  after = pwstats_snapshot();
+  pwstats_snapshot_value(after, before, "t.latency", &v);
+  printf("count %" G_GUINT64_FORMAT " min %" G_GUINT64_FORMAT
+	 " p50 %" G_GUINT64_FORMAT " max %" G_GUINT64_FORMAT "\n",
+	 v.count, v.min, v.p50, v.max);
+
+  /* Without the time line */
+  text = pwstats_snapshot_format(after, before, FALSE);
+  line = strchr(text, '\n') + 1;
+  fputs(line, stdout);
+  g_free(text);
+  text = pwstats_snapshot_format(after, before, TRUE);
+  line = strstr(text, ",\"counters\"") + 1;
+  fputs(line, stdout);
+  g_free(text);
+  pwstats_snapshot_free(before);
+  pwstats_snapshot_free(after);
+
+  /* Throttle records what it lets through and how long it holds off */
+  throttle = pwthrottle_create(1000, 1000);
+  pwthrottle_check(throttle, 500, &wait);
+  pwthrottle_check(throttle, 800, &wait);
+  pwthrottle_destroy(throttle);
+  after = pwstats_snapshot();
+  pwstats_snapshot_value(after, NULL, "pwthrottle.bytes", &v);
+  printf("pwthrottle.bytes %" G_GINT64_FORMAT "\n", (gint64)v.sum);
+  pwstats_snapshot_value(after, NULL, "pwthrottle.wait_ns", &v);
+  printf("pwthrottle.wait_ns count %" G_GUINT64_FORMAT "\n", v.count);
+  check("wait", v.p50, 300000000);
+  pwstats_snapshot_free(after);
+  return 0;
+}
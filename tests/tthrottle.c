@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* One test per option.  Those on the real clock show results rounded
+ * or as bounds, as a loaded machine may be late; those on a virtual
+ * clock, or simulating time, are exact.
+ * --htb: three classes always wanting to send share a link, on a
+ * virtual clock; show the share of the link each gets.  Then threads
+ * ask at once with the clock stopped: only what fits goes.
+ * --batch: let through as much of a vector of packets as fits.
+ * --pacer: send packets evenly spaced, checking when each was due.
+ * --source: write from a main loop as the throttle allows.
+ * --adapt: simulate the rate control against a bottleneck.
+ * --edf: frames go by deadline, and one already late is dropped,
+ * with or without the rest of its GOP.
+ * --write: write through a throttle to a writer noting each call,
+ * first on the real clock, then on a virtual one. */
+
+#define PACKET 1000
+
+#define HTB_THREADS 4
+
+static gpointer
+htb_thread(gpointer data)
+{
+  PwHtb *link = data;
+  guint64 wait;
+  gint i, sent = 0;
+
+  for (i=0; i < 1000; i++) {
+    if (pwhtb_check(link, 0, PACKET, &wait) == 0) sent++;
+  }
+  return GINT_TO_POINTER(sent);
+}
+
+static void
+htb_threads(void)
+{
+  PwHtb *link = pwhtb_create(10000, 1000000);
+  PwClock *clock = pwclock_new_virtual(0);
+  GThread *threads[HTB_THREADS];
+  gint i, sent = 0;
+
+  pwhtb_set_clock(link, clock);
+  pwhtb_add_class(link, 1000000, 1000000, 0);
+  for (i=0; i < HTB_THREADS; i++) {
+    threads[i] = g_thread_new("htb", htb_thread, link);
+  }
+  for (i=0; i < HTB_THREADS; i++) {
+    sent += GPOINTER_TO_INT(g_thread_join(threads[i]));
+  }
+  printf("threads sent %d\n", sent);
+  pwhtb_destroy(link);
+  pwclock_free(clock);
+}
+
+static void
+htb(void)
+{
+  /* sync, video and overlay: rate, ceiling and priority */
+  static const double rates[][3] = {
+    { 100000, 200000, 0 },
+    { 500000, 1000000, 1 },
+    { 200000, 200000, 2 },
+  };
+  PwHtb *link = pwhtb_create(10000, 1000000);
+  PwClock *clock = pwclock_new_virtual(0);
+  size_t pending[3];
+  guint64 sent[3] = { 0, 0, 0 }, total = 0, wait;
+  guint i;
+
+  pwhtb_set_clock(link, clock);
+  for (i=0; i < 3; i++) {
+    pwhtb_add_class(link, rates[i][0], rates[i][1], rates[i][2]);
+    pending[i] = PACKET;
+  }
+  while (pwclock_now(clock) < 500000000) {
+    int c = pwhtb_next(link, pending, &wait);
+    if (c < 0) {
+      pwclock_advance(clock, wait);
+      continue;
+    }
+    sent[c] += PACKET;
+    total += PACKET;
+  }
+  /* In twentieths */
+  for (i=0; i < 3; i++) {
+    printf("class %u %.2f\n", i, (int)(sent[i] * 20.0 / total + 0.5) / 20.0);
+  }
+  pwhtb_destroy(link);
+  pwclock_free(clock);
+  htb_threads();
+}
+
+static void
+batch(void)
+{
+  PwThrottle *throttle = pwthrottle_create(10000, 1000000);
+  size_t sizes[64];
+  guint64 departures[64], wait = 0;
+  guint i, n;
+
+  for (i=0; i < 64; i++) sizes[i] = PACKET;
+  n = pwthrottle_check_batch(throttle, sizes, 64, &wait, departures);
+  printf("sent %u wait %" G_GUINT64_FORMAT "\n", n, wait);
+  for (i=0; i < n; i++) {
+    printf(" %" G_GUINT64_FORMAT, departures[i]);
+  }
+  printf("\n");
+  n = pwthrottle_check_batch(throttle, sizes, 64, &wait, NULL);
+  printf("sent %u wait %.0fms\n", n, wait * 1e-6);
+  pwthrottle_destroy(throttle);
+}
+
+static void
+pacer_send(gpointer data, size_t nbytes, guint64 txtime_ns, gpointer userdata)
+{
+  guint64 *times = userdata;
+  times[GPOINTER_TO_UINT(data)] = txtime_ns;
+  /* Fall behind by several packets */
+  if (GPOINTER_TO_UINT(data) == 10) g_usleep(5000);
+}
+
+static void
+pacer(void)
+{
+  guint64 times[50];
+  PwPacer *pacer = pwpacer_create(1000000, 100, pacer_send, times);
+  PwPacerStats stats;
+  guint i, spaced = 0;
+
+  for (i=0; i < 50; i++) {
+    pwpacer_push(pacer, GUINT_TO_POINTER(i), PACKET);
+  }
+  do {
+    g_usleep(10000);
+    pwpacer_get_stats(pacer, &stats);
+  } while (stats.packets < 50);
+  pwpacer_destroy(pacer);
+  for (i=1; i < 50; i++) {
+    if (times[i] - times[i-1] >= 1000000) spaced++;
+  }
+  printf("due at least 1ms apart %u\n", spaced);
+  printf("caught up without a burst %s\n",
+	 (times[11] - times[10] >= 5000000) ? "yes" : "no");
+  printf("packets %" G_GUINT64_FORMAT " jitter %s\n", stats.packets,
+	 (stats.jitter_mean_ns <= stats.jitter_max_ns &&
+	  stats.jitter_max_ns <= stats.late_max_ns) ? "ok" : "wrong");
+}
+
+typedef struct {
+  PwThrottle *throttle;
+  GSource *source;
+  GMainLoop *loop;
+  guint dispatches, sent;
+} Writer;
+
+static gboolean
+source_write(gpointer data)
+{
+  Writer *w = data;
+  guint64 wait;
+
+  w->dispatches++;
+  while (w->sent < 20 && pwthrottle_check_ns(w->throttle, PACKET, &wait) == 0) {
+    w->sent++;
+  }
+  if (w->sent < 20) {
+    pwthrottle_source_want(w->source, PACKET);
+  } else {
+    g_main_loop_quit(w->loop);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+source(void)
+{
+  Writer w = { NULL, NULL, NULL, 0, 0 };
+  gint64 start;
+  double msec;
+
+  w.throttle = pwthrottle_create(PACKET, 1000000);
+  w.source = pwthrottle_source_new(w.throttle);
+  w.loop = g_main_loop_new(NULL, FALSE);
+  g_source_set_callback(w.source, source_write, &w, NULL);
+  g_source_attach(w.source, NULL);
+  /* Three writers waiting share one callback */
+  pwthrottle_source_want(w.source, PACKET);
+  pwthrottle_source_want(w.source, PACKET / 2);
+  pwthrottle_source_want(w.source, PACKET);
+  start = g_get_monotonic_time();
+  g_main_loop_run(w.loop);
+  msec = (g_get_monotonic_time() - start) * 1e-3;
+  printf("sent %u dispatches %u\n", w.sent, w.dispatches);
+  printf("time %s\n", (msec >= 18.9) ? "ok" : "early");
+  /* More than the buffer comes once it is empty */
+  pwthrottle_source_want(w.source, PACKET * 4);
+  g_main_loop_run(w.loop);
+  printf("oversize dispatches %u\n", w.dispatches);
+  g_source_destroy(w.source);
+  g_source_unref(w.source);
+  g_main_loop_unref(w.loop);
+  pwthrottle_destroy(w.throttle);
+}
+
+static void
+adapt(void)
+{
+  const double link = 2000000, interval = 0.01;
+  PwThrottle *throttle = pwthrottle_create(10 * PACKET, 1000000);
+  PwRateControl *ctl = pwratectl_create(throttle, 500000, 4000000, 10000);
+  PwRateFeedback feedback = { 0, -1, -1 };
+  double queue = 0, delivered = 0, max_queue = 0, rate;
+  guint i;
+
+  /* Each interval sends at the rate; the link drains what it can */
+  for (i=1; i <= 2000; i++) {
+    double sent = pwthrottle_get_rate(throttle) * interval;
+    double out = MIN(queue + sent, link * interval);
+    queue += sent - out;
+    if (i > 1000) {
+      delivered += out;
+      max_queue = MAX(max_queue, queue);
+    }
+    feedback.queued = (gint64)queue;
+    pwratectl_update(ctl, -1, &feedback, i * 10000000ULL);
+  }
+  printf("utilisation %.2f\n", delivered / (link * 10));
+  printf("queue %s\n", (max_queue < link * interval * 2) ? "bounded" : "grows");
+
+  /* Refused sends bring it down to the floor, and no further */
+  for (i=2001; i <= 2100; i++) {
+    pwratectl_note_eagain(ctl);
+    rate = pwratectl_update(ctl, -1, NULL, i * 10000000ULL);
+  }
+  printf("rate %.0f\n", rate);
+  /* Without congestion it climbs to the ceiling */
+  for (i=2101; i <= 2200; i++) {
+    rate = pwratectl_update(ctl, -1, NULL, i * 10000000ULL);
+  }
+  printf("rate %.0f\n", rate);
+  pwratectl_destroy(ctl);
+  pwthrottle_destroy(throttle);
+}
+
+static void
+edf_drop(gpointer data, gpointer userdata)
+{
+  printf(" drop %s", (const char *)data);
+}
+
+static void
+edf(gboolean chains)
+{
+  /* name, gop, key, deadline in ms from now */
+  static const struct { const char *name; guint gop; int ms; } frames[] = {
+    { "3I", 3, 400 }, { "1P", 1, 200 }, { "2I", 2, -1 },
+    { "2P", 2, 300 }, { "1I", 1, 100 }, { "3P", 3, 500 },
+  };
+  PwThrottle *throttle = pwthrottle_create(10 * PACKET, 1000000);
+  PwFrameSched *sched = pwframesched_create(throttle, chains, edf_drop, NULL);
+  guint64 now = g_get_monotonic_time() * 1000, wait;
+  PwFrameSchedStats stats;
+  const char *name;
+  guint i;
+
+  for (i=0; i < G_N_ELEMENTS(frames); i++) {
+    pwframesched_push(sched, (gpointer)frames[i].name, PACKET,
+		      now + frames[i].ms * 1000000LL, frames[i].gop,
+		      frames[i].name[1] == 'I');
+  }
+  while ((name = pwframesched_next(sched, now, &wait)) != NULL) {
+    printf(" %s", name);
+  }
+  pwframesched_get_stats(sched, &stats);
+  printf("\nsent %" G_GUINT64_FORMAT " missed %" G_GUINT64_FORMAT
+	 " chained %" G_GUINT64_FORMAT "\n",
+	 stats.sent, stats.missed, stats.chained);
+  pwframesched_destroy(sched);
+  pwthrottle_destroy(throttle);
+}
+
+typedef struct {
+  GString *data;
+  guint writes;
+  const void *last;		/* Where the last write came from */
+} Sink;
+
+static gboolean
+sink_write(void *priv, const void *data, gsize len, GError **error)
+{
+  Sink *sink = priv;
+  g_string_append_len(sink->data, data, len);
+  sink->writes++;
+  sink->last = data;
+  return TRUE;
+}
+
+static const pw_MIWrite sink_miwrite = {
+  sizeof(sink_miwrite),
+  &sink_write,
+  NULL,
+};
+
+static void
+write_result(const char *what, gboolean ok, GError **error)
+{
+  printf("%s %s\n", what, ok ? "ok" : (*error)->message);
+  g_clear_error(error);
+}
+
+static void
+throttled_write(void)
+{
+  static const char header[] = "header", trailer[] = "trailer";
+  Sink sink = { NULL, 0, NULL };
+  pw_IWrite inner = { &sink_miwrite, &sink };
+  PwThrottle *throttle = pwthrottle_create(4 * PACKET, 1000000);
+  PwClock *vclock = pwclock_new_virtual(0);
+  PwThrottleWrite *w = pwthrottle_write_new(&inner, throttle, 1500);
+  const pw_IWrite *iface = pwthrottle_write_iface(w);
+  gchar *data = g_strnfill(10 * PACKET, 'x');
+  struct iovec iov[3];
+  GError *error = NULL;
+  gint64 start;
+  gboolean ok;
+
+  /* Sleeps for all but the first buffer-full */
+  sink.data = g_string_new(NULL);
+  start = g_get_monotonic_time();
+  ok = PW_CALL(iface, write, data, 10 * PACKET, &error);
+  printf("wrote %" G_GSIZE_FORMAT " in %u, same %s, %s\n",
+	 sink.data->len, sink.writes,
+	 (strcmp(sink.data->str, data) == 0) ? "yes" : "no",
+	 (g_get_monotonic_time() - start >= 5900) ? "waited" : "early");
+  write_result("blocking", ok, &error);
+
+  /* On virtual time, which cannot be waited for, then without
+   * blocking */
+  pwthrottle_set_clock(throttle, vclock);
+  write_result("first", PW_CALL(iface, write, data, 3 * PACKET, &error),
+	       &error);
+  write_result("virtual", PW_CALL(iface, write, data, 1500, &error), &error);
+  pwthrottle_write_set_nonblock(w, TRUE);
+  write_result("second", PW_CALL(iface, write, data, 1500, &error), &error);
+  pwclock_advance(vclock, 1000000);
+  write_result("later", PW_CALL(iface, write, data, 1500, &error), &error);
+  write_result("huge", PW_CALL(iface, write, data, 5 * PACKET, &error),
+	       &error);
+
+  /* Buffers are passed on as they are */
+  pwclock_advance(vclock, 10000000);
+  sink.writes = 0;
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = strlen(header);
+  iov[1].iov_base = data;
+  iov[1].iov_len = 2 * PACKET;
+  iov[2].iov_base = (void *)trailer;
+  iov[2].iov_len = strlen(trailer);
+  ok = pwthrottle_write_writev(w, iov, 3, &error);
+  printf("writev in %u, last %s\n", sink.writes,
+	 (sink.last == trailer) ? "uncopied" : "copied");
+  write_result("writev", ok, &error);
+
+  pwthrottle_write_free(w);
+  pwthrottle_destroy(throttle);
+  pwclock_free(vclock);
+  g_string_free(sink.data, TRUE);
+  g_free(data);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "--htb") == 0) {
+    htb();
+  } else if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+    batch();
+  } else if (argc > 1 && strcmp(argv[1], "--pacer") == 0) {
+    pacer();
+  } else if (argc > 1 && strcmp(argv[1], "--source") == 0) {
+    source();
+  } else if (argc > 1 && strcmp(argv[1], "--adapt") == 0) {
+    adapt();
+  } else if (argc > 1 && strcmp(argv[1], "--edf") == 0) {
+    edf(TRUE);
+    edf(FALSE);
+  } else if (argc > 1 && strcmp(argv[1], "--write") == 0) {
+    throttled_write();
+  }
+  return 0;
+}
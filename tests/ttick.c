@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <time.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Check timestamps against the clock */
+
+static guint64
+clock_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (guint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+check(const char *what, const PwTickCalibration *cal, gint64 tolerance)
+{
+  guint64 before = clock_ns();
+  guint64 ns = pwtick_to_ns(pwtick_now(), cal);
+  guint64 after = clock_ns();
+  if (ns + tolerance < before || ns > after + tolerance) {
+    printf("FAIL %s: %" G_GINT64_FORMAT " ns out\n", what,
+	   (gint64)(ns < before ? before - ns : ns - after));
+  } else {
+    printf("ok %s\n", what);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  PwTickCalibration cal;
+  guint64 last, now;
+  guint i;
+  gboolean monotonic = TRUE;
+
+  if (argc > 1) printf("source %s\n", pwtick_source());
+
+  last = pwtick_now();
+  for (i=0; i < 100000; i++) {
+    now = pwtick_now();
+    if (now < last) monotonic = FALSE;
+    last = now;
+  }
+  printf("%s monotonic\n", monotonic ? "ok" : "FAIL");
+
+  /* Rate from start-up measurement */
+  pwtick_calibrate(&cal);
+  g_usleep(200000);
+  check("initial rate", &cal, 1000000);
+
+  /* Rate refined over a longer time */
+  pwtick_calibrate(&cal);
+  g_usleep(200000);
+  check("refined rate", &cal, 100000);
+  return 0;
+}
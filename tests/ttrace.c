@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <glib.h>
+#include <pwutil.h>
+
+/* Trace the same records from several threads, in whichever mode
+ * TT_TRACEFORMAT selects, so that the outputs can be compared.
+ * With --spans, nested spans and counters instead.  --dump, --usr2
+ * and --abort ask a flight recorder for a dump at the end.  --clock
+ * stamps the records after the first two 12.5s on a virtual clock. */
+
+#define NTHREADS 4
+#define NRECORDS 200
+
+static PwTrace *trace;
+static PwTraceFormat *ints;
+static gboolean slow = FALSE;
+static gboolean serial = FALSE;
+static gboolean spans = FALSE;
+static gboolean dump = FALSE;
+static gboolean usr2 = FALSE;
+static gboolean crash = FALSE;
+static PwClock *vclock = NULL;
+
+/* A frame's stages, as on a tile */
+static gpointer
+span_worker(gpointer data)
+{
+  guint n = GPOINTER_TO_UINT(data);
+  gchar *name = g_strdup_printf("worker %u", n);
+  guint i;
+
+  pwtrace_thread_name(name);
+  g_free(name);
+  for (i=0; i < NRECORDS / 4; i++) {
+    pwtrace_begin(trace, "frame");
+    pwtrace_begin(trace, "decode");
+    pwtracef(trace, "uu", n, i);
+    pwtrace_end(trace, "decode");
+    pwtrace_counter(trace, "queue", i % 3);
+    pwtrace_end(trace, "frame");
+  }
+  return NULL;
+}
+
+static gpointer
+worker(gpointer data)
+{
+  static const guchar bytes[] = {0x00, 0x7f, 0x80, 0xff, 0x12};
+  guint n = GPOINTER_TO_UINT(data);
+  guint i;
+
+  for (i=0; i < NRECORDS; i++) {
+    switch (i % 4) {
+    case 0:
+      PWTRACE(trace, "uix", n, -(gint)i, i * 0x1001);
+      break;
+    case 1:
+      pwtracef(trace, "u2s", n, "thread", (i % 8 == 1) ? NULL : "");
+      break;
+    case 2:
+      pwtracef(trace, "u*b", n, i % 5 + 1, bytes);
+      break;
+    case 3:
+      pwtrace_emit(trace, ints, n, 1, -2, 3);
+      break;
+    }
+    /* Give the writer time to empty a small ring */
+    if (slow && i % 4 == 3) g_usleep(2000);
+  }
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  GThread *threads[NTHREADS];
+  guint i;
+
+  for (i=1; i < argc; i++) {
+    if (strcmp(argv[i], "--slow") == 0) {
+      slow = TRUE;
+    } else if (strcmp(argv[i], "--serial") == 0) {
+      /* Text lines from concurrent threads can interleave */
+      serial = TRUE;
+    } else if (strcmp(argv[i], "--spans") == 0) {
+      spans = TRUE;
+    } else if (strcmp(argv[i], "--dump") == 0) {
+      dump = TRUE;
+    } else if (strcmp(argv[i], "--usr2") == 0) {
+      usr2 = TRUE;
+    } else if (strcmp(argv[i], "--abort") == 0) {
+      crash = TRUE;
+    } else if (strcmp(argv[i], "--clock") == 0) {
+      vclock = pwclock_new_virtual(12500000000ULL);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  trace = pwtrace_open("TT");
+  if (trace == NULL) {
+    fprintf(stderr, "TT_TRACEFILE not set\n");
+    return 2;
+  }
+  ints = pwtrace_register_format("u3iq");
+  if (! spans) {
+    /* Counts with nothing to count */
+    pwtracef(trace, "u2", 7);
+    pwtracef(trace, "u*", 7, 3);
+  }
+  if (vclock != NULL) pwtrace_set_clock(trace, vclock);
+  for (i=0; i < NTHREADS; i++) {
+    threads[i] = g_thread_new("worker", spans ? span_worker : worker,
+			      GUINT_TO_POINTER(i));
+    if (serial) g_thread_join(threads[i]);
+  }
+  if (! serial) {
+    for (i=0; i < NTHREADS; i++) {
+      g_thread_join(threads[i]);
+    }
+  }
+  if (dump && ! pwtrace_dump(trace, NULL)) {
+    fprintf(stderr, "Dump failed\n");
+  }
+  if (usr2) raise(SIGUSR2);
+  if (crash) abort();
+  pwtrace_close(trace);
+  return 0;
+}